@@ -0,0 +1,197 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agg.h"
+#include "banned.h"
+
+/*
+ * Aggregation of repeated requests. Every receiving thread owns a table,
+ * the mutex only has to keep it consistent with the periodic flush. An
+ * entry lives within AGG_PROBES slots of its home slot. Nothing is ever
+ * deleted in between flushes, so a probe can stop at the first free slot.
+ * When all slots of the window are taken, the entry seen least recently
+ * is evicted (emitted early) to make room, which keeps memory bounded no
+ * matter how many sources show up.
+ */
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline uint64_t
+fnv(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return (h);
+}
+
+/*
+ * address bytes of src and their length
+ */
+static inline const void *
+agg_addr(const struct sockaddr *src, size_t *len)
+{
+	if (src->sa_family == AF_INET6) {
+		*len = sizeof(struct in6_addr);
+		return (&((const struct sockaddr_in6 *)src)->sin6_addr);
+	}
+	*len = sizeof(struct in_addr);
+	return (&((const struct sockaddr_in *)src)->sin_addr);
+}
+
+static inline bool
+agg_match(const struct agg_entry *e, const void *addr, size_t alen, int family, int proto,
+    const char *key, size_t keylen)
+{
+	const void *eaddr;
+	size_t	    elen;
+
+	if (e->src.sa.sa_family != family || e->proto != proto || e->keylen != keylen)
+		return (false);
+	eaddr = agg_addr(&e->src.sa, &elen);
+	return (memcmp(eaddr, addr, alen) == 0 && memcmp(e->key, key, keylen) == 0);
+}
+
+/*
+ * create a table of nentries (rounded up to a power of two) entries
+ */
+struct agg *
+agg_new(size_t nentries, agg_emit_t emit, void *arg)
+{
+	struct agg *agg;
+	size_t	    size;
+
+	for (size = AGG_PROBES; size < nentries; size <<= 1)
+		;
+
+	if ((agg = calloc(1, sizeof(*agg))) == NULL)
+		return (NULL);
+	agg->tags    = calloc(size, sizeof(*agg->tags));
+	agg->entries = malloc(size * sizeof(*agg->entries));
+	if (agg->tags == NULL || agg->entries == NULL) {
+		free(agg->tags);
+		free(agg->entries);
+		free(agg);
+		return (NULL);
+	}
+	agg->mask = size - 1;
+	agg->emit = emit;
+	agg->arg  = arg;
+	pthread_mutex_init(&agg->lock, NULL);
+
+	return (agg);
+}
+
+/*
+ * Count a request from src. key is cut to AGG_KEYLEN bytes, now is the
+ * time it was received.
+ */
+void
+agg_add(struct agg *agg, const struct sockaddr *src, int proto, const char *key,
+    size_t keylen, time_t now)
+{
+	struct agg_entry *e;
+	const void *	  addr;
+	size_t		  alen, slot, oldest = 0;
+	uint64_t	  h;
+	uint32_t	  tag;
+	int		  i;
+
+	if (keylen > AGG_KEYLEN)
+		keylen = AGG_KEYLEN;
+	addr = agg_addr(src, &alen);
+	h    = fnv(FNV_OFFSET, addr, alen);
+	h    = fnv(h, &proto, sizeof(proto));
+	h    = fnv(h, key, keylen);
+	tag  = (uint32_t)(h >> 32) | 1;
+
+	pthread_mutex_lock(&agg->lock);
+	slot = h & agg->mask;
+	for (i = 0; i < AGG_PROBES; i++, slot = (slot + 1) & agg->mask) {
+		if (agg->tags[slot] == 0)
+			break;
+		e = &agg->entries[slot];
+		if (agg->tags[slot] == tag &&
+		    agg_match(e, addr, alen, src->sa_family, proto, key, keylen)) {
+			e->count++;
+			e->last = now;
+			pthread_mutex_unlock(&agg->lock);
+			return;
+		}
+		if (i == 0 || e->last < agg->entries[oldest].last)
+			oldest = slot;
+	}
+
+	if (i == AGG_PROBES) {
+		slot = oldest;
+		agg->emit(&agg->entries[slot], agg->arg);
+		agg->evictions++;
+	} else {
+		agg->used++;
+	}
+
+	e = &agg->entries[slot];
+	memset(&e->src, 0, sizeof(e->src));
+	if (src->sa_family == AF_INET6) {
+		memcpy(&e->src.sin6, src, sizeof(e->src.sin6));
+		e->src.sin6.sin6_port = 0;
+	} else {
+		memcpy(&e->src.sin, src, sizeof(e->src.sin));
+		e->src.sin.sin_port = 0;
+	}
+	e->count  = 1;
+	e->first  = now;
+	e->last	  = now;
+	e->proto  = proto;
+	e->keylen = keylen;
+	memcpy(e->key, key, keylen);
+	agg->tags[slot] = tag;
+
+	pthread_mutex_unlock(&agg->lock);
+}
+
+/*
+ * emit every entry and empty the table
+ */
+void
+agg_flush(struct agg *agg)
+{
+	pthread_mutex_lock(&agg->lock);
+	for (size_t slot = 0; slot <= agg->mask && agg->used > 0; slot++) {
+		if (agg->tags[slot] == 0)
+			continue;
+		agg->emit(&agg->entries[slot], agg->arg);
+		agg->tags[slot] = 0;
+		agg->used--;
+	}
+	pthread_mutex_unlock(&agg->lock);
+}
@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _AGG_H
+#define _AGG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define AGG_KEYLEN 64	  /* longer keys are cut, and aggregated together */
+#define AGG_PROBES 16	  /* slots an entry may be placed away from its home */
+#define AGG_ENTRIES 4096  /* default table size */
+
+/*
+ * Requests seen from one source with the same protocol and key (method or
+ * first line) since the last flush.
+ */
+struct agg_entry {
+	uint64_t count;
+	time_t	 first; /* first and last seen */
+	time_t	 last;
+	union {
+		struct sockaddr	    sa;
+		struct sockaddr_in  sin;
+		struct sockaddr_in6 sin6;
+	} src; /* port is cleared */
+	uint8_t	 proto;
+	uint8_t	 keylen;
+	char	 key[AGG_KEYLEN];
+};
+
+/* called with every entry that is flushed or evicted */
+typedef void (*agg_emit_t)(const struct agg_entry *entry, void *arg);
+
+/*
+ * A fixed size, open-addressing hash table of entries. A small array of
+ * hash tags is probed linearly, so a lookup touches one or two cache lines
+ * of tags and only the entries whose tag matches.
+ */
+struct agg {
+	uint32_t *	  tags; /* 0 for a free slot */
+	struct agg_entry *entries;
+	size_t		  mask;
+	size_t		  used;
+	agg_emit_t	  emit;
+	void *		  arg;
+	uint64_t	  evictions;
+	pthread_mutex_t	  lock;
+};
+
+struct agg *agg_new(size_t nentries, agg_emit_t emit, void *arg);
+void	    agg_add(struct agg *agg, const struct sockaddr *src, int proto, const char *key,
+	       size_t keylen, time_t now);
+void	    agg_flush(struct agg *agg);
+
+#endif /* _AGG_H */
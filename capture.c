@@ -0,0 +1,374 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "capture.h"
+#include "metrics.h"
+
+/*
+ * Passive capture: SIP over UDP and TCP to a set of ports, read from an
+ * mmap()ed TPACKET_V3 ring of an AF_PACKET socket. The kernel fills whole
+ * blocks of packets and hands them over at once, so a busy ring costs one
+ * poll() per block rather than a system call per packet, and payloads are
+ * processed in place. A BPF filter drops everything else in the kernel.
+ *
+ * The socket is a SOCK_DGRAM packet socket, so packets start at the IP
+ * header whatever the link layer. It joins a fanout group with
+ * PACKET_FANOUT_FLAG_DEFRAG, which spreads flows over several capture
+ * threads and reassembles fragmented UDP requests. TCP segments are
+ * handled one at a time, without stream reassembly, and IPv6 packets
+ * with extension headers are not looked into.
+ */
+
+struct cap {
+	int		   fd;
+	unsigned char *	   ring;
+	struct tpacket_req3 req;
+	unsigned int	   block; /* next block to read */
+	struct cap_ports   ports;
+	char		   spare[65536 + 1]; /* for payloads ending at the end of a block */
+};
+
+static bool
+cap_port(const struct cap_ports *p, uint16_t port)
+{
+	return (p->map[port >> 3] & (1 << (port & 7)));
+}
+
+/*
+ * parse a list of ports and ranges, e.g. "5060-5080,5090,10000-20000"
+ */
+int
+cap_ports(struct cap_ports *p, const char *spec)
+{
+	const char *s = spec;
+	char *	    end;
+	long	    lo, hi;
+
+	memset(p, 0, sizeof(*p));
+	while (*s != '\0') {
+		lo = hi = strtol(s, &end, 10);
+		if (end != s && *end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if (end == s || (*end != ',' && *end != '\0') || lo < 1 || hi > 65535 || lo > hi ||
+		    p->n == CAP_MAXRANGES) {
+			errno = EINVAL;
+			return (-1);
+		}
+		p->lo[p->n]   = lo;
+		p->hi[p->n++] = hi;
+		for (long port = lo; port <= hi; port++)
+			p->map[port >> 3] |= 1 << (port & 7);
+		s = *end == ',' ? end + 1 : end;
+	}
+	if (p->n == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Attach a BPF program passing IPv4 and IPv6 UDP and TCP packets whose
+ * destination port is in one of the ranges.
+ */
+static int
+cap_filter(int fd, const struct cap_ports *p)
+{
+	struct sock_filter prog[16 + 2 * CAP_MAXRANGES];
+	struct sock_fprog  fprog;
+	int		   ports = 14, drop = ports + 2 * p->n, n = 0;
+
+#define INSN(code, jt, jf, k)                                          \
+	do {                                                           \
+		struct sock_filter insn = BPF_JUMP(code, k, jt, jf); \
+		prog[n++]		= insn;                        \
+	} while (0)
+	INSN(BPF_LD | BPF_B | BPF_ABS, 0, 0, 0);      /* 0: version */
+	INSN(BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 4);
+	INSN(BPF_LD | BPF_B | BPF_ABS, 0, 0, 9);      /* 3: IPv4 protocol */
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, IPPROTO_UDP);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, drop - 6, IPPROTO_TCP);
+	INSN(BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0);     /* 6: header length */
+	INSN(BPF_LD | BPF_H | BPF_IND, 0, 0, 2);      /* destination port */
+	INSN(BPF_JMP | BPF_JA, 0, 0, ports - 9);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, drop - 10, 6); /* 9: IPv6 */
+	INSN(BPF_LD | BPF_B | BPF_ABS, 0, 0, 6);	 /* next header */
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, IPPROTO_UDP);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, drop - 13, IPPROTO_TCP);
+	INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 42);     /* destination port */
+	for (int i = 0; i < p->n; i++) {
+		/* 14 + 2i: below the range tries the next one, within it accepts */
+		INSN(BPF_JMP | BPF_JGE | BPF_K, 0, 1, p->lo[i]);
+		INSN(BPF_JMP | BPF_JGT | BPF_K, 0, drop - n, p->hi[i]);
+	}
+	INSN(BPF_RET | BPF_K, 0, 0, 0);		/* drop */
+	INSN(BPF_RET | BPF_K, 0, 0, 0x40000);	/* accept */
+#undef INSN
+
+	fprog.len    = n;
+	fprog.filter = prog;
+	return (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)));
+}
+
+/*
+ * Open a capture of ports on interface ifname, in fanout group group
+ * (shared by the capture threads of one process). Returns NULL and sets
+ * errno on failure.
+ */
+struct cap *
+cap_open(const char *ifname, const struct cap_ports *ports, int group)
+{
+	struct sockaddr_ll sll;
+	struct cap *	   c;
+	int		   version = TPACKET_V3, fanout, saved;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return (NULL);
+	c->ports = *ports;
+	c->fd	 = -1;
+	c->ring	 = MAP_FAILED;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family	 = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if (strcmp(ifname, "any") != 0 && (sll.sll_ifindex = if_nametoindex(ifname)) == 0)
+		goto fail;
+	if ((c->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		goto fail;
+
+	/* filter before binding, so nothing else gets into the ring */
+	c->req.tp_block_size	   = CAP_BLOCKSIZE;
+	c->req.tp_block_nr	   = CAP_BLOCKS;
+	c->req.tp_frame_size	   = CAP_FRAMESIZE;
+	c->req.tp_frame_nr	   = CAP_BLOCKSIZE / CAP_FRAMESIZE * CAP_BLOCKS;
+	c->req.tp_retire_blk_tov = CAP_TIMEOUT;
+	if (cap_filter(c->fd, ports) < 0 ||
+	    setsockopt(c->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+	    setsockopt(c->fd, SOL_PACKET, PACKET_RX_RING, &c->req, sizeof(c->req)) < 0)
+		goto fail;
+	c->ring = mmap(NULL, (size_t)CAP_BLOCKSIZE * CAP_BLOCKS, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, c->fd, 0);
+	if (c->ring == MAP_FAILED)
+		goto fail;
+	if (bind(c->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		goto fail;
+
+	fanout = (group & 0xffff) | (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16;
+	if (setsockopt(c->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+		goto fail;
+	return (c);
+
+fail:
+	saved = errno;
+	if (c->ring != MAP_FAILED)
+		munmap(c->ring, (size_t)CAP_BLOCKSIZE * CAP_BLOCKS);
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c);
+	errno = saved;
+	return (NULL);
+}
+
+/*
+ * Hand the SIP payload of a packet starting at its IP header to fn. The
+ * byte after the payload is set to NUL meanwhile, unless that would be
+ * past end, the end of the block, in which case the payload is copied.
+ */
+static bool
+cap_packet(struct cap *c, unsigned char *pkt, size_t len, const unsigned char *end, cap_fn fn)
+{
+	union {
+		struct sockaddr	    sa;
+		struct sockaddr_in  sin;
+		struct sockaddr_in6 sin6;
+	} src;
+	const struct ip *     ip  = (const struct ip *)pkt;
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *)pkt;
+	const struct udphdr * uh;
+	const struct tcphdr * th;
+	unsigned char *	      l4, *payload, saved;
+	size_t		      hlen, plen;
+	int		      proto;
+
+	memset(&src, 0, sizeof(src));
+	if (len >= sizeof(*ip) && ip->ip_v == 4) {
+		hlen = ip->ip_hl * 4;
+		if (hlen < sizeof(*ip) || (ntohs(ip->ip_off) & IP_OFFMASK) != 0)
+			return (false);
+		len		     = MIN(len, ntohs(ip->ip_len));
+		proto		     = ip->ip_p;
+		src.sin.sin_family = AF_INET;
+		src.sin.sin_addr   = ip->ip_src;
+	} else if (len >= sizeof(*ip6) && ip->ip_v == 6) {
+		hlen		      = sizeof(*ip6);
+		len		      = MIN(len, hlen + ntohs(ip6->ip6_plen));
+		proto		      = ip6->ip6_nxt;
+		src.sin6.sin6_family = AF_INET6;
+		src.sin6.sin6_addr   = ip6->ip6_src;
+	} else {
+		return (false);
+	}
+	if (len < hlen)
+		return (false);
+	l4 = pkt + hlen;
+	len -= hlen;
+
+	if (proto == IPPROTO_UDP && len >= sizeof(*uh)) {
+		uh	= (const struct udphdr *)l4;
+		payload = l4 + sizeof(*uh);
+		plen	= MIN(len, MAX(ntohs(uh->uh_ulen), sizeof(*uh))) - sizeof(*uh);
+		if (!cap_port(&c->ports, ntohs(uh->uh_dport)))
+			return (false);
+		src.sin.sin_port = uh->uh_sport; /* same offset in sockaddr_in6 */
+		proto		 = SOCK_DGRAM;
+	} else if (proto == IPPROTO_TCP && len >= sizeof(*th)) {
+		th = (const struct tcphdr *)l4;
+		if (th->th_off * 4U < sizeof(*th) || th->th_off * 4U > len ||
+		    !cap_port(&c->ports, ntohs(th->th_dport)))
+			return (false);
+		payload		 = l4 + th->th_off * 4;
+		plen		 = len - th->th_off * 4;
+		src.sin.sin_port = th->th_sport;
+		proto		 = SOCK_STREAM;
+	} else {
+		return (false);
+	}
+	if (plen == 0) /* handshakes, ACKs */
+		return (false);
+
+	if (payload + plen >= end) {
+		memcpy(c->spare, payload, plen);
+		c->spare[plen] = '\0';
+		fn(src.sa.sa_family, &src.sa, proto, c->spare, plen);
+	} else {
+		saved	      = payload[plen];
+		payload[plen] = '\0';
+		fn(src.sa.sa_family, &src.sa, proto, (char *)payload, plen);
+		payload[plen] = saved;
+	}
+	return (true);
+}
+
+/*
+ * kernel ring statistics, reset whenever they are read
+ */
+static void
+cap_stats(struct cap *c)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t		len = sizeof(st);
+
+	if (getsockopt(c->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		metric_add(M_CAP_DROPS, st.tp_drops);
+}
+
+/*
+ * wait until the kernel hands over the next block, -1 if polling failed
+ */
+int
+cap_wait(struct cap *c)
+{
+	struct tpacket_block_desc *bd;
+	struct pollfd		   pfd = { .fd = c->fd, .events = POLLIN | POLLERR };
+
+	bd = (struct tpacket_block_desc *)(c->ring + (size_t)c->block * CAP_BLOCKSIZE);
+	while (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Wait for the next block of packets and feed what it holds to fn, then
+ * give it back to the kernel. Returns the number of payloads passed on,
+ * -1 if waiting failed.
+ */
+int
+cap_next(struct cap *c, cap_fn fn)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *	   hdr;
+	struct sockaddr_ll *	   sll;
+	unsigned char *		   end;
+	uint64_t		   bytes = 0;
+	int			   n = 0, npkts;
+
+	if (cap_wait(c) < 0)
+		return (-1);
+	bd = (struct tpacket_block_desc *)(c->ring + (size_t)c->block * CAP_BLOCKSIZE);
+
+	end   = (unsigned char *)bd + CAP_BLOCKSIZE;
+	npkts = bd->hdr.bh1.num_pkts;
+	hdr   = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (int i = 0; i < npkts; i++) {
+		sll = (struct sockaddr_ll *)((unsigned char *)hdr +
+		    TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		/* loopback traffic shows up once on the way out and once on the way in */
+		if (sll->sll_pkttype != PACKET_OUTGOING &&
+		    cap_packet(c, (unsigned char *)hdr + hdr->tp_net, hdr->tp_snaplen, end, fn)) {
+			bytes += hdr->tp_snaplen;
+			n++;
+		}
+		hdr = (struct tpacket3_hdr *)((unsigned char *)hdr + hdr->tp_next_offset);
+	}
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	c->block = (c->block + 1) % CAP_BLOCKS;
+
+	metric_add(M_CAP_BLOCKS, 1);
+	metric_add(M_CAP_PACKETS, npkts);
+	metric_add(M_CAP_PAYLOADS, n);
+	metric_add(M_CAP_BYTES, bytes);
+	cap_stats(c);
+	return (n);
+}
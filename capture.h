@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdint.h>
+
+#define CAP_PORTS "5060-5080" /* SIP and the ports scanners sweep next to it */
+#define CAP_MAXRANGES 64      /* port ranges, bounded by BPF jump offsets */
+#define CAP_BLOCKSIZE (1 << 20)
+#define CAP_BLOCKS 32
+#define CAP_FRAMESIZE 2048
+#define CAP_TIMEOUT 10 /* msecs until the kernel hands over a partly filled block */
+
+/* destination ports to capture, as ranges (for the BPF filter) and a bitmap */
+struct cap_ports {
+	int	 n;
+	uint16_t lo[CAP_MAXRANGES];
+	uint16_t hi[CAP_MAXRANGES];
+	uint8_t	 map[65536 / 8];
+};
+
+/* receives the payload of a captured packet, as process_request() does */
+typedef void (*cap_fn)(int af, struct sockaddr *src, int proto, char *payload, size_t len);
+
+struct cap;
+
+int	    cap_ports(struct cap_ports *p, const char *spec);
+struct cap *cap_open(const char *ifname, const struct cap_ports *ports, int group);
+int	    cap_wait(struct cap *c);
+int	    cap_next(struct cap *c, cap_fn fn);
+
+#endif /* _CAPTURE_H */
@@ -0,0 +1,345 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "banned.h"
+#include "conn.h"
+#include "metrics.h"
+
+/*
+ * Client connections of a TCP thread: a fixed array of slots, a pool of
+ * read buffers and a timer wheel. A client is closed once it has been
+ * silent for the idle time, or when its request is not complete within
+ * the timeout however slowly it keeps sending. When every slot is taken,
+ * the oldest client makes room for the new one. A connection only gets a
+ * buffer once it has something to read, so a flood of connections that
+ * never send anything costs a slot each and nothing else.
+ */
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_SPAN (1ULL << (TW_BITS * TW_LEVELS)) /* ticks covered by the wheel */
+
+void
+tw_init(struct twheel *w, uint64_t now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+/*
+ * put a timer in the slot of the lowest level that reaches its expiry
+ */
+static void
+tw_link(struct twheel *w, struct tw_timer *t)
+{
+	struct tw_timer **slot;
+	uint64_t	  delta = t->expires - w->now;
+	int		  level = 0;
+
+	while (level < TW_LEVELS - 1 && delta >= 1ULL << (TW_BITS * (level + 1)))
+		level++;
+	slot = &w->slot[level][(t->expires >> (TW_BITS * level)) & TW_MASK];
+	if ((t->next = *slot) != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot	 = t;
+}
+
+/*
+ * arm timer t to expire at tick expires (now if it is past already)
+ */
+void
+tw_add(struct twheel *w, struct tw_timer *t, uint64_t expires)
+{
+	if (expires < w->now)
+		expires = w->now;
+	if (expires - w->now >= TW_SPAN)
+		expires = w->now + TW_SPAN - 1;
+	t->expires = expires;
+	tw_link(w, t);
+	w->count++;
+}
+
+void
+tw_del(struct twheel *w, struct tw_timer *t)
+{
+	if (t->pprev == NULL)
+		return;
+	if ((*t->pprev = t->next) != NULL)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+	w->count--;
+}
+
+/*
+ * The wheel moved on to a new tick. Whenever the slots of a level wrapped
+ * around, the next slot of the level above is spread over the levels below.
+ */
+static void
+tw_cascade(struct twheel *w)
+{
+	struct tw_timer *t, *next;
+
+	for (int level = 1; level < TW_LEVELS; level++) {
+		if (((w->now >> (TW_BITS * (level - 1))) & TW_MASK) != 0)
+			break;
+		t = w->slot[level][(w->now >> (TW_BITS * level)) & TW_MASK];
+		w->slot[level][(w->now >> (TW_BITS * level)) & TW_MASK] = NULL;
+		for (; t != NULL; t = next) {
+			next = t->next;
+			tw_link(w, t);
+		}
+	}
+}
+
+/*
+ * Turn the wheel up to tick now, one due timer at a time: returns the next
+ * timer due by now (no longer armed), or NULL once there are none left.
+ */
+struct tw_timer *
+tw_expire(struct twheel *w, uint64_t now)
+{
+	struct tw_timer *t;
+
+	while (1) {
+		if ((t = w->slot[0][w->now & TW_MASK]) != NULL) {
+			tw_del(w, t);
+			return (t);
+		}
+		if (w->now >= now)
+			return (NULL);
+		if (w->count == 0) {
+			w->now = now;
+			return (NULL);
+		}
+		w->now++;
+		tw_cascade(w);
+	}
+}
+
+/*
+ * monotonic msecs, good enough for timeouts
+ */
+uint64_t
+conn_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* first tick at or after msecs */
+static uint64_t
+conn_tick(uint64_t msecs)
+{
+	return ((msecs + TW_TICK - 1) / TW_TICK);
+}
+
+/*
+ * Table of size connections with bufsize byte buffers, closing clients
+ * silent for idle msecs or still sending their request after timeout
+ * msecs through expired. Callers that close connections asynchronously
+ * ask for spare slots, so that an evicted connection does not have to
+ * be gone before its slot is needed.
+ */
+struct conn_table *
+conn_table_new(unsigned int size, unsigned int spare, size_t bufsize, unsigned int idle,
+    unsigned int timeout, conn_fn expired, void *arg)
+{
+	struct conn_table *t;
+	unsigned int	   n = size + spare;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+	if ((t->conns = calloc(n, sizeof(*t->conns))) == NULL) {
+		free(t);
+		return (NULL);
+	}
+	for (unsigned int i = 0; i < n; i++)
+		t->conns[i].newer = i + 1 < n ? &t->conns[i + 1] : NULL;
+	t->free	   = &t->conns[0];
+	t->size	   = size;
+	t->spare   = spare;
+	t->bufsize = MAX(bufsize, sizeof(char *));
+	t->idle	   = idle;
+	t->timeout = timeout;
+	t->expired = expired;
+	t->arg	   = arg;
+	tw_init(&t->wheel, conn_tick(conn_now()));
+	return (t);
+}
+
+/*
+ * Take a slot for a new client, evicting the oldest one if the table is
+ * full. Returns NULL if even the spare slots are taken.
+ */
+struct conn *
+conn_new(struct conn_table *t, uint64_t now)
+{
+	struct conn *c;
+
+	if (t->used - t->ndetached >= t->size && t->oldest != NULL) {
+		metric_add(M_TCP_EVICTED, 1);
+		t->expired(t, t->oldest, CONN_EVICTED);
+	}
+	if ((c = t->free) == NULL)
+		return (NULL);
+	t->free = c->newer;
+
+	memset(c, 0, sizeof(*c));
+	c->fd	    = -1;
+	c->deadline = now + t->timeout;
+	if ((c->older = t->newest) != NULL)
+		c->older->newer = c;
+	else
+		t->oldest = c;
+	t->newest = c;
+	tw_add(&t->wheel, &c->timer, conn_tick(MIN(now + t->idle, c->deadline)));
+	t->used++;
+	return (c);
+}
+
+/*
+ * the read buffer of a connection, taken from the pool on first use
+ */
+char *
+conn_buf(struct conn_table *t, struct conn *c)
+{
+	char * slab;
+	size_t n;
+
+	if (c->buf != NULL)
+		return (c->buf);
+	if (t->freebufs == NULL) {
+		n = MIN(CONN_SLAB, t->size + t->spare - t->nbufs);
+		if (n == 0 || (slab = malloc(n * t->bufsize)) == NULL)
+			return (NULL);
+		for (size_t i = 0; i < n; i++) {
+			*(char **)(slab + i * t->bufsize) = t->freebufs;
+			t->freebufs			  = slab + i * t->bufsize;
+		}
+		t->nbufs += n;
+		metric_add(M_TCP_BUFFERS, n);
+	}
+	c->buf	    = t->freebufs;
+	t->freebufs = *(char **)c->buf;
+	return (c->buf);
+}
+
+/*
+ * a client sent something, give it the idle time again (but no more than
+ * what is left until its deadline)
+ */
+void
+conn_touch(struct conn_table *t, struct conn *c, uint64_t now)
+{
+	if (c->detached)
+		return;
+	tw_del(&t->wheel, &c->timer);
+	tw_add(&t->wheel, &c->timer, conn_tick(MIN(now + t->idle, c->deadline)));
+}
+
+/*
+ * stop timing a connection and take it out of the eviction order, for a
+ * connection that is being closed but still holds its slot
+ */
+void
+conn_detach(struct conn_table *t, struct conn *c)
+{
+	if (c->detached)
+		return;
+	tw_del(&t->wheel, &c->timer);
+	if (c->older != NULL)
+		c->older->newer = c->newer;
+	else
+		t->oldest = c->newer;
+	if (c->newer != NULL)
+		c->newer->older = c->older;
+	else
+		t->newest = c->older;
+	c->detached = true;
+	t->ndetached++;
+}
+
+/*
+ * release the slot and buffer of a closed connection
+ */
+void
+conn_put(struct conn_table *t, struct conn *c)
+{
+	conn_detach(t, c);
+	t->ndetached--;
+	if (c->buf != NULL) {
+		*(char **)c->buf = t->freebufs;
+		t->freebufs	 = c->buf;
+		c->buf		 = NULL;
+	}
+	c->newer = t->free;
+	t->free	 = c;
+	t->used--;
+}
+
+/*
+ * close the connections whose time is up, returns their number
+ */
+int
+conn_expire(struct conn_table *t, uint64_t now)
+{
+	struct tw_timer *timer;
+	struct conn *	 c;
+	int		 n = 0;
+
+	while ((timer = tw_expire(&t->wheel, now / TW_TICK)) != NULL) {
+		c = (struct conn *)((char *)timer - offsetof(struct conn, timer));
+		if (now >= c->deadline) {
+			metric_add(M_TCP_TIMEOUTS, 1);
+			t->expired(t, c, CONN_TIMEOUT_CLOSE);
+		} else {
+			metric_add(M_TCP_IDLE, 1);
+			t->expired(t, c, CONN_IDLE_CLOSE);
+		}
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * msecs to wait for events before calling conn_expire(), -1: forever
+ */
+int
+conn_wait(const struct conn_table *t)
+{
+	return (t->wheel.count > 0 ? TW_TICK : -1);
+}
@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CONN_H
+#define _CONN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONN_MAX 4096	/* default connections per TCP thread */
+#define CONN_IDLE 5	/* default secs a client may stay silent */
+#define CONN_TIMEOUT 30 /* default secs a client has to send its request */
+#define CONN_SLAB 64	/* read buffers allocated at once */
+
+#define TW_TICK 100 /* msecs per timer wheel tick */
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4 /* 64^4 ticks, about 19 days */
+
+/*
+ * Hierarchical timer wheel. Level 0 holds timers due within TW_SLOTS ticks,
+ * one slot per tick; every higher level covers TW_SLOTS times the span of
+ * the one below and its slots are moved down ("cascaded") as the wheel
+ * turns. Adding and removing a timer is O(1).
+ */
+struct tw_timer {
+	struct tw_timer * next;
+	struct tw_timer **pprev; /* NULL when not armed */
+	uint64_t	  expires; /* tick */
+};
+
+struct twheel {
+	uint64_t	 now; /* tick whose level 0 slot is due next */
+	unsigned int	 count;
+	struct tw_timer *slot[TW_LEVELS][TW_SLOTS];
+};
+
+/* why the table gave up on a connection */
+enum conn_why { CONN_IDLE_CLOSE, CONN_TIMEOUT_CLOSE, CONN_EVICTED };
+
+/*
+ * A client connection (or a listening socket, which is never in a table).
+ * Clients get a read buffer from the table's pool with conn_buf().
+ */
+struct conn {
+	int			fd;
+	bool			listening;
+	bool			detached; /* no longer timed or evictable */
+	size_t			len;
+	char *			buf;
+	struct sockaddr_storage sa;
+	uint64_t		deadline; /* msecs by which the request must be in */
+	struct conn *		older;
+	struct conn *		newer;
+	struct tw_timer		timer;
+};
+
+struct conn_table;
+
+/*
+ * Called when a connection times out or is evicted to make room. It has to
+ * close the socket and either conn_put() the connection or, if it is only
+ * closed later, conn_detach() it.
+ */
+typedef void (*conn_fn)(struct conn_table *t, struct conn *c, enum conn_why why);
+
+/*
+ * Fixed-size table of the client connections of one thread, oldest first,
+ * with a pool of read buffers carved out of slabs as needed and never
+ * given back, so memory use is bounded by size + spare connections and
+ * buffers. Spare slots hold detached connections on their way out.
+ */
+struct conn_table {
+	struct conn * conns;
+	unsigned int  size;
+	unsigned int  spare;
+	unsigned int  used;
+	unsigned int  ndetached;
+	struct conn * free;
+	struct conn * oldest;
+	struct conn * newest;
+	char *	      freebufs; /* linked through their first bytes */
+	size_t	      bufsize;
+	unsigned int  nbufs; /* allocated so far */
+	unsigned int  idle;  /* msecs */
+	unsigned int  timeout;
+	struct twheel wheel;
+	conn_fn	      expired;
+	void *	      arg; /* for expired */
+};
+
+void		   tw_init(struct twheel *w, uint64_t now);
+void		   tw_add(struct twheel *w, struct tw_timer *t, uint64_t expires);
+void		   tw_del(struct twheel *w, struct tw_timer *t);
+struct tw_timer *  tw_expire(struct twheel *w, uint64_t now);
+uint64_t	   conn_now(void);
+struct conn_table *conn_table_new(unsigned int size, unsigned int spare, size_t bufsize,
+    unsigned int idle, unsigned int timeout, conn_fn expired, void *arg);
+struct conn *	   conn_new(struct conn_table *t, uint64_t now);
+char *		   conn_buf(struct conn_table *t, struct conn *c);
+void		   conn_touch(struct conn_table *t, struct conn *c, uint64_t now);
+void		   conn_detach(struct conn_table *t, struct conn *c);
+void		   conn_put(struct conn_table *t, struct conn *c);
+int		   conn_expire(struct conn_table *t, uint64_t now);
+int		   conn_wait(const struct conn_table *t);
+
+#endif /* _CONN_H */
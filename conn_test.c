@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn.h"
+
+#define TIMERS 100000
+#define HORIZON (4 * TW_SLOTS * TW_SLOTS * TW_SLOTS) /* ticks, reaching into level 3 */
+#define TABLE 4
+
+/*
+ * Arm timers all over the wheel, cancel some of them and turn the wheel
+ * in uneven steps: every other timer has to fire exactly at its tick.
+ * Then check that a connection table evicts, times out and pools buffers.
+ */
+
+struct tw_timer timers[TIMERS];
+bool		cancelled[TIMERS];
+bool		fired[TIMERS];
+int		closed[CONN_EVICTED + 1];
+
+static void
+expired(struct conn_table *t, struct conn *c, enum conn_why why)
+{
+	closed[why]++;
+	conn_put(t, c);
+}
+
+int
+main(void)
+{
+	struct twheel	   w;
+	struct tw_timer *  timer;
+	struct conn_table *t;
+	struct conn *	   c[TABLE + 1];
+	uint64_t	   start = 12345, now, end = start + HORIZON;
+	int		   n = 0, i;
+
+	srandom(5060);
+	tw_init(&w, start);
+	for (i = 0; i < TIMERS; i++)
+		tw_add(&w, &timers[i], start + random() % HORIZON);
+	for (i = 0; i < TIMERS; i += 2) {
+		tw_del(&w, &timers[i]);
+		cancelled[i] = true;
+	}
+	for (now = start; now <= end; now += random() % 100) {
+		while ((timer = tw_expire(&w, now)) != NULL) {
+			i = timer - timers;
+			if (cancelled[i] || fired[i])
+				errx(1, "timer %d fired twice or after tw_del()", i);
+			if (timer->expires != w.now || w.now > now)
+				errx(1, "timer %d due at %lu fired at %lu", i,
+				    (unsigned long)timer->expires, (unsigned long)w.now);
+			fired[i] = true;
+			n++;
+		}
+	}
+	while (tw_expire(&w, end) != NULL)
+		n++;
+	if (n != TIMERS / 2 || w.count != 0)
+		errx(1, "%d of %d timers fired, %u left", n, TIMERS / 2, w.count);
+	printf("conn: %d timers fired on time over %d ticks\n", n, HORIZON);
+
+	/* a full table makes room by closing its oldest client */
+	if ((t = conn_table_new(TABLE, 0, 8192, 1000, 5000, expired, NULL)) == NULL)
+		err(1, "conn_table_new");
+	now = conn_now();
+	for (i = 0; i <= TABLE; i++) {
+		if ((c[i] = conn_new(t, now)) == NULL)
+			errx(1, "no slot for connection %d", i);
+		if (conn_buf(t, c[i]) == NULL)
+			errx(1, "no buffer for connection %d", i);
+	}
+	if (closed[CONN_EVICTED] != 1 || t->oldest != c[1] || t->used != TABLE ||
+	    t->nbufs != TABLE)
+		errx(1, "eviction failed");
+
+	/* a client that keeps sending is closed at its deadline, not before */
+	for (uint64_t ms = now; ms < now + 6000; ms += TW_TICK) {
+		conn_touch(t, c[TABLE], ms);
+		conn_expire(t, ms);
+		if (ms < now + 1000 && t->used != TABLE)
+			errx(1, "closed before the idle time");
+		if (ms >= now + 1000 + TW_TICK && ms < now + 5000 && t->used != 1)
+			errx(1, "silent clients not closed after the idle time");
+	}
+	if (closed[CONN_IDLE_CLOSE] != TABLE - 1 || closed[CONN_TIMEOUT_CLOSE] != 1 ||
+	    t->used != 0 || t->nbufs != TABLE)
+		errx(1, "timeouts failed");
+	printf("conn: eviction, idle and request timeouts\n");
+
+	return (0);
+}
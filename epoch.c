@@ -0,0 +1,122 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "banned.h"
+#include "epoch.h"
+
+/*
+ * Every reader thread takes a slot on its first epoch_enter() and keeps
+ * it. The slot holds the global epoch at which the reader entered its
+ * section, 0 while it is outside. epoch_wait() advances the global epoch
+ * and waits for the slots still holding an older one, so readers that keep
+ * entering new sections do not hold it up. Threads beyond EPOCH_THREADS
+ * share a counter instead, which epoch_wait() waits to drop to 0.
+ */
+
+struct epoch_slot {
+	_Atomic uint64_t epoch;
+} __attribute__((aligned(64))); /* a cache line of its own */
+
+static struct epoch_slot		  slots[EPOCH_THREADS];
+static atomic_uint			  nslots;
+static _Atomic uint64_t			  epoch = 1;
+static atomic_uint			  overflow; /* readers without a slot inside */
+static _Thread_local struct epoch_slot *self;
+static _Thread_local bool		  noslot;
+
+/*
+ * slot of the calling thread, NULL once they ran out
+ */
+static struct epoch_slot *
+epoch_slot(void)
+{
+	unsigned int n;
+
+	if (self != NULL || noslot)
+		return (self);
+	if ((n = atomic_fetch_add(&nslots, 1)) >= EPOCH_THREADS) {
+		noslot = true;
+		return (NULL);
+	}
+	self = &slots[n];
+	return (self);
+}
+
+/*
+ * Enter a read section: shared pointers loaded from here on stay valid
+ * until epoch_exit(). The store is sequentially consistent so that it is
+ * seen before the loads that follow it.
+ */
+void
+epoch_enter(void)
+{
+	struct epoch_slot *s;
+
+	if ((s = epoch_slot()) == NULL) {
+		atomic_fetch_add(&overflow, 1);
+		return;
+	}
+	atomic_store(&s->epoch, atomic_load_explicit(&epoch, memory_order_relaxed));
+}
+
+void
+epoch_exit(void)
+{
+	if (self == NULL) {
+		atomic_fetch_sub(&overflow, 1);
+		return;
+	}
+	atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+/*
+ * Wait until no reader can still hold a pointer that was replaced before
+ * the call. Must not be called from within a read section.
+ */
+void
+epoch_wait(void)
+{
+	struct timespec ts = { 0, EPOCH_POLL * 1000 * 1000 };
+	unsigned int	n;
+	uint64_t	e, cur;
+
+	e = atomic_fetch_add(&epoch, 1) + 1;
+	if ((n = atomic_load(&nslots)) > EPOCH_THREADS)
+		n = EPOCH_THREADS;
+	for (unsigned int i = 0; i < n; i++) {
+		while ((cur = atomic_load(&slots[i].epoch)) != 0 && cur < e)
+			nanosleep(&ts, NULL);
+	}
+	while (atomic_load(&overflow) > 0)
+		nanosleep(&ts, NULL);
+}
@@ -0,0 +1,46 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#define EPOCH_THREADS 1088 /* readers with a slot of their own, enough for every thread */
+#define EPOCH_POLL 1	   /* msecs between two looks at the readers in epoch_wait() */
+
+/*
+ * Epoch based reclamation of data shared with lock-free readers. A reader
+ * brackets its use of a shared pointer with epoch_enter() and
+ * epoch_exit(), typically around a whole batch of work; both are a store
+ * into a slot of its own. A writer publishes a new pointer (or NULL) with
+ * an atomic store, then epoch_wait() returns once every reader that could
+ * still see the old one has left its section, so it can be freed. Read
+ * sections do not nest.
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_wait(void);
+
+#endif /* _EPOCH_H */
@@ -0,0 +1,482 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * End-to-end load generator: replay a weighted mix of SIP requests over
+ * UDP4, UDP6, TCP4 and TCP6 to a local fsipd, flat out or at a target
+ * rate, then count the lines that made it into the log. fsipd closes a
+ * TCP connection after one request, so every TCP request gets its own
+ * connection.
+ */
+
+#define PORT 5060
+#define SEND_BATCH 32
+#define MSGSIZE 1024
+#define MAXSLOTS 1000	 /* length of a weighted schedule */
+#define MAXTHREADS 64
+#define MAXSOURCES 254
+#define SETTLE_MSECS 500 /* log is complete once it stopped growing this long */
+#define SETTLE_MAX 10	 /* but wait at most this many seconds */
+
+enum { P_UDP4, P_UDP6, P_TCP4, P_TCP6, P_MAX };
+
+static const char *protonames[P_MAX] = { "udp4", "udp6", "tcp4", "tcp6" };
+
+/* request templates, filled with transport, branch, tag and call-id */
+static const struct {
+	const char *name;
+	const char *fmt;
+} requests[] = {
+	{ "options", "OPTIONS sip:100@bench.invalid SIP/2.0\r\n"
+		     "Via: SIP/2.0/%s 127.0.0.1:5061;branch=z9hG4bK-%lu\r\n"
+		     "From: \"sipvicious\"<sip:100@1.1.1.1>;tag=%lx\r\n"
+		     "To: \"sipvicious\"<sip:100@1.1.1.1>\r\n"
+		     "Call-ID: %lu@bench\r\n"
+		     "CSeq: 1 OPTIONS\r\n"
+		     "Max-Forwards: 70\r\n"
+		     "User-Agent: friendly-scanner\r\n"
+		     "Accept: application/sdp\r\n"
+		     "Content-Length: 0\r\n\r\n" },
+	{ "register", "REGISTER sip:bench.invalid SIP/2.0\r\n"
+		      "Via: SIP/2.0/%s 127.0.0.1:5061;branch=z9hG4bK-%lu\r\n"
+		      "From: <sip:1000@bench.invalid>;tag=%lx\r\n"
+		      "To: <sip:1000@bench.invalid>\r\n"
+		      "Call-ID: %lu@bench\r\n"
+		      "CSeq: 1 REGISTER\r\n"
+		      "Contact: <sip:1000@127.0.0.1:5061>\r\n"
+		      "Expires: 3600\r\n"
+		      "User-Agent: sipcli/v1.8\r\n"
+		      "Content-Length: 0\r\n\r\n" },
+	{ "invite", "INVITE sip:0046701234567@bench.invalid SIP/2.0\r\n"
+		    "Via: SIP/2.0/%s 127.0.0.1:5061;branch=z9hG4bK-%lu\r\n"
+		    "From: <sip:100@bench.invalid>;tag=%lx\r\n"
+		    "To: <sip:0046701234567@bench.invalid>\r\n"
+		    "Call-ID: %lu@bench\r\n"
+		    "CSeq: 1 INVITE\r\n"
+		    "Contact: <sip:100@127.0.0.1:5061>\r\n"
+		    "Max-Forwards: 70\r\n"
+		    "User-Agent: Asterisk PBX\r\n"
+		    "Content-Type: application/sdp\r\n"
+		    "Content-Length: 130\r\n\r\n"
+		    "v=0\r\n"
+		    "o=- 1 1 IN IP4 127.0.0.1\r\n"
+		    "s=-\r\n"
+		    "c=IN IP4 127.0.0.1\r\n"
+		    "t=0 0\r\n"
+		    "m=audio 10000 RTP/AVP 0 8 101\r\n"
+		    "a=rtpmap:0 PCMU/8000\r\n"
+		    "a=sendrecv\r\n" },
+};
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* weighted round-robin schedule of protocols and requests */
+struct schedule {
+	int slots[MAXSLOTS];
+	int n;
+};
+
+struct sender {
+	pthread_t thr;
+	double	  rate; /* msgs/sec of this thread, 0: flat out */
+	uint64_t  seq;	/* first sequence number, threads are spaced apart */
+	uint64_t  sent[P_MAX];
+	uint64_t  errors;
+	char	  bufs[SEND_BATCH][MSGSIZE];
+};
+
+static struct schedule protos, reqs;
+static struct sockaddr_in  dst4;
+static struct sockaddr_in6 dst6;
+static int		   nsources = 1;
+static double		   duration = 5.0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Parse "name:weight,..." against names into a smooth weighted round-robin
+ * schedule, so that every kind is spread evenly over the run.
+ */
+static void
+parse_mix(struct schedule *sch, char *spec, const char *const *names, int nnames)
+{
+	int   weight[16] = { 0 }, credit[16] = { 0 }, total = 0, best;
+	char *name, *w, *end;
+	int   i;
+
+	for (name = strtok(spec, ","); name != NULL; name = strtok(NULL, ",")) {
+		if ((w = strchr(name, ':')) != NULL)
+			*w++ = '\0';
+		for (i = 0; i < nnames && strcmp(names[i], name) != 0; i++)
+			;
+		if (i == nnames)
+			errx(EX_USAGE, "unknown mix entry: %s", name);
+		weight[i] = w != NULL ? strtol(w, &end, 10) : 1;
+		if (weight[i] < 0 || (w != NULL && *end != '\0'))
+			errx(EX_USAGE, "bad weight for %s", name);
+		total += weight[i];
+	}
+	if (total <= 0 || total > MAXSLOTS)
+		errx(EX_USAGE, "weights must add up to between 1 and %d", MAXSLOTS);
+
+	for (sch->n = 0; sch->n < total; sch->n++) {
+		best = -1;
+		for (i = 0; i < nnames; i++) {
+			credit[i] += weight[i];
+			if (weight[i] > 0 && (best < 0 || credit[i] > credit[best]))
+				best = i;
+		}
+		credit[best] -= total;
+		sch->slots[sch->n] = best;
+	}
+}
+
+static bool
+uses(const struct schedule *sch, int kind)
+{
+	for (int i = 0; i < sch->n; i++)
+		if (sch->slots[i] == kind)
+			return (true);
+	return (false);
+}
+
+/*
+ * socket connected to fsipd, bound to source address k for IPv4
+ */
+static int
+open_socket(int proto, int k)
+{
+	struct sockaddr_in src;
+	int		   fd, v6 = proto == P_UDP6 || proto == P_TCP6;
+	int		   type = proto == P_UDP4 || proto == P_UDP6 ? SOCK_DGRAM : SOCK_STREAM;
+
+	if ((fd = socket(v6 ? PF_INET6 : PF_INET, type | SOCK_CLOEXEC, 0)) < 0)
+		return (-1);
+	if (!v6 && nsources > 1) {
+		memset(&src, 0, sizeof(src));
+		src.sin_family	    = AF_INET;
+		src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + k % nsources);
+		if (bind(fd, (struct sockaddr *)&src, sizeof(src)) < 0) {
+			close(fd);
+			return (-1);
+		}
+	}
+	if ((v6 ? connect(fd, (struct sockaddr *)&dst6, sizeof(dst6)) :
+		  connect(fd, (struct sockaddr *)&dst4, sizeof(dst4))) < 0) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * send one request over a fresh TCP connection
+ */
+static bool
+send_tcp(int proto, uint64_t seq, const char *msg, size_t len)
+{
+	ssize_t n = -1;
+	int	fd;
+
+	if ((fd = open_socket(proto, seq)) >= 0) {
+		n = send(fd, msg, len, MSG_NOSIGNAL);
+		close(fd);
+	}
+	return (n == (ssize_t)len);
+}
+
+static void *
+sender(void *arg)
+{
+	struct sender * s = arg;
+	struct mmsghdr	msgs[2][SEND_BATCH];
+	struct iovec	iov[2][SEND_BATCH];
+	struct timespec due;
+	uint64_t	seq = s->seq, total = 0, batch;
+	double		start, t;
+	size_t		len;
+	int		udp[2][MAXSOURCES], nmsgs[2], fam, proto, req, r;
+
+	memset(udp, -1, sizeof(udp));
+	for (int k = 0; k < nsources; k++) {
+		if (uses(&protos, P_UDP4) && (udp[0][k] = open_socket(P_UDP4, k)) < 0)
+			err(EX_OSERR, "udp4 socket");
+		if (k == 0 && uses(&protos, P_UDP6) && (udp[1][0] = open_socket(P_UDP6, 0)) < 0)
+			err(EX_OSERR, "udp6 socket");
+	}
+	memset(msgs, 0, sizeof(msgs));
+
+	start = now();
+	while ((t = now()) - start < duration) {
+		/* number of requests due now, or a full batch when flat out */
+		batch = SEND_BATCH;
+		if (s->rate > 0) {
+			batch = (uint64_t)((t - start) * s->rate) - total;
+			if (batch == 0) {
+				t	    = start + (total + 1) / s->rate;
+				due.tv_sec  = t;
+				due.tv_nsec = (t - due.tv_sec) * 1e9;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+				continue;
+			}
+			batch = batch > SEND_BATCH ? SEND_BATCH : batch;
+		}
+
+		nmsgs[0] = nmsgs[1] = 0;
+		for (uint64_t i = 0; i < batch; i++, seq++) {
+			proto = protos.slots[seq % protos.n];
+			req   = reqs.slots[(seq / protos.n) % reqs.n];
+			len   = snprintf(s->bufs[i], MSGSIZE, requests[req].fmt,
+			      proto == P_TCP4 || proto == P_TCP6 ? "TCP" : "UDP", seq, seq, seq);
+			if (proto == P_TCP4 || proto == P_TCP6) {
+				if (send_tcp(proto, seq, s->bufs[i], len))
+					s->sent[proto]++;
+				else
+					s->errors++;
+				continue;
+			}
+			fam			      = proto == P_UDP6;
+			r			      = nmsgs[fam]++;
+			iov[fam][r].iov_base	      = s->bufs[i];
+			iov[fam][r].iov_len	      = len;
+			msgs[fam][r].msg_hdr.msg_iov	= &iov[fam][r];
+			msgs[fam][r].msg_hdr.msg_iovlen = 1;
+		}
+		total += batch;
+
+		/* IPv4 batches rotate over the source addresses */
+		for (fam = 0; fam < 2; fam++) {
+			if (nmsgs[fam] == 0)
+				continue;
+			r = sendmmsg(udp[fam][fam == 0 ? seq % nsources : 0], msgs[fam], nmsgs[fam],
+			    0);
+			if (r > 0)
+				s->sent[fam == 0 ? P_UDP4 : P_UDP6] += r;
+			s->errors += nmsgs[fam] - (r > 0 ? r : 0);
+		}
+	}
+
+	for (int k = 0; k < nsources; k++) {
+		if (udp[0][k] >= 0)
+			close(udp[0][k]);
+	}
+	if (udp[1][0] >= 0)
+		close(udp[1][0]);
+	return (NULL);
+}
+
+/*
+ * Number of records in the CSV log at path, -1 if it cannot be read.
+ * Messages are logged with their line breaks, so only lines starting with
+ * "epoch,UDP" or "epoch,TCP" count.
+ */
+static long
+count_lines(const char *path)
+{
+	FILE * fp;
+	char * line = NULL;
+	size_t size = 0, n;
+	long   lines = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	while (getline(&line, &size, fp) != -1) {
+		n = strspn(line, "0123456789");
+		if (n > 0 &&
+		    (strncmp(line + n, ",UDP", 4) == 0 || strncmp(line + n, ",TCP", 4) == 0))
+			lines++;
+	}
+	free(line);
+	fclose(fp);
+
+	return (lines);
+}
+
+/*
+ * wait until the log stopped growing, returns its final line count
+ */
+static long
+settle(const char *path)
+{
+	struct timespec pause = { 0, SETTLE_MSECS * 1000000L };
+	double		deadline = now() + SETTLE_MAX;
+	long		last = count_lines(path), cur;
+
+	while (now() < deadline) {
+		nanosleep(&pause, NULL);
+		if ((cur = count_lines(path)) == last)
+			break;
+		last = cur;
+	}
+	return (last);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: fsipd-bench [-l logfile] [-d seconds] [-r rate] [-t threads] [-s sources]\n"
+	    "                   [-p proto:weight,...] [-m request:weight,...]\n"
+	    "\t-l: CSV log of fsipd to count logged requests in, - for none (default: fsipd.log)\n"
+	    "\t-d: seconds to send (default: 5)\n"
+	    "\t-r: requests per second over all threads (default: 0, flat out)\n"
+	    "\t-t: sending threads (default: 1)\n"
+	    "\t-s: spread IPv4 requests over this many 127.0.0.x source addresses\n"
+	    "\t-p: protocol mix of udp4, udp6, tcp4, tcp6 (default: udp4)\n"
+	    "\t-m: request mix of options, register, invite (default: options)\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *   reqnames[NREQUESTS];
+	struct sender *senders;
+	const char *   logfile = "fsipd.log";
+	char	       pmix[] = "udp4", rmix[] = "options";
+	char *	       pspec = pmix, *rspec = rmix;
+	uint64_t       sent[P_MAX] = { 0 }, total = 0, errors = 0;
+	double	       rate = 0, start, elapsed;
+	long	       before, after;
+	int	       nthreads = 1, opt;
+	bool	       counted;
+
+	while ((opt = getopt(argc, argv, "l:d:r:t:s:p:m:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			logfile = optarg;
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				errx(EX_USAGE, "threads must be between 1 and %d", MAXTHREADS);
+			break;
+		case 's':
+			nsources = atoi(optarg);
+			if (nsources < 1 || nsources > MAXSOURCES)
+				errx(EX_USAGE, "sources must be between 1 and %d", MAXSOURCES);
+			break;
+		case 'p':
+			pspec = optarg;
+			break;
+		case 'm':
+			rspec = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	for (size_t i = 0; i < NREQUESTS; i++)
+		reqnames[i] = requests[i].name;
+	parse_mix(&protos, pspec, protonames, P_MAX);
+	parse_mix(&reqs, rspec, reqnames, NREQUESTS);
+
+	memset(&dst4, 0, sizeof(dst4));
+	dst4.sin_family	     = AF_INET;
+	dst4.sin_port	     = htons(PORT);
+	dst4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&dst6, 0, sizeof(dst6));
+	dst6.sin6_family = AF_INET6;
+	dst6.sin6_port	 = htons(PORT);
+	dst6.sin6_addr	 = in6addr_loopback;
+
+	if ((senders = calloc(nthreads, sizeof(*senders))) == NULL)
+		err(EX_OSERR, "calloc");
+	counted = strcmp(logfile, "-") != 0;
+	before	= counted ? count_lines(logfile) : 0;
+
+	start = now();
+	for (int i = 0; i < nthreads; i++) {
+		senders[i].rate = rate / nthreads;
+		senders[i].seq	= (uint64_t)i << 40;
+		if ((errno = pthread_create(&senders[i].thr, NULL, sender, &senders[i])) != 0)
+			err(EX_OSERR, "pthread_create");
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(senders[i].thr, NULL);
+		for (int p = 0; p < P_MAX; p++)
+			sent[p] += senders[i].sent[p];
+		errors += senders[i].errors;
+	}
+	elapsed = now() - start;
+	after	= counted ? settle(logfile) : 0;
+
+	for (int p = 0; p < P_MAX; p++)
+		total += sent[p];
+	printf("%-8s %12s %12s\n", "", "requests", "req/s");
+	for (int p = 0; p < P_MAX; p++) {
+		if (sent[p] > 0)
+			printf("%-8s %12lu %12.0f\n", protonames[p], (unsigned long)sent[p],
+			    sent[p] / elapsed);
+	}
+	printf("%-8s %12lu %12.0f  (%lu send errors)\n", "sent", (unsigned long)total,
+	    total / elapsed, (unsigned long)errors);
+	if (!counted)
+		return (0);
+	if (before < 0 || after < 0) {
+		printf("%-8s %12s  (cannot read %s)\n", "logged", "-", logfile);
+		return (0);
+	}
+	printf("%-8s %12ld %12.0f\n", "logged", after - before, (after - before) / elapsed);
+	printf("%-8s %11.2f%%\n", "loss",
+	    total > 0 ? 100.0 * ((double)total - (after - before)) / total : 0.0);
+
+	free(senders);
+	return (0);
+}
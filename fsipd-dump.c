@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "banned.h"
+#include "logfile.h"
+#include "record.h"
+
+/*
+ * fsipd-dump - convert binary fsipd logs into the CSV format written by
+ * fsipd -f csv:
+ *
+ *	epoch,proto,ip,port,"message"
+ *
+ * Logs written with fsipd -z are decompressed on the way, a stream that
+ * ends without its gzip trailer (fsipd is still writing it) is read up to
+ * the last flush.
+ */
+
+#define BUFSIZE (1024 * 1024)
+
+static char inbuf[BUFSIZE];
+static char outbuf[LOG_RECSIZE + REC_HEADMAX];
+
+/*
+ * convert one binary log, returns 0 on success
+ */
+static int
+dump(gzFile in, const char *name)
+{
+	struct sockaddr_storage ss;
+	struct sip_event	ev;
+	size_t			have = 0, off, reclen, len;
+	int			n, zerr;
+
+	/* header */
+	while (have < LOG_BIN_HDRSIZE) {
+		if ((n = gzread(in, inbuf + have, LOG_BIN_HDRSIZE - have)) <= 0)
+			break;
+		have += n;
+	}
+	if (have < LOG_BIN_HDRSIZE || memcmp(inbuf, LOG_BIN_MAGIC, 8) != 0) {
+		warnx("%s: not a binary fsipd log", name);
+		return (-1);
+	}
+	if (((uint8_t)inbuf[8] | (uint8_t)inbuf[9] << 8) > LOG_BIN_VERSION) {
+		warnx("%s: unsupported log version %d", name,
+		    (uint8_t)inbuf[8] | (uint8_t)inbuf[9] << 8);
+		return (-1);
+	}
+
+	/* records */
+	have = 0;
+	while ((n = gzread(in, inbuf + have, sizeof(inbuf) - have)) != 0) {
+		if (n < 0)
+			break;
+		have += n;
+		for (off = 0; (reclen = rec_frombin(inbuf + off, have - off, &ev, &ss)) > 0;
+		     off += reclen) {
+			len	      = rec_csv(outbuf, sizeof(outbuf) - 1, &ev);
+			outbuf[len++] = '\n';
+			fwrite(outbuf, 1, len, stdout);
+		}
+		if (off == 0 && have == sizeof(inbuf)) {
+			warnx("%s: malformed record", name);
+			return (-1);
+		}
+		memmove(inbuf, inbuf + off, have - off);
+		have -= off;
+	}
+	if (n < 0) {
+		gzerror(in, &zerr);
+		if (zerr == Z_ERRNO)
+			warn("%s", name);
+		else if (zerr == Z_BUF_ERROR)
+			warnx("%s: compressed stream ends early", name);
+		else
+			warnx("%s: %s", name, gzerror(in, &zerr));
+		if (zerr != Z_BUF_ERROR)
+			return (-1);
+	}
+	if (have > 0)
+		warnx("%s: %zu trailing bytes of an incomplete record", name, have);
+
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	gzFile in;
+	int    fd, ret = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+		printf("usage: fsipd-dump [file ...]\n");
+		exit(EXIT_SUCCESS);
+	}
+
+	if (argc == 1) {
+		if ((in = gzdopen(STDIN_FILENO, "rb")) == NULL)
+			err(EX_OSERR, "stdin");
+		ret = dump(in, "stdin") == 0 ? EXIT_SUCCESS : EX_DATAERR;
+		gzclose(in);
+		return (ret);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY)) == -1) {
+			warn("%s", argv[i]);
+			ret = EX_NOINPUT;
+			continue;
+		}
+		if ((in = gzdopen(fd, "rb")) == NULL) {
+			warn("%s", argv[i]);
+			close(fd);
+			ret = EX_OSERR;
+			continue;
+		}
+		if (dump(in, argv[i]) != 0)
+			ret = EX_DATAERR;
+		gzclose(in);
+	}
+
+	return (ret);
+}
@@ -24,14 +24,18 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <sys/cdefs.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <netinet/in.h>
 
@@ -39,6 +43,7 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <netdb.h>
 #include <signal.h>
@@ -52,13 +57,40 @@
 #define SYSLOG_NAMES
 #include <pidutil.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <syslog.h>
 
+#include "agg.h"
 #include "banned.h"
+#include "capture.h"
+#include "conn.h"
+#include "epoch.h"
+#include "hh.h"
+#include "latency.h"
 #include "logfile.h"
+#include "metrics.h"
+#include "record.h"
+#include "reply.h"
+#include "request.h"
+#include "scan.h"
+#include "sink.h"
+#include "sipparse.h"
+#include "slog.h"
+#include "uring.h"
 
 #define PORT 5060
 #define BACKLOG 1024
+#define TCP_BUFSIZE 8192
+#define TCP_MAXEVENTS 256
+#define UDP_BUFSIZE 8192
+#define UDP_BATCH 32	   /* default number of datagrams per recvmmsg() */
+#define UDP_MAXBATCH 1024
+#define MAX_WORKERS 256
+#define LOG_QLEN 1024 /* default number of records in the async log queue */
+#define SYNC_RECS 256 /* default group commit size */
+#define SYNC_MSECS 100 /* default group commit delay */
+#define UDP_CTRLSIZE CMSG_SPACE(sizeof(struct timespec)) /* SO_TIMESTAMPNS */
+#define URING_BUFS 256 /* buffers provided per UDP socket, a power of two */
 
 #ifndef IPV6_BINDV6ONLY /* Linux does not have IPV6_BINDV6ONLY */
 #define IPV6_BINDV6ONLY IPV6_V6ONLY
@@ -67,47 +99,68 @@
 /*
  * Globals
  */
-log_t *	      lfh;
-struct pidfh *pfh;
-bool	      use_syslog  = false;
-char *	      logfilename = NULL;
-int	      syslog_pri  = -1;
-
-struct sockaddr_in t_sa, u_sa;
-int		   t_sockfd, u_sockfd;
-
-#ifdef PF_INET6
-struct sockaddr_in6 t6_sa, u6_sa;
-int		    t6_sockfd, u6_sockfd;
-
-#endif /* PF_INET6 */
+struct pidfh *	    pfh;
+char *		    logfilename	= NULL;
+int		    udp_batch	= UDP_BATCH;
+size_t		    log_qlen	= LOG_QLEN;
+enum log_overflow   log_policy	= LOG_BLOCK;
+unsigned int	    log_batchsize = 0; /* records per write of the writer, 0: LOG_BATCH */
+enum log_durability log_sync	= LOG_SYNC;
+unsigned int	    sync_recs	= SYNC_RECS;
+unsigned int	    sync_msecs	= SYNC_MSECS;
+enum log_format	    log_fmt	= LOG_TEXT;
+size_t		    log_seg	= 0;
+size_t		    rot_size	= 0; /* rotate the log at this size (-R), 0: never */
+unsigned int	    rot_secs	= 0; /* and/or every rot_secs */
+unsigned int	    rot_keep	= 0;
+char *		    rot_name	= NULL;
+int		    log_zlevel	= 0;
+bool		    sip_csv	= false;  /* log the parsed fields (-f sip) */
+int		    top_k	= HH_TOP;
+char *		    metrics_addr = NULL; /* port or UNIX socket path of the exporter */
+int		    metrics_fd	 = -1;
+char *		    slog_dest	 = NULL; /* UNIX socket path or host[:port] of -S */
+bool		    use_uring	 = false; /* io_uring listeners and log writer (-U) */
+char *		    cap_ifname	 = NULL;  /* capture on this interface instead of listening (-c) */
+struct cap_ports    cap_dports;
+unsigned int	    conn_max	 = CONN_MAX; /* client connections per TCP thread (-C) */
+unsigned int	    conn_idle	 = CONN_IDLE * 1000;
+unsigned int	    conn_timeout = CONN_TIMEOUT * 1000;
+sem_t		    lat_sem; /* posted by SIGUSR2 to dump latencies */
+int		    noutputs	 = 0;	  /* -O given, only those outputs are used */
+bool		    file_out	 = false; /* -O file */
+bool		    syslog_out	 = false; /* -O syslog */
+
+int	      nworkers	  = 1;
+bool	      reuseport	  = false;
 
 /*
- * trim string from whitespace characters
+ * Listener sockets and threads of a worker. Without -w there is a single
+ * worker owning the only set of sockets, with -w every worker binds its own
+ * SO_REUSEPORT sockets and runs pinned to one CPU.
  */
-size_t
-chomp(char *s)
-{
-	int i;
+enum { FAM_INET, FAM_INET6, FAM_MAX };
+enum { THR_TCP, THR_UDP4, THR_UDP6, THR_CAP, THR_MAX };
 
-	/* trim leading spaces */
-	while (isspace(*s))
-		s++;
+struct worker {
+	int	    cpu;
+	int	    tcp_fd[FAM_MAX];
+	int	    udp_fd[FAM_MAX];
+	struct cap *cap; /* instead of the listeners with -c */
+	pthread_t   threads[THR_MAX];
+};
 
-	/* All spaces? */
-	if (*s == 0)
-		return 0;
+struct worker *workers;
 
-	/* trim trailing spaces */
-	i = strlen(s);
+/* posted by SIGUSR1 to report heavy hitters right away */
+sem_t top_sem;
 
-	while ((i > 0) && (isspace(s[i - 1])))
-		i--;
-
-	s[i] = '\0';
-
-	return i;
-}
+/* one line of a heavy-hitter report */
+struct top_rec {
+	time_t		      ts;
+	int		      rank;
+	const struct hh_item *item;
+};
 
 /*
  * Prepare for a clean shutdown
@@ -115,23 +168,42 @@ chomp(char *s)
 void
 daemon_shutdown()
 {
+	log_t *log;
+
 	pidfile_remove(pfh);
-	if (!use_syslog)
-		log_close(lfh);
+	if (metrics_fd >= 0 && strchr(metrics_addr, '/') != NULL)
+		unlink(metrics_addr);
+	/* wait for a busy syslog daemon rather than drop the last summaries */
+	if (slog != NULL)
+		slog_drain(slog);
+	agg_flushall();
+	/* unpublish the outputs, close them once no thread can be writing to them */
+	log = atomic_exchange(&lfh, NULL);
+	sinks_stop();
+	epoch_wait();
+	log_close(log);
+	sinks_close();
 }
 
 /*
  * Act upon receiving signals
  */
 void
-signal_handler(int sig)
+handle_signal(int sig)
 {
 	switch (sig) {
 
 	case SIGHUP:
-		if (!use_syslog)
-			log_reopen(&lfh); /* necessary for log file
-					   * rotation */
+		if (lfh != NULL)
+			log_reopen(lfh); /* after an external rotation */
+		break;
+	case SIGUSR1:
+		if (top_secs > 0)
+			sem_post(&top_sem);
+		break;
+	case SIGUSR2:
+		if (lat_enabled)
+			sem_post(&lat_sem);
 		break;
 	case SIGINT:
 	case SIGTERM:
@@ -143,97 +215,170 @@ signal_handler(int sig)
 	}
 }
 
-void
-process_request(int af, struct sockaddr *src, int proto, char *str)
+/*
+ * Control thread: the signals fsipd acts upon are blocked in every thread
+ * and read from a signalfd (passed in arg) here, one at a time, so that
+ * none of their handling has to be async-signal-safe.
+ */
+void *
+sig_control(void *arg)
 {
-	char *		    p_names[] = { "TCP", "UDP", "RAW", "UNKNOWN" };
-	char *		    pname;
-	uint16_t	    port;
-	char		    addr_str[46];
-	struct sockaddr_in *s_in;
+	struct signalfd_siginfo si;
+	int			fd = *(int *)arg;
 
-#ifdef PF_INET6
-	struct sockaddr_in6 *s_in6;
+	while (1) {
+		if (read(fd, &si, sizeof(si)) != sizeof(si)) {
+			if (errno == EINTR)
+				continue;
+			daemon_shutdown();
+			exit(EXIT_FAILURE);
+		}
+		handle_signal(si.ssi_signo);
+	}
 
-#endif /* PF_INET6 */
+	return (NULL);
+}
 
-	switch (proto) {
-	case SOCK_STREAM:
-		pname = p_names[0];
-		break;
-	case SOCK_DGRAM:
-		pname = p_names[1];
-		break;
-	case SOCK_RAW:
-		pname = p_names[2];
-		break;
-	default:
-		pname = p_names[3];
-		;
+/*
+ * flush the aggregation tables every agg_secs seconds
+ */
+void *
+agg_flusher(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	while (1) {
+		ts.tv_sec  = agg_secs;
+		ts.tv_nsec = 0;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		epoch_enter();
+		agg_flushall();
+		epoch_exit();
 	}
 
-	chomp(str);
+	return (NULL);
+}
 
-#ifdef PF_INET6
-	switch (af) {
-	case AF_INET6:
-		s_in6 = (struct sockaddr_in6 *)src;
-		inet_ntop(af, &s_in6->sin6_addr, addr_str, sizeof(addr_str));
-		port = ntohs(s_in6->sin6_port);
-		if (use_syslog) {
-			syslog(syslog_pri, "From: %s:%d (%s6) - Message: \"%s\"", addr_str, port,
-			    pname, str);
-		} else {
-			log_printf(lfh, "%ld,%s6,%s,%d,\"%s\"", time(NULL), pname, addr_str, port,
-			    str);
+size_t
+format_top(char *buf, size_t size, const void *arg)
+{
+	const struct top_rec *rec = arg;
+
+	return (rec_top(buf, size, rec->ts, rec->rank, rec->item));
+}
+
+/*
+ * log the top_k heavy hitters of every dimension
+ */
+void
+report_top(void)
+{
+	struct hh_item items[HH_SLOTS];
+	struct top_rec rec;
+	char	       buf[REC_TOPMAX + 1];
+	size_t	       len;
+	int	       n;
+
+	rec.ts = time(NULL);
+	for (int dim = 0; dim < HH_NDIMS; dim++) {
+		if ((n = hh_top(hh, dim, items, top_k)) < 0)
+			return;
+		for (int i = 0; i < n; i++) {
+			rec.rank = i + 1;
+			rec.item = &items[i];
+			if (use_syslog) {
+				len = rec_top(buf, REC_TOPMAX, rec.ts, rec.rank, rec.item);
+				buf[len] = '\0';
+				syslog_msg("%s", buf);
+			} else {
+				log_emit(lfh, format_top, &rec);
+				sinks_emit(format_top, format_top, &rec);
+			}
 		}
-		break;
-	case AF_INET:
-		s_in = (struct sockaddr_in *)src;
-		if (use_syslog) {
-			syslog(syslog_pri, "From: %s:%d (%s4) - Message: \"%s\"",
-			    inet_ntoa(s_in->sin_addr), ntohs(s_in->sin_port), pname, str);
-		} else {
-			log_printf(lfh, "%ld,%s4,%s,%d,\"%s\"", time(NULL), pname,
-			    inet_ntoa(s_in->sin_addr), ntohs(s_in->sin_port), str);
+	}
+	syslog_flush();
+}
+
+/*
+ * Report heavy hitters at the end of every interval of top_secs seconds,
+ * then start counting anew. SIGUSR1 reports the interval so far.
+ */
+void *
+top_reporter(void *arg)
+{
+	struct timespec deadline;
+
+	(void)arg;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while (1) {
+		deadline.tv_sec += top_secs;
+		for (;;) {
+			if (sem_timedwait(&top_sem, &deadline) == 0) {
+				epoch_enter();
+				report_top();
+				epoch_exit();
+			} else if (errno == ETIMEDOUT) {
+				break;
+			}
 		}
-		break;
+		epoch_enter();
+		report_top();
+		epoch_exit();
+		hh_rotate(hh);
 	}
-#else
-	s_in = (struct sockaddr_in *)src;
-	if (use_syslog) {
-		syslog(syslog_pri, "From: %s:%d (%s4) - Message: \"%s\"", inet_ntoa(s_in->sin_addr),
-		    ntohs(s_in->sin_port), pname, str);
-	} else {
-		log_printf(lfh, "%ld,%s4,%s,%d,\"%s\"", time(NULL), pname,
-		    inet_ntoa(s_in->sin_addr), ntohs(s_in->sin_port), str);
+
+	return (NULL);
+}
+
+/*
+ * allow several sockets to share the port when running multiple workers
+ */
+int
+set_reuse(int fd, const char *name)
+{
+	int on = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0) {
+		perror(name);
+		return (-1);
 	}
-#endif
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) < 0) {
+		perror(name);
+		return (-1);
+	}
+	return (0);
 }
 
 /*
  * setup TCP listener socket
  */
 int
-init_tcp()
+init_tcp(struct worker *w)
 {
+	struct sockaddr_in t_sa;
 
 #ifdef PF_INET6
+	struct sockaddr_in6 t6_sa;
+
 	/* Setup TCP6 Listener */
 	memset(&t6_sa, 0, sizeof(t6_sa));
 	t6_sa.sin6_port	    = htons(PORT);
 	t6_sa.sin6_family   = AF_INET6;
 	t6_sa.sin6_addr	    = in6addr_any;
 	t6_sa.sin6_scope_id = 0;
-	if ((t6_sockfd = socket(PF_INET6, SOCK_STREAM, 0)) < 0) {
+	if ((w->tcp_fd[FAM_INET6] = socket(PF_INET6, SOCK_STREAM, 0)) < 0) {
 		perror("tcp6 socket()");
 		return (EXIT_FAILURE);
 	}
 	int on = 1;
 
-	setsockopt(t6_sockfd, IPPROTO_IPV6, IPV6_BINDV6ONLY, (char *)&on, sizeof(on));
+	setsockopt(w->tcp_fd[FAM_INET6], IPPROTO_IPV6, IPV6_BINDV6ONLY, (char *)&on, sizeof(on));
+	if (set_reuse(w->tcp_fd[FAM_INET6], "tcp6 setsockopt()") < 0)
+		return (EXIT_FAILURE);
 
-	if (bind(t6_sockfd, (struct sockaddr *)&t6_sa, sizeof(t6_sa)) < 0) {
+	if (bind(w->tcp_fd[FAM_INET6], (struct sockaddr *)&t6_sa, sizeof(t6_sa)) < 0) {
 		perror("tcp6 bind()");
 		return (EXIT_FAILURE);
 	}
@@ -244,11 +389,13 @@ init_tcp()
 	t_sa.sin_port	     = htons(PORT);
 	t_sa.sin_family	     = AF_INET;
 	t_sa.sin_addr.s_addr = htonl(INADDR_ANY);
-	if ((t_sockfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+	if ((w->tcp_fd[FAM_INET] = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
 		perror("tcp4 socket()");
 		return (EXIT_FAILURE);
 	}
-	if (bind(t_sockfd, (struct sockaddr *)&t_sa, sizeof(t_sa)) < 0) {
+	if (set_reuse(w->tcp_fd[FAM_INET], "tcp4 setsockopt()") < 0)
+		return (EXIT_FAILURE);
+	if (bind(w->tcp_fd[FAM_INET], (struct sockaddr *)&t_sa, sizeof(t_sa)) < 0) {
 		perror("tcp4 bind()");
 		return (EXIT_FAILURE);
 	}
@@ -259,10 +406,12 @@ init_tcp()
  * setup UDP listener socket
  */
 int
-init_udp()
+init_udp(struct worker *w)
 {
+	struct sockaddr_in u_sa;
 
 #ifdef PF_INET6
+	struct sockaddr_in6 u6_sa;
 
 	/* Setup UDP6 Listener */
 	memset(&u6_sa, 0, sizeof(u6_sa));
@@ -270,15 +419,17 @@ init_udp()
 	u6_sa.sin6_family   = AF_INET6;
 	u6_sa.sin6_addr	    = in6addr_any;
 	u6_sa.sin6_scope_id = 0;
-	if ((u6_sockfd = socket(PF_INET6, SOCK_DGRAM, 0)) < 0) {
+	if ((w->udp_fd[FAM_INET6] = socket(PF_INET6, SOCK_DGRAM, 0)) < 0) {
 		perror("udp6 socket()");
 		return (EXIT_FAILURE);
 	}
 	int on = 1;
 
-	setsockopt(u6_sockfd, IPPROTO_IPV6, IPV6_BINDV6ONLY, (char *)&on, sizeof(on));
+	setsockopt(w->udp_fd[FAM_INET6], IPPROTO_IPV6, IPV6_BINDV6ONLY, (char *)&on, sizeof(on));
+	if (reuseport && set_reuse(w->udp_fd[FAM_INET6], "udp6 setsockopt()") < 0)
+		return (EXIT_FAILURE);
 
-	if (bind(u6_sockfd, (struct sockaddr *)&u6_sa, sizeof(u6_sa)) < 0) {
+	if (bind(w->udp_fd[FAM_INET6], (struct sockaddr *)&u6_sa, sizeof(u6_sa)) < 0) {
 		perror("udp6 bind()");
 		return (EXIT_FAILURE);
 	}
@@ -289,147 +440,1006 @@ init_udp()
 	u_sa.sin_port	     = htons(PORT);
 	u_sa.sin_family	     = AF_INET;
 	u_sa.sin_addr.s_addr = htonl(INADDR_ANY);
-	if ((u_sockfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+	if ((w->udp_fd[FAM_INET] = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
 		perror("udp4 socket()");
 		return (EXIT_FAILURE);
 	}
-	if (bind(u_sockfd, (struct sockaddr *)&u_sa, sizeof(u_sa)) < 0) {
+	if (reuseport && set_reuse(w->udp_fd[FAM_INET], "udp4 setsockopt()") < 0)
+		return (EXIT_FAILURE);
+	if (bind(w->udp_fd[FAM_INET], (struct sockaddr *)&u_sa, sizeof(u_sa)) < 0) {
 		perror("udp4 bind()");
 		return (EXIT_FAILURE);
 	}
 	return (EXIT_SUCCESS);
 }
 
-void *
-tcp4_handler(void *args)
+/*
+ * put socket in non-blocking mode
+ */
+int
+set_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return (-1);
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+/*
+ * add a socket to the epoll set of the TCP event loop
+ */
+int
+tcp_watch(int epfd, struct conn *conn)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = conn;
+
+	return (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev));
+}
+
+/*
+ * close a client connection and release its slot (closing the socket also
+ * removes it from the epoll set)
+ */
+void
+tcp_close(struct conn_table *t, struct conn *conn)
 {
-	int		   c;
-	struct sockaddr_in t_other;
-	FILE *		   client;
-	char		   str[8192];
-	socklen_t	   sa_len;
+	close(conn->fd);
+	conn_put(t, conn);
+}
 
-	listen(t_sockfd, BACKLOG);
+/*
+ * accept all pending connections on a listening socket
+ */
+void
+tcp_accept(int epfd, struct conn_table *t, struct conn *lconn)
+{
+	struct sockaddr_storage sa;
+	struct conn *		conn;
+	socklen_t		sa_len;
+	int			c;
 
 	while (1) {
-		sa_len = sizeof(t_sa);
-		if ((c = accept(t_sockfd, (struct sockaddr *)&t_other, &sa_len)) < 0) {
-			perror("tcp accept()");
+		sa_len = sizeof(sa);
+		if ((c = accept4(lconn->fd, (struct sockaddr *)&sa, &sa_len,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("tcp accept()");
+				metric_add(M_TCP_ACCEPT_ERRORS, 1);
+			}
+			return;
+		}
+		if ((conn = conn_new(t, conn_now())) == NULL) {
+			close(c);
+			metric_add(M_TCP_ACCEPT_ERRORS, 1);
+			continue;
+		}
+		conn->fd = c;
+		conn->sa = sa;
+		if (tcp_watch(epfd, conn) < 0) {
+			perror("tcp epoll_ctl()");
+			metric_add(M_TCP_ACCEPT_ERRORS, 1);
+			tcp_close(t, conn);
+			continue;
+		}
+		metric_add(M_TCP_ACCEPTED, 1);
+	}
+}
+
+
+/*
+ * Find the empty line ending the header of a SIP message in buf[0..len),
+ * starting the search at from. Returns a pointer to its last byte.
+ */
+char *
+tcp_hdrend(char *buf, size_t from, size_t len)
+{
+	char *nl, *end = buf + len;
+
+	for (nl = buf + from; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++) {
+		if (nl + 1 < end && nl[1] == '\n')
+			return (nl + 1);
+		if (nl + 2 < end && nl[1] == '\r' && nl[2] == '\n')
+			return (nl + 2);
+	}
+	return (NULL);
+}
+
+/*
+ * Account for n more bytes read on a client connection (n <= 0: closed or
+ * failed). Once a full line has arrived (or the peer closed the connection,
+ * or the buffer is full) the line is logged and true returned, so that the
+ * caller closes the connection, same as the former fgets() loop. When
+ * requests are parsed the whole header is waited for instead.
+ */
+bool
+tcp_consume(struct conn *conn, ssize_t n)
+{
+	char *eol;
+
+	if (n > 0) {
+		metric_add(M_TCP_BYTES, n);
+		if (parse_sip)
+			eol = tcp_hdrend(conn->buf, conn->len > 2 ? conn->len - 2 : 0,
+			    conn->len + n);
+		else
+			eol = memchr(conn->buf + conn->len, '\n', n);
+		conn->len += n;
+		if (eol == NULL && conn->len < TCP_BUFSIZE - 1)
+			return (false); /* wait for the rest of the line */
+		if (eol != NULL)
+			conn->len = eol - conn->buf + 1;
+		else
+			metric_add(M_TCP_INCOMPLETE, 1);
+	} else {
+		metric_add(M_TCP_INCOMPLETE, 1);
+	}
+	conn->buf[conn->len] = '\0';
+	metric_add(M_TCP_REQUESTS, 1);
+
+	process_request(conn->sa.ss_family, (struct sockaddr *)&conn->sa, SOCK_STREAM, conn->buf,
+	    conn->len);
+	return (true);
+}
+
+/*
+ * read whatever is available on a client connection
+ */
+void
+tcp_read(struct conn_table *t, struct conn *conn, uint64_t now)
+{
+	ssize_t n;
+
+	if (conn_buf(t, conn) == NULL) {
+		tcp_close(t, conn);
+		return;
+	}
+	n = recv(conn->fd, conn->buf + conn->len, TCP_BUFSIZE - 1 - conn->len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (tcp_consume(conn, n))
+		tcp_close(t, conn);
+	else
+		conn_touch(t, conn, now);
+}
+
+/*
+ * A client was silent or slow for too long, or evicted: log what it sent
+ * so far, if anything, and close it.
+ */
+void
+tcp_expired(struct conn_table *t, struct conn *conn, enum conn_why why)
+{
+	(void)why;
+	if (conn->len > 0)
+		tcp_consume(conn, 0);
+	tcp_close(t, conn);
+}
+
+/*
+ * put the TCP listeners of a worker in listening state, returns their number
+ */
+int
+tcp_listeners(struct worker *w, struct conn *listeners)
+{
+	int n = 0;
+
+	memset(listeners, 0, FAM_MAX * sizeof(*listeners));
+	listeners[n++].fd = w->tcp_fd[FAM_INET];
+#ifdef PF_INET6
+	listeners[n++].fd = w->tcp_fd[FAM_INET6];
+#endif /* PF_INET6 */
+
+	for (int i = 0; i < n; i++) {
+		listeners[i].listening = true;
+		if (listen(listeners[i].fd, BACKLOG) < 0) {
+			perror("tcp listen()");
+			return (-1);
+		}
+	}
+	return (n);
+}
+
+/*
+ * Event loop serving both TCP listeners of a worker (passed in args). All
+ * sockets are non-blocking, so a silent client only costs its own
+ * connection slot, until it times out.
+ */
+void *
+tcp_handler(void *args)
+{
+	struct worker *	   w = args;
+	struct epoll_event events[TCP_MAXEVENTS];
+	struct conn	   listeners[FAM_MAX];
+	struct conn *	   conn;
+	struct conn_table *t;
+	uint64_t	   now;
+	int		   epfd, nlisteners, n, i;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("tcp epoll_create1()");
+		pthread_exit(NULL);
+	}
+	if ((t = conn_table_new(conn_max, 0, TCP_BUFSIZE, conn_idle, conn_timeout,
+		 tcp_expired, NULL)) == NULL) {
+		perror("tcp connection table");
+		pthread_exit(NULL);
+	}
+
+	if ((nlisteners = tcp_listeners(w, listeners)) < 0)
+		pthread_exit(NULL);
+	for (i = 0; i < nlisteners; i++) {
+		if (set_nonblock(listeners[i].fd) < 0 || tcp_watch(epfd, &listeners[i]) < 0) {
+			perror("tcp epoll_ctl()");
 			pthread_exit(NULL);
 		}
-		if ((client = fdopen(c, "r")) == NULL) {
-			perror("tcp fdopen()");
+	}
+
+	while (1) {
+		if ((n = epoll_wait(epfd, events, TCP_MAXEVENTS, conn_wait(t))) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("tcp epoll_wait()");
 			pthread_exit(NULL);
 		}
-		memset(str, 0, sizeof(str)); /* just in case */
-		fgets(str, sizeof(str), client);
-		process_request(t_other.sin_family, (struct sockaddr *)&t_other, SOCK_STREAM, str);
-		fclose(client);
+		now = conn_now();
+		epoch_enter();
+		for (i = 0; i < n; i++) {
+			conn = events[i].data.ptr;
+			if (conn->listening)
+				tcp_accept(epfd, t, conn);
+			else
+				tcp_read(t, conn, now);
+		}
+		conn_expire(t, now);
+		epoch_exit();
+		syslog_flush();
 	}
 	return (args); /* suppress compiler warning */
 }
 
+/*
+ * Receive ring for the batched UDP path: one preallocated buffer, address
+ * and message header per slot, handed to recvmmsg() as a whole.
+ */
+struct udp_ring {
+	unsigned int		 size;
+	struct mmsghdr *	 msgs;
+	struct iovec *		 iov;
+	struct sockaddr_storage *addrs;
+	char *			 bufs;
+	char *			 ctrl; /* receive timestamps, NULL unless lat_enabled */
+};
+
+int
+udp_ring_init(struct udp_ring *ring, unsigned int size)
+{
+	ring->size  = size;
+	ring->msgs  = calloc(size, sizeof(*ring->msgs));
+	ring->iov   = calloc(size, sizeof(*ring->iov));
+	ring->addrs = calloc(size, sizeof(*ring->addrs));
+	ring->bufs  = malloc((size_t)size * (UDP_BUFSIZE + 1));
+
+	if (ring->msgs == NULL || ring->iov == NULL || ring->addrs == NULL || ring->bufs == NULL)
+		return (-1);
+	if (lat_enabled && (ring->ctrl = calloc(size, UDP_CTRLSIZE)) == NULL)
+		return (-1);
+
+	for (unsigned int i = 0; i < size; i++) {
+		ring->iov[i].iov_base		 = ring->bufs + (size_t)i * (UDP_BUFSIZE + 1);
+		ring->iov[i].iov_len		 = UDP_BUFSIZE;
+		ring->msgs[i].msg_hdr.msg_iov	 = &ring->iov[i];
+		ring->msgs[i].msg_hdr.msg_iovlen = 1;
+		ring->msgs[i].msg_hdr.msg_name	 = &ring->addrs[i];
+		if (ring->ctrl != NULL)
+			ring->msgs[i].msg_hdr.msg_control = ring->ctrl + (size_t)i * UDP_CTRLSIZE;
+	}
+	return (0);
+}
+
+/*
+ * time from the kernel receiving a datagram (its SO_TIMESTAMPNS in mh) to
+ * mono, which is now on the monotonic clock and real on the wall clock
+ */
+void
+udp_stamp(struct msghdr *mh, uint64_t mono, uint64_t real)
+{
+	struct timespec *ts;
+	struct cmsghdr * cm;
+	uint64_t	 then;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+		ts   = (struct timespec *)CMSG_DATA(cm);
+		then = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+		lat_record(LAT_RECV, mono - MIN(mono, real - MIN(real, then)), mono);
+	}
+}
+
+/*
+ * wall clock in nanoseconds, to compare with receive timestamps
+ */
+uint64_t
+udp_realtime(void)
+{
+	struct timespec real;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	return ((uint64_t)real.tv_sec * 1000000000 + real.tv_nsec);
+}
+
+/*
+ * time from the kernel receiving each datagram of a batch to now
+ */
+void
+udp_latency(struct udp_ring *ring, int count)
+{
+	uint64_t mono = lat_now(), real = udp_realtime();
+
+	for (int i = 0; i < count; i++)
+		udp_stamp(&ring->msgs[i].msg_hdr, mono, real);
+}
+
+/*
+ * hand a batch of received datagrams over to process_request()
+ */
+void
+process_batch(struct udp_ring *ring, int count)
+{
+	uint64_t bytes = 0;
+	char *	 str;
+
+	if (ring->ctrl != NULL)
+		udp_latency(ring, count);
+	epoch_enter();
+	for (int i = 0; i < count; i++) {
+		str			   = ring->iov[i].iov_base;
+		str[ring->msgs[i].msg_len] = '\0';
+		bytes += ring->msgs[i].msg_len;
+		process_request(ring->addrs[i].ss_family, (struct sockaddr *)&ring->addrs[i],
+		    SOCK_DGRAM, str, ring->msgs[i].msg_len);
+	}
+	epoch_exit();
+	reply_flush();
+	syslog_flush();
+	metric_add(M_UDP_BATCHES, 1);
+	metric_add(M_UDP_DATAGRAMS, count);
+	metric_add(M_UDP_BYTES, bytes);
+}
+
+/*
+ * Receive datagrams on a UDP listener (args points to the socket) in
+ * batches of up to udp_batch messages per system call.
+ */
 void *
-udp4_handler(void *args)
+udp_handler(void *args)
 {
-	char		   str[8192];
-	struct sockaddr_in u_other;
-	socklen_t	   sa_len;
-	ssize_t		   len;
+	struct udp_ring ring;
+	int		sockfd = *(int *)args;
+	int		count;
+
+	if (udp_ring_init(&ring, udp_batch) < 0) {
+		perror("udp ring");
+		pthread_exit(NULL);
+	}
+	if (ring.ctrl != NULL)
+		setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &(int) { 1 }, sizeof(int));
+	reply_socket(sockfd);
 
-	sa_len = sizeof(u_other);
 	while (1) {
-		if ((len = recvfrom(u_sockfd, str, sizeof(str), 0, (struct sockaddr *)&u_other,
-			 &sa_len)) > 0) {
-			process_request(u_other.sin_family, (struct sockaddr *)&u_other, SOCK_DGRAM,
-			    str);
+		for (unsigned int i = 0; i < ring.size; i++) {
+			ring.msgs[i].msg_hdr.msg_namelen = sizeof(ring.addrs[i]);
+			if (ring.ctrl != NULL)
+				ring.msgs[i].msg_hdr.msg_controllen = UDP_CTRLSIZE;
+		}
+
+		if ((count = recvmmsg(sockfd, ring.msgs, ring.size, MSG_WAITFORONE, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			metric_add(M_UDP_ERRORS, 1);
+			perror("udp recvmmsg()");
+			pthread_exit(NULL);
 		}
+		process_batch(&ring, count);
 	}
 
 	return (args); /* suppress compiler warning */
 }
 
-#ifdef PF_INET6
-
+/*
+ * Capture thread of a worker: hands the SIP payloads of every block of
+ * packets in its share of the capture ring over to process_request().
+ */
 void *
-tcp6_handler(void *args)
+cap_handler(void *args)
 {
-	int		    c;
-	struct sockaddr_in6 t_other;
-	FILE *		    client;
-	char		    str[8192];
-	socklen_t	    sa_len;
+	struct worker *w = args;
+	int	       n;
+
+	while (cap_wait(w->cap) == 0) {
+		epoch_enter();
+		n = cap_next(w->cap, process_request);
+		epoch_exit();
+		if (n < 0)
+			break;
+		syslog_flush();
+	}
+	perror("capture poll()");
+	pthread_exit(NULL);
+}
 
-	listen(t6_sockfd, BACKLOG);
+#ifdef HAVE_URING
+/*
+ * arm a multishot recvmsg() on a UDP socket, filling buffers from bufs
+ */
+int
+udp_uring_arm(struct uring *r, int fd, struct msghdr *mh, const struct uring_bufs *bufs)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r)) == NULL)
+		return (-1);
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd	       = fd;
+	sqe->addr      = (uintptr_t)mh;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bufs->group;
+	return (0);
+}
+
+/*
+ * UDP listener on io_uring: a multishot recvmsg() keeps filling provided
+ * buffers, and one io_uring_enter() both hands back the buffers of the
+ * last batch and waits for the next. Falls back to udp_handler() if the
+ * ring cannot be set up.
+ */
+void *
+udp_uring_handler(void *args)
+{
+	struct io_uring_recvmsg_out *out;
+	struct io_uring_cqe *	     cqe;
+	struct uring_bufs	     bufs;
+	struct uring		     r;
+	struct msghdr		     mh, stamp;
+	uint64_t		     bytes, mono = 0, real = 0;
+	size_t			     hdrlen, len;
+	char *			     buf;
+	bool			     armed = false;
+	int			     sockfd = *(int *)args;
+	int			     count;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_namelen	  = sizeof(struct sockaddr_storage);
+	mh.msg_controllen = lat_enabled ? UDP_CTRLSIZE : 0;
+	hdrlen		  = sizeof(*out) + mh.msg_namelen + mh.msg_controllen;
+	if (uring_init(&r, URING_ENTRIES) < 0)
+		return (udp_handler(args));
+	if (uring_bufs_init(&r, &bufs, 0, URING_BUFS, hdrlen + UDP_BUFSIZE) < 0) {
+		uring_free(&r);
+		return (udp_handler(args));
+	}
+	if (lat_enabled)
+		setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &(int) { 1 }, sizeof(int));
+	reply_socket(sockfd);
 
 	while (1) {
-		sa_len = sizeof(t6_sa);
-		if ((c = accept(t6_sockfd, (struct sockaddr *)&t_other, &sa_len)) < 0) {
-			perror("tcp6 accept()");
+		/* re-armed once it ran out of buffers */
+		if (!armed && udp_uring_arm(&r, sockfd, &mh, &bufs) == 0)
+			armed = true;
+		if (uring_submit(&r, 1) < 0) {
+			metric_add(M_UDP_ERRORS, 1);
+			perror("udp io_uring_enter()");
 			pthread_exit(NULL);
 		}
-		if ((client = fdopen(c, "r")) == NULL) {
-			perror("tcp6 fdopen()");
-			pthread_exit(NULL);
+		if (lat_enabled) {
+			mono = lat_now();
+			real = udp_realtime();
+		}
+
+		count = 0;
+		bytes = 0;
+		epoch_enter();
+		while ((cqe = uring_peek(&r)) != NULL) {
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				armed = false;
+			if (cqe->res < 0) {
+				if (cqe->res != -ENOBUFS) {
+					metric_add(M_UDP_ERRORS, 1);
+					errno = -cqe->res;
+					perror("udp recvmsg()");
+					epoch_exit();
+					pthread_exit(NULL);
+				}
+				uring_seen(&r);
+				continue;
+			}
+
+			buf	 = uring_buf(&bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			out	 = (struct io_uring_recvmsg_out *)buf;
+			len	 = cqe->res - hdrlen;
+			buf[cqe->res] = '\0';
+			if (lat_enabled) {
+				memset(&stamp, 0, sizeof(stamp));
+				stamp.msg_control    = buf + sizeof(*out) + mh.msg_namelen;
+				stamp.msg_controllen = out->controllen;
+				udp_stamp(&stamp, mono, real);
+			}
+			process_request(((struct sockaddr *)(out + 1))->sa_family,
+			    (struct sockaddr *)(out + 1), SOCK_DGRAM, buf + hdrlen, len);
+			bytes += len;
+			count++;
+			uring_bufs_put(&bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			uring_seen(&r);
+		}
+		epoch_exit();
+		uring_bufs_commit(&bufs);
+
+		if (count > 0) {
+			reply_flush();
+			syslog_flush();
+			metric_add(M_UDP_BATCHES, 1);
+			metric_add(M_UDP_DATAGRAMS, count);
+			metric_add(M_UDP_BYTES, bytes);
 		}
-		memset(str, 0, sizeof(str)); /* just in case */
-		fgets(str, sizeof(str), client);
-		process_request(t_other.sin6_family, (struct sockaddr *)&t_other, SOCK_STREAM, str);
-		fclose(client);
 	}
+
 	return (args); /* suppress compiler warning */
 }
 
+/*
+ * arm a receive on a client connection, or a multishot accept on a listener
+ */
+int
+tcp_uring_arm(struct uring *r, struct conn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r)) == NULL)
+		return (-1);
+	sqe->fd	       = conn->fd;
+	sqe->user_data = (uintptr_t)conn;
+	if (conn->listening) {
+		sqe->opcode	  = IORING_OP_ACCEPT;
+		sqe->ioprio	  = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr   = (uintptr_t)(conn->buf + conn->len);
+		sqe->len    = TCP_BUFSIZE - 1 - conn->len;
+	}
+	return (0);
+}
+
+/*
+ * close a client connection through the ring, without a completion
+ */
+void
+tcp_uring_close(struct uring *r, struct conn_table *t, struct conn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r)) == NULL) {
+		tcp_close(t, conn);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd	    = conn->fd;
+	sqe->flags  = IOSQE_CQE_SKIP_SUCCESS;
+	conn_put(t, conn);
+}
+
+/*
+ * Take over a socket accepted by the ring and start reading from it. All
+ * completions of a multishot accept share one address buffer, so the peer
+ * address is asked for instead.
+ */
+void
+tcp_uring_accept(struct uring *r, struct conn_table *t, int fd)
+{
+	struct conn *conn;
+	socklen_t    sa_len;
+
+	if ((conn = conn_new(t, conn_now())) == NULL) {
+		close(fd);
+		metric_add(M_TCP_ACCEPT_ERRORS, 1);
+		return;
+	}
+	conn->fd = fd;
+	sa_len	 = sizeof(conn->sa);
+	if (conn_buf(t, conn) == NULL ||
+	    getpeername(fd, (struct sockaddr *)&conn->sa, &sa_len) < 0 ||
+	    tcp_uring_arm(r, conn) < 0) {
+		metric_add(M_TCP_ACCEPT_ERRORS, 1);
+		tcp_close(t, conn);
+		return;
+	}
+	metric_add(M_TCP_ACCEPTED, 1);
+}
+
+/*
+ * A client timed out or was evicted while its receive is in flight: shut
+ * the socket down, which ends the receive, and close it when that
+ * completes. It holds a spare slot until then.
+ */
+void
+tcp_uring_expired(struct conn_table *t, struct conn *conn, enum conn_why why)
+{
+	(void)why;
+	conn_detach(t, conn);
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * arm a timeout completion after one tick of the connection timer wheel
+ */
+int
+tcp_uring_tick(struct uring *r, struct __kernel_timespec *ts)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r)) == NULL)
+		return (-1);
+	ts->tv_sec     = 0;
+	ts->tv_nsec    = TW_TICK * 1000000L;
+	sqe->opcode    = IORING_OP_TIMEOUT;
+	sqe->addr      = (uintptr_t)ts;
+	sqe->len       = 1;
+	sqe->user_data = (uintptr_t)ts;
+	return (0);
+}
+
+/*
+ * TCP listeners of a worker on io_uring: multishot accepts on both
+ * listeners, then one receive at a time per connection. Accepting,
+ * reading, closing and waiting for more all happen in one io_uring_enter()
+ * per round. While there are clients, a timeout completion wakes the loop
+ * up every tick to close the expired ones. Falls back to tcp_handler() if
+ * the ring cannot be set up.
+ */
 void *
-udp6_handler(void *args)
+tcp_uring_handler(void *args)
 {
-	char		    str[8192];
-	struct sockaddr_in6 u_other;
-	socklen_t	    sa_len;
-	ssize_t		    len;
+	struct worker *		 w = args;
+	struct conn		 listeners[FAM_MAX];
+	struct conn *		 conn;
+	struct conn_table *	 t;
+	struct io_uring_cqe *	 cqe;
+	struct uring		 r;
+	struct __kernel_timespec tick;
+	bool			 ticking = false;
+	unsigned int		 flags;
+	uint64_t		 now;
+	int			 nlisteners, res;
+
+	if (uring_init(&r, URING_ENTRIES) < 0)
+		return (tcp_handler(args));
+	if ((t = conn_table_new(conn_max, URING_ENTRIES, TCP_BUFSIZE, conn_idle, conn_timeout,
+		 tcp_uring_expired, &r)) == NULL) {
+		perror("tcp connection table");
+		pthread_exit(NULL);
+	}
+	if ((nlisteners = tcp_listeners(w, listeners)) < 0)
+		pthread_exit(NULL);
+	for (int i = 0; i < nlisteners; i++) {
+		if (tcp_uring_arm(&r, &listeners[i]) < 0) {
+			perror("tcp io_uring accept");
+			pthread_exit(NULL);
+		}
+	}
 
-	sa_len = sizeof(u_other);
 	while (1) {
-		if ((len = recvfrom(u6_sockfd, str, sizeof(str), 0, (struct sockaddr *)&u_other,
-			 &sa_len)) > 0) {
-			process_request(u_other.sin6_family, (struct sockaddr *)&u_other,
-			    SOCK_DGRAM, str);
+		if (!ticking && conn_wait(t) >= 0)
+			ticking = tcp_uring_tick(&r, &tick) == 0;
+		if (uring_submit(&r, 1) < 0) {
+			perror("tcp io_uring_enter()");
+			pthread_exit(NULL);
 		}
+		now = conn_now();
+		epoch_enter();
+		while ((cqe = uring_peek(&r)) != NULL) {
+			conn  = (struct conn *)(uintptr_t)cqe->user_data;
+			res   = cqe->res;
+			flags = cqe->flags;
+			uring_seen(&r);
+
+			if (conn == NULL) /* a failed close */
+				continue;
+			if ((void *)conn == &tick) {
+				ticking = false;
+			} else if (conn->listening) {
+				if (res >= 0)
+					tcp_uring_accept(&r, t, res);
+				else
+					metric_add(M_TCP_ACCEPT_ERRORS, 1);
+				if (!(flags & IORING_CQE_F_MORE) && tcp_uring_arm(&r, conn) < 0)
+					perror("tcp io_uring accept");
+			} else if (res == -EINTR || res == -EAGAIN) {
+				if (tcp_uring_arm(&r, conn) < 0)
+					tcp_close(t, conn);
+			} else if (conn->detached && res <= 0) {
+				/* shut down by tcp_uring_expired() */
+				if (conn->len > 0)
+					tcp_consume(conn, 0);
+				tcp_uring_close(&r, t, conn);
+			} else if (tcp_consume(conn, res)) {
+				tcp_uring_close(&r, t, conn);
+			} else if (tcp_uring_arm(&r, conn) < 0) {
+				tcp_close(t, conn);
+			} else {
+				conn_touch(t, conn, now);
+			}
+		}
+		conn_expire(t, now);
+		epoch_exit();
+		syslog_flush();
 	}
 
 	return (args); /* suppress compiler warning */
 }
+#endif /* HAVE_URING */
 
-#endif /* PF_INET6 */
+/*
+ * Listen for metrics scrapes on metrics_addr: a port on the loopback
+ * interface, or the path of a UNIX socket if it contains a slash.
+ */
+int
+metrics_listen(void)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *  sa;
+	socklen_t	   salen;
+	char *		   end;
+	long		   port;
+
+	if (strchr(metrics_addr, '/') != NULL) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(metrics_addr) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		memcpy(sun.sun_path, metrics_addr, strlen(metrics_addr));
+		unlink(metrics_addr);
+		sa    = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	} else {
+		port = strtol(metrics_addr, &end, 10);
+		if (*end != '\0' || port < 1 || port > 65535) {
+			errno = EINVAL;
+			return (-1);
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family	    = AF_INET;
+		sin.sin_port	    = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa		    = (struct sockaddr *)&sin;
+		salen		    = sizeof(sin);
+	}
+
+	if ((metrics_fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return (-1);
+	if ((sa->sa_family == AF_INET && set_reuse(metrics_fd, "metrics setsockopt()") < 0) ||
+	    bind(metrics_fd, sa, salen) < 0 || listen(metrics_fd, 16) < 0) {
+		close(metrics_fd);
+		metrics_fd = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * dump latency histograms (and the flight recorder if trace is set) to fp
+ */
+void
+dump_latency(FILE *fp, bool trace)
+{
+	if (!lat_enabled) {
+		fprintf(fp, "latency tracking is off, see -L\n");
+		return;
+	}
+	lat_dump(fp);
+	if (trace)
+		lat_dumptrace(fp);
+}
+
+/*
+ * Answer every connection on the metrics socket over HTTP/1.0: /latency
+ * and /trace get the latency histograms and flight recorder, any other path
+ * the current counters in Prometheus text format. Counters are only read
+ * here.
+ */
+void *
+metrics_server(void *arg)
+{
+	static char    counters[16384];
+	char	       req[1024], hdr[256], *body;
+	struct iovec   iov[2];
+	struct timeval tv = { 1, 0 };
+	size_t	       len;
+	ssize_t	       r;
+	FILE *	       fp;
+	int	       c, n;
+
+	(void)arg;
+	while (1) {
+		if ((c = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+			continue;
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		if ((r = recv(c, req, sizeof(req) - 1, 0)) <= 0 ||
+		    (fp = open_memstream(&body, &len)) == NULL) {
+			close(c);
+			continue;
+		}
+		req[r] = '\0';
+
+		if (strncmp(req, "GET /latency ", 13) == 0) {
+			dump_latency(fp, false);
+		} else if (strncmp(req, "GET /trace ", 11) == 0) {
+			dump_latency(fp, true);
+		} else {
+			fwrite(counters, 1, metrics_render(counters, sizeof(counters)), fp);
+			epoch_enter();
+			if (lfh != NULL)
+				fprintf(fp,
+				    "# HELP fsipd_log_dropped_total Records dropped by a full log "
+				    "queue.\n"
+				    "# TYPE fsipd_log_dropped_total counter\n"
+				    "fsipd_log_dropped_total %llu\n",
+				    (unsigned long long)log_drops(lfh));
+			fwrite(counters, 1, sinks_render(counters, sizeof(counters), lfh), fp);
+			epoch_exit();
+		}
+		fclose(fp);
+
+		n = snprintf(hdr, sizeof(hdr),
+		    "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n",
+		    len);
+		iov[0].iov_base = hdr;
+		iov[0].iov_len	= n;
+		iov[1].iov_base = body;
+		iov[1].iov_len	= len;
+		writev(c, iov, 2);
+		close(c);
+		free(body);
+	}
+
+	return (NULL);
+}
+
+/*
+ * write latency histograms and flight recorder to <log file>.latency
+ * whenever SIGUSR2 posts lat_sem
+ */
+void *
+lat_dumper(void *arg)
+{
+	char  path[MAXPATHLEN];
+	FILE *fp;
+
+	(void)arg;
+	snprintf(path, sizeof(path), "%s.latency", logfilename == NULL ? "fsipd" : logfilename);
+	while (1) {
+		while (sem_wait(&lat_sem) != 0)
+			;
+		if ((fp = fopen(path, "w")) == NULL)
+			continue;
+		dump_latency(fp, true);
+		fclose(fp);
+	}
+
+	return (NULL);
+}
 
 void
 init_logger()
 {
-	if (use_syslog) {
+	if (use_syslog || syslog_out) {
 		/* initialize facility and level parameters */
 		if (syslog_pri == -1) /* not specidied by user, use default */
 			syslog_pri = LOG_USER | LOG_NOTICE | LOG_PID;
-	} else {
+		if (slog_dest != NULL && (slog = slog_open(slog_dest, syslog_pri)) == NULL)
+			err(EXIT_FAILURE, "Cannot send to syslog at \"%s\"", slog_dest);
+	}
+	if (log_fmt == LOG_BINARY)
+		log_format_fn = format_binary;
+	else
+		log_format_fn = sip_csv ? format_sip : format_csv;
+	if (!use_syslog && (noutputs == 0 || file_out)) {
 		/* open a log file in current directory */
 		if (logfilename == NULL)
 			logfilename = strdup("fsipd.log");
 		if ((lfh = log_open(logfilename, 0644)) == NULL)
 			err(EXIT_FAILURE, "Cannot open log file \"%s\"", logfilename);
+		if (log_zlevel > 0 && log_compress(lfh, log_zlevel) == -1)
+			err(EXIT_FAILURE, "Cannot compress log file \"%s\"", logfilename);
+		if (log_sync != LOG_SYNC &&
+		    log_durability(lfh, log_sync, sync_recs, sync_msecs) == -1)
+			err(EXIT_FAILURE, "Cannot reopen log file \"%s\"", logfilename);
+		if (log_format(lfh, log_fmt) == -1)
+			err(EXIT_FAILURE, "Log file \"%s\" is not a binary log", logfilename);
+		if (log_seg > 0 && log_mmap(lfh, log_seg) == -1)
+			err(EXIT_FAILURE, "Cannot map log file \"%s\"", logfilename);
 	}
 }
 
+/*
+ * number of online CPUs
+ */
+int
+ncpus()
+{
+	long n;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return (1);
+	return ((int)n);
+}
+
+/*
+ * Create the listener threads of a worker, pinned to the worker's CPU if it
+ * has one.
+ */
+void
+start_worker(struct worker *w)
+{
+	pthread_attr_t attr;
+	void *(*tcp)(void *) = tcp_handler;
+	void *(*udp)(void *) = udp_handler;
+
+	pthread_attr_init(&attr);
+#ifdef __linux__
+	if (w->cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+#endif /* __linux__ */
+
+#ifdef HAVE_URING
+	if (use_uring) {
+		tcp	= tcp_uring_handler;
+		udp	= udp_uring_handler;
+	}
+#endif /* HAVE_URING */
+	if (w->cap != NULL) {
+		pthread_create(&w->threads[THR_CAP], &attr, cap_handler, w);
+		pthread_attr_destroy(&attr);
+		return;
+	}
+	pthread_create(&w->threads[THR_TCP], &attr, tcp, w);
+	pthread_create(&w->threads[THR_UDP4], &attr, udp, &w->udp_fd[FAM_INET]);
+#ifdef PF_INET6
+	pthread_create(&w->threads[THR_UDP6], &attr, udp, &w->udp_fd[FAM_INET6]);
+#endif
+	pthread_attr_destroy(&attr);
+}
+
 /*
  * Daemonize and persist pid
  */
 int
 daemon_start()
 {
-	struct sigaction sig_action;
-	sigset_t	 sig_set;
-	pid_t		 otherpid;
-	int		 curPID;
-	pthread_t	 tcp4_thread, udp4_thread;
-	pthread_t	 tcp6_thread, udp6_thread;
+	sigset_t  sig_set, ctl_set;
+	pthread_t flusher, reporter, exporter, dumper, control;
+	pid_t	  otherpid;
+	int	  curPID, sigfd;
 
 	/* Check if we can acquire the pid file */
 	pfh = pidfile_open(NULL, 0644, &otherpid);
@@ -442,11 +1452,41 @@ daemon_start()
 	}
 	init_logger();
 
-	/* Initialize TCP46 and UDP46 sockets */
-	if (init_tcp() == EXIT_FAILURE)
-		return (EXIT_FAILURE);
-	if (init_udp() == EXIT_FAILURE)
-		return (EXIT_FAILURE);
+	/* Initialize TCP46 and UDP46 sockets of every worker */
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL)
+		err(EXIT_FAILURE, "Cannot allocate workers");
+	for (int i = 0; i < nworkers; i++) {
+		workers[i].cpu = reuseport ? i % ncpus() : -1;
+		if (cap_ifname != NULL) {
+			/* all workers share the packets of one fanout group */
+			if ((workers[i].cap = cap_open(cap_ifname, &cap_dports, getpid())) == NULL)
+				err(EXIT_FAILURE, "Cannot capture on \"%s\"", cap_ifname);
+			continue;
+		}
+		if (init_tcp(&workers[i]) == EXIT_FAILURE)
+			return (EXIT_FAILURE);
+		if (init_udp(&workers[i]) == EXIT_FAILURE)
+			return (EXIT_FAILURE);
+	}
+#ifdef HAVE_URING
+	if (use_uring && !uring_supported()) {
+		warnx("io_uring is not available, using recvmmsg() and epoll instead");
+		use_uring = false;
+	}
+#endif /* HAVE_URING */
+	if (metrics_addr != NULL && metrics_listen() < 0)
+		err(EXIT_FAILURE, "Cannot listen for metrics on \"%s\"", metrics_addr);
+
+	/* blocked before any thread starts, so that only sig_control() gets them */
+	sigemptyset(&ctl_set);
+	sigaddset(&ctl_set, SIGHUP);
+	sigaddset(&ctl_set, SIGINT);
+	sigaddset(&ctl_set, SIGTERM);
+	sigaddset(&ctl_set, SIGUSR1);
+	sigaddset(&ctl_set, SIGUSR2);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &ctl_set, NULL)) != 0 ||
+	    (sigfd = signalfd(-1, &ctl_set, SFD_CLOEXEC)) < 0)
+		err(EXIT_FAILURE, "Cannot set up signal handling");
 
 	/* start daemonizing */
 	curPID = fork();
@@ -479,39 +1519,58 @@ daemon_start()
 	sigprocmask(SIG_BLOCK, &sig_set, NULL); /* Block the above specified
 						 * signals */
 
-	/* Catch necessary signals */
-	sig_action.sa_handler = signal_handler;
-	sigemptyset(&sig_action.sa_mask);
-	sig_action.sa_flags = 0;
-
-	sigaction(SIGTERM, &sig_action, NULL);
-	sigaction(SIGHUP, &sig_action, NULL);
-	sigaction(SIGINT, &sig_action, NULL);
-
 	/* create new session and process group */
 	setsid();
 
 	/* persist pid */
 	pidfile_write(pfh);
 
+	/* move log writes off the receiving threads, falling back to direct writes */
+	if (lfh != NULL && log_qlen > 0) {
+		if (use_uring)
+			log_uring(lfh);
+		log_async(lfh, log_qlen, log_batchsize, log_policy);
+	}
+	/* after log_async(), starts a keeper thread for it if there is no writer */
+	if (lfh != NULL)
+		log_rotation(lfh, rot_size, rot_secs, rot_keep, rot_name);
+	if (sinks_start(slog, syslog_pri, log_fmt == LOG_TEXT) < 0) {
+		daemon_shutdown();
+		return (EXIT_FAILURE);
+	}
+
 	/* Create TCP and UDP listener threads */
-	pthread_create(&tcp4_thread, NULL, tcp4_handler, NULL);
-	pthread_create(&udp4_thread, NULL, udp4_handler, NULL);
-#ifdef PF_INET6
-	pthread_create(&tcp6_thread, NULL, tcp6_handler, NULL);
-	pthread_create(&udp6_thread, NULL, udp6_handler, NULL);
-#endif
+	for (int i = 0; i < nworkers; i++)
+		start_worker(&workers[i]);
+	if (agg_secs > 0 && pthread_create(&flusher, NULL, agg_flusher, NULL) != 0)
+		agg_secs = 0;
+	if (top_secs > 0 && pthread_create(&reporter, NULL, top_reporter, NULL) != 0)
+		top_secs = 0;
+	if (metrics_fd >= 0)
+		pthread_create(&exporter, NULL, metrics_server, NULL);
+	if (lat_enabled && sem_init(&lat_sem, 0, 0) == 0)
+		pthread_create(&dumper, NULL, lat_dumper, NULL);
+	/* last, signals received so far wait in sigfd */
+	if (pthread_create(&control, NULL, sig_control, &sigfd) != 0) {
+		daemon_shutdown();
+		return (EXIT_FAILURE);
+	}
 
 	/*
 	 * Wait for threads to terminate, which normally shouldn't ever
 	 * happen
 	 */
-	pthread_join(tcp4_thread, NULL);
-	pthread_join(udp4_thread, NULL);
+	for (int i = 0; i < nworkers; i++) {
+		if (workers[i].cap != NULL) {
+			pthread_join(workers[i].threads[THR_CAP], NULL);
+			continue;
+		}
+		pthread_join(workers[i].threads[THR_TCP], NULL);
+		pthread_join(workers[i].threads[THR_UDP4], NULL);
 #ifdef PF_INET6
-	pthread_join(tcp6_thread, NULL);
-	pthread_join(udp6_thread, NULL);
+		pthread_join(workers[i].threads[THR_UDP6], NULL);
 #endif
+	}
 
 	return (EXIT_SUCCESS);
 }
@@ -519,11 +1578,71 @@ daemon_start()
 void
 usage()
 {
-	printf("usage: fsipd [-h] [-l logfile] [-s] [-p priority] \n");
+	printf("usage: fsipd [-h] [-l logfile] [-s] [-S path|host[:port]] [-p priority]\n"
+	       "             [-b batch] [-w workers] [-q queue] [-o block|drop]\n"
+	       "             [-d sync|group[:records[:msecs]]|none]\n"
+	       "             [-f csv|sip|binary] [-m segment] [-z level] [-M method,...]\n"
+	       "             [-R size[:secs[:keep[:pattern]]]]\n"
+	       "             [-O file|syslog|path[:queue[:batch[:block|drop]]]] ...\n"
+	       "             [-a secs[:entries]] [-t secs[:count]] [-e port|path]\n"
+	       "             [-C connections[:idle[:timeout]]] [-r]\n"
+	       "             [-L] [-U] [-c interface [-P ports]]\n");
 	printf("\t-h: this message\n");
 	printf("\t-s: use syslog instead of local log file\n");
+	printf("\t-S: send RFC 5424 messages to this UNIX datagram socket or UDP host in\n"
+	       "\t    batches, dropping what the socket cannot take (default port: %s)\n",
+	    SLOG_PORT);
 	printf("\t-p: syslog priotiry (default: user.notice)\n");
 	printf("\t-l: specify output log filename (default: fsipd.log)\n");
+	printf("\t-b: number of UDP datagrams received per system call (default: %d)\n",
+	    UDP_BATCH);
+	printf("\t-w: number of SO_REUSEPORT workers, each pinned to a CPU (0: one per CPU)\n");
+	printf("\t-q: log records queued for the writer thread (default: %d, 0: write directly,\n"
+	       "\t    at most %d records of %d bytes, all queues together at most %d MB)\n",
+	    LOG_QLEN, LOGQ_MAX, LOG_RECSIZE, LOGQ_MAXBYTES >> 20);
+	printf("\t-o: when the log queue is full, block or drop records (default: block)\n");
+	printf("\t-d: log durability, sync every write, group commit (default: %d records or\n"
+	       "\t    %d msecs) or leave it to the kernel (default: sync)\n",
+	    SYNC_RECS, SYNC_MSECS);
+	printf("\t-f: log file format, csv, csv with parsed SIP fields (sip) or binary\n"
+	       "\t    (see fsipd-dump) (default: csv)\n");
+	printf("\t-m: append through preallocated mmap segments of this many MB, 1-%d\n"
+	       "\t    (default: off)\n",
+	    LOG_MAXSEG / (1024 * 1024));
+	printf("\t-z: gzip the log file on the fly at this level, 1-9 (default: off)\n");
+	printf("\t-R: rotate the log file at size MB and/or every secs seconds (0: never),\n"
+	       "\t    keep the newest keep files (default: all), named by the strftime()\n"
+	       "\t    pattern (default: <logfile>%s)\n",
+	    LOG_ROTNAME);
+	printf("\t-O: write to each of these outputs, the log file, syslog (-s, -S, -p) or\n"
+	       "\t    a UNIX datagram socket, with a queue of its own (default: %d records,\n"
+	       "\t    -q for the file, limits as for -q), written batch records at a time\n"
+	       "\t    (default: %d), dropping or blocking when it is full (default: drop,\n"
+	       "\t    -o for the file) (default: the log file, or syslog with -s or -S)\n",
+	    SINK_QLEN, LOG_BATCH);
+	printf("\t-M: only log requests with one of these methods (default: log everything)\n");
+	printf("\t-a: log one summary per source and method every secs seconds, tracking at\n"
+	       "\t    most entries sources per thread (default: off, %d entries)\n",
+	    AGG_ENTRIES);
+	printf("\t-t: track the heaviest sources, methods and user agents, log the top count\n"
+	       "\t    of each every secs seconds and on SIGUSR1 (default: off, %d)\n",
+	    HH_TOP);
+	printf("\t-C: keep at most this many TCP clients per thread, evicting the oldest, and\n"
+	       "\t    close those silent for idle or still sending after timeout seconds\n"
+	       "\t    (default: %d:%d:%d)\n",
+	    CONN_MAX, CONN_IDLE, CONN_TIMEOUT);
+	printf("\t-r: answer UDP requests like a PBX (200 OK, or 401 Unauthorized to REGISTER\n"
+	       "\t    and INVITE), so that scanners go on with their next request\n");
+	printf("\t-e: serve Prometheus metrics on this loopback port or UNIX socket path\n"
+	       "\t    (default: off)\n");
+	printf("\t-L: time every stage of a request, dump the histograms and last events on\n"
+	       "\t    SIGUSR2 (into <logfile>.latency) or via -e at /latency and /trace\n");
+	printf("\t-U: receive, accept and write the log through io_uring (Linux 6.0 or later),\n"
+	       "\t    falling back to recvmmsg() and epoll on older kernels\n");
+	printf("\t-c: do not listen, capture the requests sent to the ports on this interface\n"
+	       "\t    (needs CAP_NET_RAW, \"any\" for all interfaces)\n");
+	printf("\t-P: ports and port ranges to capture, e.g. 5060,5070-5080 (default: %s)\n",
+	    CAP_PORTS);
 }
 
 static int
@@ -565,26 +1684,286 @@ decodepri(char *s)
 	return ((lev & LOG_PRIMASK) | (fac & LOG_FACMASK));
 }
 
+/*
+ * parse aggregation interval and table size: secs[:entries]
+ */
+static void
+decodeagg(char *s)
+{
+	char *p;
+
+	agg_secs = strtoul(s, &p, 10);
+	if (p == s || agg_secs == 0)
+		errx(EX_USAGE, "aggregation interval must be a positive number of seconds");
+	if (*p == ':') {
+		agg_size = strtoul(p + 1, &p, 10);
+		if (agg_size < AGG_PROBES)
+			errx(EX_USAGE, "aggregation table needs at least %d entries", AGG_PROBES);
+	}
+	if (*p != '\0')
+		errx(EX_USAGE, "aggregation must be secs[:entries]");
+	parse_sip = true;
+}
+
+/*
+ * parse log rotation size (MB), interval, retention and name pattern:
+ * size[:secs[:keep[:pattern]]]
+ */
+static void
+decoderotate(char *s)
+{
+	char *p;
+
+	rot_size = strtoul(s, &p, 10) * 1024 * 1024;
+	if (p == s)
+		errx(EX_USAGE, "rotation size must be a number of MB");
+	if (*p == ':') {
+		rot_secs = strtoul(p + 1, &p, 10);
+		if (*p == ':') {
+			rot_keep = strtoul(p + 1, &p, 10);
+			if (*p == ':' && p[1] != '\0') {
+				rot_name = strdup(p + 1);
+				p += strlen(p);
+			}
+		}
+	}
+	if (*p != '\0')
+		errx(EX_USAGE, "rotation must be size[:secs[:keep[:pattern]]]");
+	if (rot_size == 0 && rot_secs == 0)
+		errx(EX_USAGE, "rotation needs a size or an interval");
+}
+
+/*
+ * parse an output and its queue: file|syslog|path[:queue[:batch[:block|drop]]]
+ */
+static void
+decodeoutput(char *s)
+{
+	struct sink_cfg cfg;
+
+	if (sink_parse(s, &cfg) == -1)
+		errx(EX_USAGE, "output must be file|syslog|path[:queue[:batch[:block|drop]]]");
+	if (cfg.kind == SINK_FILE) {
+		if (file_out)
+			errx(EX_USAGE, "output \"file\" given twice");
+		file_out = true;
+		if (cfg.qlen > 0)
+			log_qlen = cfg.qlen;
+		log_batchsize = cfg.batch;
+		if (cfg.has_policy)
+			log_policy = cfg.policy;
+	} else {
+		if (sink_add(&cfg) == -1) {
+			if (errno == ENOBUFS)
+				errx(EX_USAGE, "log queues must not take more than %d MB together",
+				    LOGQ_MAXBYTES >> 20);
+			err(EX_USAGE, "Cannot add output \"%s\"", s);
+		}
+		if (cfg.kind == SINK_SYSLOG)
+			syslog_out = true;
+	}
+	noutputs++;
+}
+
+/*
+ * parse the TCP connection limit and timeouts: connections[:idle[:timeout]]
+ */
+static void
+decodeconn(char *s)
+{
+	char *p;
+
+	conn_max = strtoul(s, &p, 10);
+	if (p == s || conn_max == 0)
+		errx(EX_USAGE, "connection limit must be a positive number");
+	if (*p == ':') {
+		conn_idle = strtoul(p + 1, &p, 10) * 1000;
+		if (*p == ':')
+			conn_timeout = strtoul(p + 1, &p, 10) * 1000;
+	}
+	if (*p != '\0' || conn_idle == 0 || conn_timeout == 0)
+		errx(EX_USAGE, "connection limits must be connections[:idle[:timeout]], "
+			       "timeouts in seconds");
+}
+
+/*
+ * parse heavy-hitter report interval and length: secs[:count]
+ */
+static void
+decodetop(char *s)
+{
+	char *p;
+
+	top_secs = strtoul(s, &p, 10);
+	if (p == s || top_secs == 0)
+		errx(EX_USAGE, "report interval must be a positive number of seconds");
+	if (*p == ':') {
+		top_k = strtol(p + 1, &p, 10);
+		if (top_k < 1 || top_k > HH_SLOTS)
+			errx(EX_USAGE, "report length must be between 1 and %d", HH_SLOTS);
+	}
+	if (*p != '\0')
+		errx(EX_USAGE, "heavy-hitter reports must be secs[:count]");
+	parse_sip = true;
+}
+
+/*
+ * parse durability policy: sync, none or group[:records[:msecs]]
+ */
+static void
+decodesync(char *s)
+{
+	char *p;
+
+	if (strcmp(s, "sync") == 0) {
+		log_sync = LOG_SYNC;
+	} else if (strcmp(s, "none") == 0) {
+		log_sync = LOG_NONE;
+	} else if (strncmp(s, "group", 5) == 0 && (s[5] == '\0' || s[5] == ':')) {
+		log_sync = LOG_GROUP;
+		if (s[5] == ':') {
+			sync_recs = strtoul(s + 6, &p, 10);
+			if (*p == ':')
+				sync_msecs = strtoul(p + 1, &p, 10);
+			if (*p != '\0' || sync_recs == 0)
+				errx(EX_USAGE, "invalid group commit setting: %s", s);
+		}
+	} else {
+		errx(EX_USAGE, "durability must be \"sync\", \"group\" or \"none\"");
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
-	int opt;
+	char *end;
+	int   opt;
 
-	while ((opt = getopt(argc, argv, "hl:sp:")) != -1) {
+	cap_ports(&cap_dports, CAP_PORTS);
+	while ((opt = getopt(argc, argv, "hl:sS:p:b:w:q:o:d:f:m:z:M:a:t:e:LUc:P:C:rR:O:")) != -1) {
 		switch (opt) {
 		case 's':
 			use_syslog = true;
 			break;
+		case 'S':
+			use_syslog = true;
+			slog_dest  = optarg;
+			break;
 		case 'p':
 			if (use_syslog) {
 				syslog_pri = decodepri(optarg) | LOG_PID;
 			} else {
-				errx(EX_USAGE, "you need to specify \"-s\".");
+				errx(EX_USAGE, "you need to specify \"-s\" or \"-S\".");
 			}
 			break;
 		case 'l':
 			logfilename = strdup(optarg);
 			break;
+		case 'b':
+			udp_batch = atoi(optarg);
+			if (udp_batch < 1 || udp_batch > UDP_MAXBATCH)
+				errx(EX_USAGE, "batch size must be between 1 and %d", UDP_MAXBATCH);
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 0 || nworkers > MAX_WORKERS)
+				errx(EX_USAGE, "number of workers must be between 0 and %d",
+				    MAX_WORKERS);
+			if (nworkers == 0)
+				nworkers = ncpus();
+			reuseport = true;
+			break;
+		case 'q':
+			errno	 = 0;
+			log_qlen = strtoul(optarg, &end, 10);
+			if (*optarg < '0' || *optarg > '9' || *end != '\0' || errno != 0 ||
+			    log_qlen > LOGQ_MAX)
+				errx(EX_USAGE, "log queue must be between 0 and %d records",
+				    LOGQ_MAX);
+			break;
+		case 'o':
+			if (strcmp(optarg, "block") == 0)
+				log_policy = LOG_BLOCK;
+			else if (strcmp(optarg, "drop") == 0)
+				log_policy = LOG_DROP;
+			else
+				errx(EX_USAGE, "overflow policy must be \"block\" or \"drop\"");
+			break;
+		case 'd':
+			decodesync(optarg);
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0)
+				log_fmt = LOG_TEXT;
+			else if (strcmp(optarg, "binary") == 0)
+				log_fmt = LOG_BINARY;
+			else if (strcmp(optarg, "sip") == 0)
+				sip_csv = parse_sip = true;
+			else
+				errx(EX_USAGE, "log format must be \"csv\", \"sip\" or \"binary\"");
+			break;
+		case 'M':
+			for (char *m = strtok(optarg, ","); m != NULL; m = strtok(NULL, ",")) {
+				if (nmethods == MAX_METHODS)
+					errx(EX_USAGE, "too many methods, at most %d", MAX_METHODS);
+				methods[nmethods++] = strdup(m);
+			}
+			parse_sip = true;
+			break;
+		case 'a':
+			decodeagg(optarg);
+			break;
+		case 't':
+			decodetop(optarg);
+			break;
+		case 'C':
+			decodeconn(optarg);
+			break;
+		case 'r':
+			respond = parse_sip = true;
+			break;
+		case 'R':
+			decoderotate(optarg);
+			break;
+		case 'O':
+			decodeoutput(optarg);
+			break;
+		case 'e':
+			metrics_addr = strdup(optarg);
+			break;
+		case 'U':
+#ifndef HAVE_URING
+			errx(EX_USAGE, "fsipd was built without io_uring support");
+#endif /* HAVE_URING */
+			use_uring = true;
+			break;
+		case 'c':
+			cap_ifname = strdup(optarg);
+			break;
+		case 'P':
+			if (cap_ports(&cap_dports, optarg) < 0)
+				errx(EX_USAGE, "expected a list of at most %d ports and ranges",
+				    CAP_MAXRANGES);
+			break;
+		case 'L':
+			lat_enabled = true;
+			break;
+		case 'm':
+			errno	= 0;
+			log_seg = strtoul(optarg, &end, 10);
+			if (*optarg < '0' || *optarg > '9' || *end != '\0' || errno != 0 ||
+			    log_seg == 0 || log_seg > LOG_MAXSEG / (1024 * 1024))
+				errx(EX_USAGE, "mmap segment must be between 1 and %d MB",
+				    LOG_MAXSEG / (1024 * 1024));
+			log_seg *= 1024 * 1024;
+			if (log_seg % sysconf(_SC_PAGESIZE) != 0)
+				errx(EX_USAGE, "mmap segment must be a multiple of the page size");
+			break;
+		case 'z':
+			log_zlevel = atoi(optarg);
+			if (log_zlevel < 1 || log_zlevel > 9)
+				errx(EX_USAGE, "compression level must be between 1 and 9");
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -596,5 +1975,24 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* -O lists every output, -s and -S only pick the syslog flavor then */
+	if (noutputs > 0)
+		use_syslog = false;
+	/* -O queues are set up already, the one of the log file comes later */
+	if (!use_syslog && (noutputs == 0 || file_out) && log_qlen > 0 &&
+	    logq_size(log_qlen) > logq_room())
+		errx(EX_USAGE, "log queues must not take more than %d MB together",
+		    LOGQ_MAXBYTES >> 20);
+	if (agg_secs > 0 && log_fmt == LOG_BINARY)
+		errx(EX_USAGE, "aggregation summaries cannot be written to a binary log");
+	if (top_secs > 0) {
+		if (log_fmt == LOG_BINARY)
+			errx(EX_USAGE, "heavy-hitter reports cannot be written to a binary log");
+		if ((hh = hh_new()) == NULL || sem_init(&top_sem, 0, 0) != 0)
+			err(EX_OSERR, "heavy-hitter tracker");
+	}
+
+	scan_init();
+	reply_init();
 	return (daemon_start());
 }
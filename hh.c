@@ -0,0 +1,327 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "banned.h"
+#include "hh.h"
+
+/*
+ * Heavy-hitter tracking. Every key is counted in a count-min sketch of its
+ * dimension; the sketch estimate decides whether the key belongs in the
+ * space-saving list of the HH_SLOTS heaviest keys, where it replaces the
+ * lightest one. Each receiving thread updates its own shard without locks
+ * or atomic read-modify-write instructions. Readers merge the lists of all
+ * shards and sum the sketch estimates of every candidate key.
+ */
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline uint64_t
+fnv(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t       h = FNV_OFFSET;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return (h);
+}
+
+/*
+ * counter of row for hash h, rows are indexed by double hashing
+ */
+static inline atomic_uint_least32_t *
+hh_counter(struct hh_shard *shard, enum hh_dim dim, int row, uint64_t h)
+{
+	uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+
+	return (&shard->cms[dim][row][(h1 + row * h2) & (HH_WIDTH - 1)]);
+}
+
+/*
+ * sketch estimate of hash h in shard
+ */
+static uint32_t
+hh_estimate(struct hh_shard *shard, enum hh_dim dim, uint64_t h)
+{
+	uint32_t est = UINT32_MAX, v;
+
+	for (int row = 0; row < HH_DEPTH; row++) {
+		v = atomic_load_explicit(hh_counter(shard, dim, row, h), memory_order_relaxed);
+		if (v < est)
+			est = v;
+	}
+	return (est);
+}
+
+static inline void
+hh_wbegin(struct hh_topk *top)
+{
+	unsigned int seq = atomic_load_explicit(&top->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&top->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+hh_wend(struct hh_topk *top)
+{
+	unsigned int seq = atomic_load_explicit(&top->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&top->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * start counting interval gen, called by the owner of shard
+ */
+static void
+hh_reset(struct hh_shard *shard, unsigned int gen)
+{
+	memset(shard->cms, 0, sizeof(shard->cms));
+	for (int dim = 0; dim < HH_NDIMS; dim++) {
+		hh_wbegin(&shard->top[dim]);
+		shard->top[dim].n   = 0;
+		shard->top[dim].min = 0;
+		hh_wend(&shard->top[dim]);
+	}
+	atomic_store_explicit(&shard->gen, gen, memory_order_release);
+}
+
+struct hh *
+hh_new(void)
+{
+	struct hh *hh;
+
+	if ((hh = calloc(1, sizeof(*hh))) == NULL)
+		return (NULL);
+	pthread_mutex_init(&hh->lock, NULL);
+
+	return (hh);
+}
+
+/*
+ * add a shard for the calling thread, NULL when out of memory or shards
+ */
+struct hh_shard *
+hh_shard_new(struct hh *hh)
+{
+	struct hh_shard *shard;
+	int		 n;
+
+	if ((shard = calloc(1, sizeof(*shard))) == NULL)
+		return (NULL);
+	shard->hh  = hh;
+	shard->gen = atomic_load(&hh->gen);
+
+	pthread_mutex_lock(&hh->lock);
+	n = atomic_load_explicit(&hh->nshards, memory_order_relaxed);
+	if (n == HH_SHARDS) {
+		pthread_mutex_unlock(&hh->lock);
+		free(shard);
+		return (NULL);
+	}
+	hh->shards[n] = shard;
+	atomic_store_explicit(&hh->nshards, n + 1, memory_order_release);
+	pthread_mutex_unlock(&hh->lock);
+
+	return (shard);
+}
+
+/*
+ * count one occurrence of key (cut to HH_KEYLEN bytes) in dimension dim
+ */
+void
+hh_add(struct hh_shard *shard, enum hh_dim dim, const void *key, size_t len)
+{
+	struct hh_topk *top = &shard->top[dim];
+	uint64_t	h;
+	uint32_t	est = UINT32_MAX, v, old;
+	unsigned int	gen;
+	int		i;
+
+	gen = atomic_load_explicit(&shard->hh->gen, memory_order_relaxed);
+	if (atomic_load_explicit(&shard->gen, memory_order_relaxed) != gen)
+		hh_reset(shard, gen);
+
+	if (len > HH_KEYLEN)
+		len = HH_KEYLEN;
+	h = fnv(key, len);
+	for (int row = 0; row < HH_DEPTH; row++) {
+		atomic_uint_least32_t *c = hh_counter(shard, dim, row, h);
+
+		v = atomic_load_explicit(c, memory_order_relaxed) + 1;
+		atomic_store_explicit(c, v, memory_order_relaxed);
+		if (v < est)
+			est = v;
+	}
+
+	/*
+	 * A tracked key was at least min when last counted and its estimate
+	 * only grows, so anything not above min is neither tracked nor heavy
+	 * enough to replace a tracked key.
+	 */
+	if (top->n == HH_SLOTS && est <= top->min)
+		return;
+
+	for (i = 0; i < (int)top->n; i++)
+		if (top->hash[i] == h && top->key[i].len == len &&
+		    memcmp(top->key[i].data, key, len) == 0)
+			break;
+
+	if (i == (int)top->n) {
+		if (top->n == HH_SLOTS) {
+			for (i = 0; top->count[i] != top->min; i++)
+				;
+		}
+		hh_wbegin(top);
+		top->hash[i]	= h;
+		top->key[i].len = len;
+		memcpy(top->key[i].data, key, len);
+		if (i == (int)top->n)
+			top->n++;
+		hh_wend(top);
+		old = top->n == HH_SLOTS ? top->min : 0;
+	} else {
+		old = top->count[i];
+	}
+	top->count[i] = est;
+
+	if (top->n == HH_SLOTS && old == top->min) {
+		top->min = UINT32_MAX;
+		for (i = 0; i < HH_SLOTS; i++)
+			if (top->count[i] < top->min)
+				top->min = top->count[i];
+	}
+}
+
+static int
+cmp_hash(const void *a, const void *b)
+{
+	const struct hh_item *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return (x->hash < y->hash ? -1 : 1);
+	if (x->keylen != y->keylen)
+		return (x->keylen - y->keylen);
+	return (memcmp(x->key, y->key, x->keylen));
+}
+
+static int
+cmp_count(const void *a, const void *b)
+{
+	const struct hh_item *x = a, *y = b;
+
+	if (x->count != y->count)
+		return (x->count > y->count ? -1 : 1);
+	return (0);
+}
+
+/*
+ * copy the tracked keys of a shard into items, returns their number
+ */
+static int
+hh_snapshot(struct hh_topk *top, enum hh_dim dim, struct hh_item *items)
+{
+	unsigned int seq;
+	uint32_t     n;
+
+	do {
+		seq = atomic_load_explicit(&top->seq, memory_order_acquire);
+		n   = top->n;
+		if (n > HH_SLOTS)
+			n = HH_SLOTS;
+		for (uint32_t i = 0; i < n; i++) {
+			items[i].dim	= dim;
+			items[i].hash	= top->hash[i];
+			items[i].keylen = top->key[i].len;
+			memcpy(items[i].key, top->key[i].data, sizeof(items[i].key));
+		}
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq != atomic_load_explicit(&top->seq, memory_order_relaxed));
+
+	return (n);
+}
+
+/*
+ * Merge the shards counting in the current interval and store up to k of
+ * the heaviest keys of dimension dim in items, heaviest first. Returns the
+ * number of items stored, -1 when out of memory.
+ */
+int
+hh_top(struct hh *hh, enum hh_dim dim, struct hh_item *items, int k)
+{
+	struct hh_shard *shard;
+	struct hh_item * cand;
+	unsigned int	 gen;
+	int		 nshards, ncand = 0, n = 0;
+
+	nshards = atomic_load_explicit(&hh->nshards, memory_order_acquire);
+	gen	= atomic_load(&hh->gen);
+	if ((cand = malloc((nshards * HH_SLOTS + 1) * sizeof(*cand))) == NULL)
+		return (-1);
+
+	for (int s = 0; s < nshards; s++) {
+		shard = hh->shards[s];
+		if (atomic_load_explicit(&shard->gen, memory_order_acquire) == gen)
+			ncand += hh_snapshot(&shard->top[dim], dim, cand + ncand);
+	}
+
+	/* drop duplicates and sum the estimates of all shards */
+	qsort(cand, ncand, sizeof(*cand), cmp_hash);
+	for (int i = 0; i < ncand; i++) {
+		if (n > 0 && cmp_hash(&cand[n - 1], &cand[i]) == 0)
+			continue;
+		cand[n] = cand[i];
+		cand[n].count = 0;
+		for (int s = 0; s < nshards; s++) {
+			shard = hh->shards[s];
+			if (atomic_load_explicit(&shard->gen, memory_order_relaxed) == gen)
+				cand[n].count += hh_estimate(shard, dim, cand[n].hash);
+		}
+		n++;
+	}
+
+	qsort(cand, n, sizeof(*cand), cmp_count);
+	if (n > k)
+		n = k;
+	memcpy(items, cand, n * sizeof(*items));
+	free(cand);
+
+	return (n);
+}
+
+/*
+ * start a new interval, shards reset themselves when they count next
+ */
+void
+hh_rotate(struct hh *hh)
+{
+	atomic_fetch_add(&hh->gen, 1);
+}
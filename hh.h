@@ -0,0 +1,118 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HH_H
+#define _HH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HH_DEPTH 4	  /* count-min rows */
+#define HH_WIDTH 1024	  /* counters per row, a power of two */
+#define HH_SLOTS 32	  /* keys tracked per dimension and shard */
+#define HH_KEYLEN 64	  /* longer keys are cut, and counted together */
+#define HH_SHARDS 1024	  /* at most this many threads may feed a tracker */
+#define HH_TOP 10	  /* default number of keys reported per dimension */
+
+/* what is counted */
+enum hh_dim { HH_SRC, HH_UA, HH_METHOD, HH_NDIMS };
+
+/*
+ * A key and its estimated count. For HH_SRC the key holds the 4 or 16 raw
+ * address bytes.
+ */
+struct hh_item {
+	uint64_t count;
+	uint64_t hash;
+	uint8_t	 dim;
+	uint8_t	 keylen;
+	char	 key[HH_KEYLEN];
+};
+
+/*
+ * Space-saving list of the heaviest keys a shard has seen in one dimension.
+ * Keys are only replaced between two increments of seq (odd while they
+ * change), so a reader can copy them without a lock; counts are
+ * approximate anyway.
+ */
+struct hh_topk {
+	atomic_uint	seq;
+	uint32_t	n;
+	uint32_t	min; /* smallest count once full */
+	uint64_t	hash[HH_SLOTS];
+	uint32_t	count[HH_SLOTS];
+	struct {
+		uint8_t len;
+		char	data[HH_KEYLEN];
+	} key[HH_SLOTS];
+};
+
+/*
+ * Per-thread part of a tracker, written by its owner thread only. Counters
+ * are reset lazily by the owner when the tracker starts a new interval.
+ */
+struct hh_shard {
+	atomic_uint_least32_t cms[HH_NDIMS][HH_DEPTH][HH_WIDTH];
+	struct hh_topk	      top[HH_NDIMS];
+	atomic_uint	      gen; /* interval the counters belong to */
+	struct hh *	      hh;
+};
+
+/*
+ * Heavy-hitter tracker: one shard per thread, merged when read.
+ */
+struct hh {
+	struct hh_shard *shards[HH_SHARDS];
+	atomic_int	 nshards;
+	atomic_uint	 gen; /* current interval */
+	pthread_mutex_t	 lock;
+};
+
+struct hh *	 hh_new(void);
+struct hh_shard *hh_shard_new(struct hh *hh);
+void		 hh_add(struct hh_shard *shard, enum hh_dim dim, const void *key, size_t len);
+int		 hh_top(struct hh *hh, enum hh_dim dim, struct hh_item *items, int k);
+void		 hh_rotate(struct hh *hh);
+
+/* name of a dimension in reports, inline so record.c needs no hh.o */
+static inline const char *
+hh_dimname(enum hh_dim dim)
+{
+	switch (dim) {
+	case HH_SRC:
+		return ("src");
+	case HH_UA:
+		return ("user-agent");
+	case HH_METHOD:
+		return ("method");
+	default:
+		return ("");
+	}
+}
+
+#endif /* _HH_H */
@@ -0,0 +1,139 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hh.h"
+
+#define THREADS 4
+#define KEYS 10000
+#define HEAVIEST 20000 /* key i occurs HEAVIEST / (i + 1) times per thread */
+
+/*
+ * Feed a Zipf-like stream of KEYS distinct keys from several threads while
+ * the main thread keeps merging, then check that the heaviest keys come
+ * out on top and no count is underestimated.
+ */
+
+struct hh *hh;
+int *	   stream;
+size_t	   nstream;
+bool	   done;
+
+static size_t
+keyname(char *buf, int key)
+{
+	return (snprintf(buf, 16, "key%d", key));
+}
+
+void *
+feeder(void *arg)
+{
+	struct hh_shard *shard;
+	char		 buf[16];
+	size_t		 len;
+
+	(void)arg;
+	if ((shard = hh_shard_new(hh)) == NULL)
+		errx(1, "hh_shard_new failed");
+	for (size_t i = 0; i < nstream; i++) {
+		len = keyname(buf, stream[i]);
+		hh_add(shard, HH_UA, buf, len);
+	}
+
+	return (NULL);
+}
+
+int
+main(void)
+{
+	struct hh_shard *shard;
+	struct hh_item	 items[HH_SLOTS];
+	pthread_t	 threads[THREADS];
+	char		 buf[16];
+	size_t		 n = 0, len;
+	int		 tmp, j, merges = 0;
+
+	for (int k = 0; k < KEYS; k++)
+		nstream += HEAVIEST / (k + 1);
+	if ((stream = malloc(nstream * sizeof(*stream))) == NULL || (hh = hh_new()) == NULL)
+		err(1, "malloc");
+	for (int k = 0; k < KEYS; k++)
+		for (int i = 0; i < HEAVIEST / (k + 1); i++)
+			stream[n++] = k;
+	srandom(5060);
+	for (size_t i = nstream - 1; i > 0; i--) {
+		j	  = random() % (i + 1);
+		tmp	  = stream[i];
+		stream[i] = stream[j];
+		stream[j] = tmp;
+	}
+
+	for (int t = 0; t < THREADS; t++)
+		pthread_create(&threads[t], NULL, feeder, NULL);
+	for (int t = 0; t < THREADS; t++) {
+		while (pthread_tryjoin_np(threads[t], NULL) != 0) {
+			if (hh_top(hh, HH_UA, items, HH_SLOTS) < 0)
+				errx(1, "hh_top failed");
+			merges++;
+		}
+	}
+
+	if (hh_top(hh, HH_UA, items, HH_TOP) != HH_TOP)
+		errx(1, "expected %d heavy hitters", HH_TOP);
+	for (int i = 0; i < HH_TOP; i++) {
+		len = keyname(buf, i);
+		if (items[i].keylen != len || memcmp(items[i].key, buf, len) != 0)
+			errx(1, "rank %d: expected %s, got %.*s", i + 1, buf, items[i].keylen,
+			    items[i].key);
+		if (items[i].count < (uint64_t)THREADS * (HEAVIEST / (i + 1)))
+			errx(1, "%s: count %lu below %d", buf, (unsigned long)items[i].count,
+			    THREADS * (HEAVIEST / (i + 1)));
+	}
+	printf("hh: top %d of %d keys found in %zu adds on %d threads (%d merges in flight)\n",
+	    HH_TOP, KEYS, nstream * THREADS, THREADS, merges);
+
+	/* a new interval starts empty, shards that count again show up */
+	hh_rotate(hh);
+	if (hh_top(hh, HH_UA, items, HH_TOP) != 0)
+		errx(1, "rotated tracker not empty");
+	if ((shard = hh_shard_new(hh)) == NULL)
+		errx(1, "hh_shard_new failed");
+	hh_add(shard, HH_METHOD, "INVITE", 6);
+	hh_add(shard, HH_METHOD, "INVITE", 6);
+	if (hh_top(hh, HH_METHOD, items, HH_TOP) != 1 || items[0].count != 2)
+		errx(1, "new interval miscounted");
+	printf("hh: rotation starts a new interval\n");
+
+	return (0);
+}
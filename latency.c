@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "latency.h"
+
+/*
+ * Per-stage latency histograms and a flight recorder of the most recent
+ * timings, both kept per thread and merged only when dumped.
+ */
+
+bool lat_enabled = false;
+
+static _Thread_local struct lat_thread *lat_tls;
+static struct lat_thread *		threads[LAT_THREADS];
+static int				nthreads;
+static pthread_mutex_t			threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stagenames[LAT_NSTAGES] = {
+	[LAT_RECV]    = "recv",
+	[LAT_PARSE]   = "parse",
+	[LAT_FORMAT]  = "format",
+	[LAT_ENQUEUE] = "enqueue",
+	[LAT_WRITE]   = "write",
+};
+
+static inline int
+lat_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < LAT_SUB)
+		return (v);
+	if (v >= 1ULL << (LAT_MAXBITS + 1))
+		v = (1ULL << (LAT_MAXBITS + 1)) - 1;
+	e = 63 - __builtin_clzll(v);
+	return ((e - LAT_SUBBITS + 1) * LAT_SUB + ((v >> (e - LAT_SUBBITS)) & (LAT_SUB - 1)));
+}
+
+/*
+ * highest value counted in bucket i
+ */
+static uint64_t
+lat_value(int i)
+{
+	int	 e;
+	uint64_t lower;
+
+	if (i < LAT_SUB)
+		return (i);
+	e     = i / LAT_SUB + LAT_SUBBITS - 1;
+	lower = (uint64_t)(LAT_SUB + i % LAT_SUB) << (e - LAT_SUBBITS);
+	return (lower + (1ULL << (e - LAT_SUBBITS)) - 1);
+}
+
+/*
+ * the calling thread's histograms, NULL once LAT_THREADS threads have them
+ */
+static struct lat_thread *
+lat_thread(void)
+{
+	struct lat_thread *lt = NULL;
+
+	pthread_mutex_lock(&threads_lock);
+	if (nthreads < LAT_THREADS && (lt = calloc(1, sizeof(*lt))) != NULL) {
+		lt->tid		     = gettid();
+		threads[nthreads++] = lt;
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	return (lat_tls = lt);
+}
+
+static inline void
+lat_inc(atomic_uint_least64_t *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+	    memory_order_relaxed);
+}
+
+/*
+ * account for a stage of the calling thread that ran from start to end
+ * (lat_now() nsecs)
+ */
+void
+lat_record(enum lat_stage stage, uint64_t start, uint64_t end)
+{
+	struct lat_thread *lt = lat_tls;
+	struct lat_event * ev;
+	uint64_t	   ns = end > start ? end - start : 0;
+	uint32_t	   head;
+
+	if (lt == NULL && (lt = lat_thread()) == NULL)
+		return;
+
+	lat_inc(&lt->hist[stage][lat_bucket(ns)], 1);
+	lat_inc(&lt->sum[stage], ns);
+	if (ns > atomic_load_explicit(&lt->max[stage], memory_order_relaxed))
+		atomic_store_explicit(&lt->max[stage], ns, memory_order_relaxed);
+
+	head = atomic_load_explicit(&lt->head, memory_order_relaxed);
+	ev   = &lt->trace[head & (LAT_TRACE - 1)];
+	atomic_store_explicit(&ev->ts, end, memory_order_relaxed);
+	atomic_store_explicit(&ev->ns, ns > UINT32_MAX ? UINT32_MAX : ns, memory_order_relaxed);
+	atomic_store_explicit(&ev->stage, stage, memory_order_relaxed);
+	atomic_store_explicit(&lt->head, head + 1, memory_order_release);
+}
+
+/*
+ * write count and percentiles of every stage over all threads to fp
+ */
+void
+lat_dump(FILE *fp)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	uint64_t	    hist[LAT_BUCKETS], count, sum, max, seen, v;
+	size_t		    p;
+	int		    n;
+
+	pthread_mutex_lock(&threads_lock);
+	n = nthreads;
+	pthread_mutex_unlock(&threads_lock);
+
+	fprintf(fp, "%-8s %12s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50",
+	    "p90", "p99", "p99.9", "max");
+	for (int s = 0; s < LAT_NSTAGES; s++) {
+		memset(hist, 0, sizeof(hist));
+		count = sum = max = 0;
+		for (int t = 0; t < n; t++) {
+			for (int i = 0; i < LAT_BUCKETS; i++) {
+				hist[i] += atomic_load_explicit(&threads[t]->hist[s][i],
+				    memory_order_relaxed);
+			}
+			sum += atomic_load_explicit(&threads[t]->sum[s], memory_order_relaxed);
+			v   = atomic_load_explicit(&threads[t]->max[s], memory_order_relaxed);
+			max = MAX(max, v);
+		}
+		for (int i = 0; i < LAT_BUCKETS; i++)
+			count += hist[i];
+
+		fprintf(fp, "%-8s %12llu %8.1fus", stagenames[s], (unsigned long long)count,
+		    count > 0 ? sum / 1e3 / count : 0.0);
+		seen = 0;
+		p    = 0;
+		for (int i = 0; i < LAT_BUCKETS && p < sizeof(pct) / sizeof(pct[0]); i++) {
+			seen += hist[i];
+			while (count > 0 && p < sizeof(pct) / sizeof(pct[0]) &&
+			    seen >= count * pct[p] / 100) {
+				fprintf(fp, " %8.1fus", MIN(lat_value(i), max) / 1e3);
+				p++;
+			}
+		}
+		for (; p < sizeof(pct) / sizeof(pct[0]); p++)
+			fprintf(fp, " %10s", "-");
+		fprintf(fp, " %8.1fus\n", max / 1e3);
+	}
+}
+
+/*
+ * write the flight recorder of every thread to fp, oldest events first
+ */
+void
+lat_dumptrace(FILE *fp)
+{
+	struct lat_event *ev;
+	uint64_t	  now = lat_now(), ts;
+	uint32_t	  head;
+	int		  n;
+
+	pthread_mutex_lock(&threads_lock);
+	n = nthreads;
+	pthread_mutex_unlock(&threads_lock);
+
+	for (int t = 0; t < n; t++) {
+		fprintf(fp, "thread %d\n", threads[t]->tid);
+		head = atomic_load_explicit(&threads[t]->head, memory_order_acquire);
+		for (uint32_t i = head - MIN(head, LAT_TRACE); i != head; i++) {
+			ev = &threads[t]->trace[i & (LAT_TRACE - 1)];
+			ts = atomic_load_explicit(&ev->ts, memory_order_relaxed);
+			fprintf(fp, "  %12.3fms ago %-8s %10luns\n",
+			    now > ts ? (now - ts) / 1e6 : 0.0,
+			    stagenames[atomic_load_explicit(&ev->stage, memory_order_relaxed) %
+				LAT_NSTAGES],
+			    (unsigned long)atomic_load_explicit(&ev->ns, memory_order_relaxed));
+		}
+	}
+}
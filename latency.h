@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LAT_SUBBITS 4 /* 16 linear sub-buckets per power of two, ~6% error */
+#define LAT_SUB (1 << LAT_SUBBITS)
+#define LAT_MAXBITS 40 /* longer durations (~18 minutes) land in the last bucket */
+#define LAT_BUCKETS ((LAT_MAXBITS - LAT_SUBBITS + 2) * LAT_SUB)
+#define LAT_TRACE 256	/* events kept per thread, a power of two */
+#define LAT_THREADS 1024 /* threads with their own histograms */
+
+/* timed stages of a request */
+enum lat_stage {
+	LAT_RECV,    /* kernel receive timestamp to processing (UDP) */
+	LAT_PARSE,   /* trimming, parsing and filtering */
+	LAT_FORMAT,  /* building the log record */
+	LAT_ENQUEUE, /* waiting for a slot in the log queue */
+	LAT_WRITE,   /* appending (and syncing) a batch of records */
+	LAT_NSTAGES
+};
+
+/* a flight recorder entry */
+struct lat_event {
+	atomic_uint_least64_t ts; /* CLOCK_MONOTONIC nsecs at the end of the stage */
+	atomic_uint_least32_t ns; /* duration */
+	atomic_uint_least32_t stage;
+};
+
+/*
+ * Histograms and flight recorder of one thread, written by that thread
+ * only. Buckets are log-linear as in HdrHistogram: values below LAT_SUB
+ * nsecs get a bucket each, above that every power of two is split into
+ * LAT_SUB buckets.
+ */
+struct lat_thread {
+	atomic_uint_least64_t hist[LAT_NSTAGES][LAT_BUCKETS];
+	atomic_uint_least64_t sum[LAT_NSTAGES];
+	atomic_uint_least64_t max[LAT_NSTAGES];
+	atomic_uint_least32_t head; /* next trace slot */
+	struct lat_event      trace[LAT_TRACE];
+	int		      tid;
+};
+
+extern bool lat_enabled;
+
+/* CLOCK_MONOTONIC in nsecs */
+static inline uint64_t
+lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void lat_record(enum lat_stage stage, uint64_t start, uint64_t end);
+void lat_dump(FILE *fp);
+void lat_dumptrace(FILE *fp);
+
+#endif /* _LATENCY_H */
@@ -27,12 +27,823 @@
 
 #include "logfile.h"
 
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <ctype.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+#include "latency.h"
+#include "metrics.h"
+#include "uring.h"
+
 #ifdef __linux__
 #define _PROGNAME program_invocation_short_name
 #else
 #define _PROGNAME getprogname()
 #endif /* __linux__ */
 
+/*
+ * Deflate state of a compressed logfile. Every file opened gets its own
+ * gzip member, so appending to an existing file keeps it a valid gzip
+ * stream.
+ */
+#define LOG_ZBUFSIZE (64 * 1024)
+
+struct log_zstream {
+	z_stream      strm;
+	bool	      active; /* a member has been started in the current file */
+	bool	      dirty;  /* input deflated since the last flush */
+	unsigned char out[LOG_ZBUFSIZE];
+};
+
+/*
+ * Rotation settings. The writer thread rotates the file when it is due;
+ * without one, the keeper thread does, and it also takes over reopen
+ * requests from signal handlers.
+ */
+struct log_rot {
+	size_t	     size; /* rotate at this many bytes, 0: never */
+	unsigned int secs; /* rotate at every multiple of secs, 0: never */
+	unsigned int keep; /* rotated files kept, 0: all */
+	char	     name[MAXPATHLEN + 1]; /* strftime() pattern of rotated files */
+	time_t	     next;		   /* next rotation by time */
+	long long    checked;		   /* msecs of the last check */
+	pthread_t    keeper;
+	bool	     keeping; /* keeper thread running */
+	atomic_bool  stop;
+};
+
+static void log_zflush(log_t *log);
+
+/*
+ * open/create logfile for appending and take an exclusive lock on it
+ */
+static int
+log_openfd(const char *filename, mode_t mode, int flags, struct stat *sb)
+{
+	int fd;
+
+	if ((fd = open(filename, O_APPEND | O_CREAT | flags, mode)) == -1)
+		return (-1);
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return (-1);
+	}
+	if (fstat(fd, sb) == -1) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * fill in the header of a binary logfile
+ */
+static void
+log_mkhdr(unsigned char *hdr)
+{
+	memset(hdr, 0, LOG_BIN_HDRSIZE);
+	memcpy(hdr, LOG_BIN_MAGIC, 8);
+	hdr[8] = LOG_BIN_VERSION & 0xff;
+	hdr[9] = LOG_BIN_VERSION >> 8;
+}
+
+/*
+ * Make sure a binary logfile starts with our header: write it into an empty
+ * file, otherwise check that the existing one is compatible.
+ */
+static int
+log_binhdr(int fd, const char *path, const struct stat *sb)
+{
+	unsigned char hdr[LOG_BIN_HDRSIZE];
+	ssize_t	      n;
+	int	      rfd;
+
+	if (sb->st_size == 0) {
+		log_mkhdr(hdr);
+		return (write(fd, hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1);
+	}
+
+	/* our descriptor is write-only */
+	if ((rfd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	n = pread(rfd, hdr, sizeof(hdr), 0);
+	close(rfd);
+
+	if (n != sizeof(hdr) || memcmp(hdr, LOG_BIN_MAGIC, 8) != 0 ||
+	    (hdr[8] | hdr[9] << 8) > LOG_BIN_VERSION) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * monotonic clock in milliseconds
+ */
+static long long
+log_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Group commit: account for nrecs freshly written records and tell whether
+ * to fdatasync() now, which is once enough records are pending or the
+ * oldest one has waited too long.
+ */
+static bool
+log_syncdue(const log_t *log, unsigned int nrecs)
+{
+	log_t *	     lh = (log_t *)log;
+	unsigned int pending;
+	long long    now;
+
+	if (log->durability != LOG_GROUP)
+		return (false);
+
+	pending = atomic_fetch_add(&lh->unsynced, nrecs) + nrecs;
+	if (pending == 0)
+		return (false);
+
+	now = log_msecs();
+	if (pending < log->sync_recs && now - atomic_load(&lh->synced_at) < log->sync_msecs)
+		return (false);
+
+	atomic_store(&lh->unsynced, 0);
+	atomic_store(&lh->synced_at, now);
+	return (true);
+}
+
+/*
+ * group commit after nrecs freshly written records, see log_syncdue()
+ */
+static void
+log_sync(const log_t *log, unsigned int nrecs)
+{
+	/* O_SYNC does not cover stores into a mapping */
+	if (log->durability == LOG_SYNC && log->map_seg != 0 && nrecs > 0) {
+		fdatasync(log->fd);
+		metric_add(M_LOG_SYNCS, 1);
+	}
+	if (log_syncdue(log, nrecs)) {
+		log_zflush((log_t *)log);
+		fdatasync(log->fd);
+		metric_add(M_LOG_SYNCS, 1);
+	}
+}
+
+/*
+ * Format a record straight into a queue slot. Records longer than the slot
+ * are truncated, the terminating newline is always kept.
+ */
+static void
+logq_vprintf(struct log_queue *q, const char *prefix, size_t plen, const char *format,
+    va_list args)
+{
+	struct log_rec *rec;
+	int		n;
+
+	if ((rec = logq_get(q)) == NULL)
+		return;
+
+	memcpy(rec->data, prefix, plen);
+	n = vsnprintf(rec->data + plen, LOG_RECSIZE - plen, format, args);
+	if (n < 0)
+		n = 0;
+	rec->len = MIN(plen + n, LOG_RECSIZE - 1);
+	rec->data[rec->len++] = '\n';
+
+	logq_commit(q, rec);
+}
+
+/*
+ * write all of iov, restarting after short writes
+ */
+static void
+log_writev(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		if ((n = writev(fd, iov, cnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			metric_add(M_LOG_WRITE_ERRORS, 1);
+			return;
+		}
+		metric_add(M_LOG_BYTES, n);
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Give up the current segment and cut the file back to the bytes actually
+ * written.
+ */
+static void
+log_unmap(log_t *log)
+{
+	if (log->map == NULL)
+		return;
+
+	munmap(log->map, log->map_seg);
+	ftruncate(log->fd, log->map_off + log->map_pos);
+	log->map = NULL;
+}
+
+/*
+ * Make sure the current segment has room for need more bytes, otherwise
+ * roll over to a fresh segment starting at the end of the data. Segments
+ * are preallocated and start on a page boundary.
+ */
+static int
+log_mapseg(log_t *log, size_t need)
+{
+	struct stat sb;
+	off_t	    end, off;
+	long	    pagesz = sysconf(_SC_PAGESIZE);
+
+	if (log->map != NULL && log->map_pos + need <= log->map_seg)
+		return (0);
+
+	if (log->map != NULL) {
+		end = log->map_off + log->map_pos;
+		log_unmap(log);
+	} else {
+		if (fstat(log->fd, &sb) == -1)
+			return (-1);
+		end = sb.st_size;
+	}
+
+	off = end & ~(off_t)(pagesz - 1);
+	if (need > log->map_seg - (end - off)) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (ftruncate(log->fd, off + log->map_seg) == -1)
+		return (-1);
+#ifdef __linux__
+	fallocate(log->fd, 0, off, log->map_seg);
+#else
+	posix_fallocate(log->fd, off, log->map_seg);
+#endif /* __linux__ */
+
+	log->map = mmap(NULL, log->map_seg, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, off);
+	if (log->map == MAP_FAILED) {
+		log->map = NULL;
+		ftruncate(log->fd, end);
+		return (-1);
+	}
+	log->map_off = off;
+	log->map_pos = end - off;
+
+	return (0);
+}
+
+/*
+ * copy iov into the mapped segment, falls back to write() if the file
+ * cannot be mapped
+ */
+static void
+log_mapwrite(log_t *log, struct iovec *iov, int cnt)
+{
+	size_t total = 0;
+
+	for (int i = 0; i < cnt; i++)
+		total += iov[i].iov_len;
+
+	if (log_mapseg(log, total) == -1) {
+		log_writev(log->fd, iov, cnt);
+		return;
+	}
+	for (int i = 0; i < cnt; i++) {
+		memcpy(log->map + log->map_pos, iov[i].iov_base, iov[i].iov_len);
+		log->map_pos += iov[i].iov_len;
+	}
+	metric_add(M_LOG_BYTES, total);
+}
+
+/*
+ * append iov through write() or the mapped segment
+ */
+static void
+log_rawput(log_t *log, struct iovec *iov, int cnt)
+{
+	if (log->map_seg == 0)
+		log_writev(log->fd, iov, cnt);
+	else
+		log_mapwrite(log, iov, cnt);
+}
+
+/*
+ * run len bytes of data through deflate() and append whatever comes out
+ */
+static void
+log_zwrite(log_t *log, const void *data, size_t len, int flush)
+{
+	struct log_zstream *z = log->zs;
+	struct iovec	    iov;
+
+	z->strm.next_in	 = (Bytef *)data;
+	z->strm.avail_in = len;
+	do {
+		z->strm.next_out  = z->out;
+		z->strm.avail_out = sizeof(z->out);
+		deflate(&z->strm, flush);
+		iov.iov_base = z->out;
+		iov.iov_len  = sizeof(z->out) - z->strm.avail_out;
+		if (iov.iov_len > 0)
+			log_rawput(log, &iov, 1);
+	} while (z->strm.avail_out == 0);
+	z->dirty = flush == Z_NO_FLUSH;
+}
+
+/*
+ * Compress records into the current gzip member, starting one if needed.
+ * A binary logfile that is still empty gets its header inside the stream.
+ * Under LOG_SYNC every batch is flushed to a byte boundary so it can be
+ * decompressed as soon as it is written.
+ */
+static void
+log_zput(log_t *log, struct iovec *iov, int cnt)
+{
+	unsigned char hdr[LOG_BIN_HDRSIZE];
+	struct stat   sb;
+
+	if (!log->zs->active) {
+		log->zs->active = true;
+		if (log->format == LOG_BINARY && log->map == NULL && fstat(log->fd, &sb) == 0 &&
+		    sb.st_size == 0) {
+			log_mkhdr(hdr);
+			log_zwrite(log, hdr, sizeof(hdr), Z_NO_FLUSH);
+		}
+	}
+	for (int i = 0; i < cnt; i++)
+		log_zwrite(log, iov[i].iov_base, iov[i].iov_len, Z_NO_FLUSH);
+	if (log->durability == LOG_SYNC)
+		log_zwrite(log, NULL, 0, Z_SYNC_FLUSH);
+}
+
+/*
+ * Flush compressed records written so far, so that readers can decompress
+ * everything up to this point. Called at the sync points of the durability
+ * policy.
+ */
+static void
+log_zflush(log_t *log)
+{
+	if (log->zs == NULL)
+		return;
+
+	if (log->queue == NULL)
+		pthread_mutex_lock(&log->lock);
+	if (log->zs->dirty)
+		log_zwrite(log, NULL, 0, Z_SYNC_FLUSH);
+	if (log->queue == NULL)
+		pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * terminate the current gzip member before the file is closed
+ */
+static void
+log_zfinish(log_t *log)
+{
+	if (log->zs == NULL || !log->zs->active)
+		return;
+
+	log_zwrite(log, NULL, 0, Z_FINISH);
+	deflateReset(&log->zs->strm);
+	log->zs->active = false;
+}
+
+/*
+ * Append records to the logfile through the configured backend. Without a
+ * writer thread several callers may append concurrently, which the mapped
+ * segment and the deflate stream have to serialize.
+ */
+static void
+log_put(const log_t *log, struct iovec *iov, int cnt)
+{
+	log_t *lh     = (log_t *)log;
+	bool   locked = log->queue == NULL && (log->map_seg != 0 || log->zs != NULL);
+
+	if (locked)
+		pthread_mutex_lock(&lh->lock);
+	if (log->zs != NULL)
+		log_zput(lh, iov, cnt);
+	else
+		log_rawput(lh, iov, cnt);
+	if (locked)
+		pthread_mutex_unlock(&lh->lock);
+}
+
+/*
+ * open flags for the current durability policy and backend, mappings need
+ * a readable descriptor
+ */
+static int
+log_oflags(const log_t *log)
+{
+	return ((log->map_seg != 0 ? O_RDWR : O_WRONLY) |
+	    (log->durability == LOG_SYNC ? O_SYNC : 0));
+}
+
+/*
+ * Reopen the logfile in place, keeping the old descriptor if that fails.
+ * Used by the writer thread on reopen requests and to apply a new
+ * durability policy or backend.
+ */
+static int
+log_swap(log_t *log)
+{
+	struct stat sb;
+	int	    fd;
+
+	/* the old descriptor still holds the lock if this is the same file */
+	flock(log->fd, LOCK_UN);
+	if ((fd = log_openfd(log->path, log->mode, log_oflags(log), &sb)) == -1) {
+		flock(log->fd, LOCK_EX);
+		return (-1);
+	}
+	if (log->format == LOG_BINARY && log->zs == NULL &&
+	    log_binhdr(fd, log->path, &sb) == -1) {
+		close(fd);
+		flock(log->fd, LOCK_EX);
+		return (-1);
+	}
+
+	log_zfinish(log);
+	log_unmap(log);
+	if (log->durability == LOG_GROUP)
+		fdatasync(log->fd);
+	/* replace the descriptor in place, direct writers never see it closed */
+	dup2(fd, log->fd);
+	close(fd);
+	log->dev = sb.st_dev;
+	log->ino = sb.st_ino;
+
+	return (0);
+}
+
+/*
+ * bytes in the logfile, up to the end of the records in a mapped segment
+ */
+static off_t
+log_cursize(const log_t *log)
+{
+	struct stat sb;
+
+	if (log->map != NULL)
+		return (log->map_off + log->map_pos);
+	return (fstat(log->fd, &sb) == 0 ? sb.st_size : 0);
+}
+
+/*
+ * whether the file has grown past the rotation size or the rotation time
+ * has come, checked every LOG_ROTCHECK msecs at most
+ */
+static bool
+log_rotdue(log_t *log)
+{
+	struct log_rot *rot = log->rot;
+	long long	now = log_msecs();
+
+	if (rot == NULL || now - rot->checked < LOG_ROTCHECK)
+		return (false);
+	rot->checked = now;
+	if (rot->secs > 0 && time(NULL) >= rot->next)
+		return (true);
+	return (rot->size > 0 && (size_t)log_cursize(log) >= rot->size);
+}
+
+/* a rotated file found by log_prune() */
+struct log_old {
+	struct timespec mtime;
+	const char *	path;
+};
+
+/* newest first */
+static int
+log_mtimecmp(const void *a, const void *b)
+{
+	const struct log_old *oa = a, *ob = b;
+
+	if (oa->mtime.tv_sec != ob->mtime.tv_sec)
+		return (oa->mtime.tv_sec < ob->mtime.tv_sec ? 1 : -1);
+	if (oa->mtime.tv_nsec != ob->mtime.tv_nsec)
+		return (oa->mtime.tv_nsec < ob->mtime.tv_nsec ? 1 : -1);
+	return (0);
+}
+
+/*
+ * whether path is a name rotation pattern name produces: it parses back with
+ * strptime(), followed by nothing or a "-N" suffix (see log_rotate())
+ */
+static bool
+log_rotated(const char *name, const char *path)
+{
+	struct tm   tm;
+	const char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	if ((end = strptime(path, name, &tm)) == NULL)
+		return (false);
+	if (*end == '-' && isdigit((unsigned char)end[1]))
+		for (end++; isdigit((unsigned char)*end); end++)
+			;
+	return (*end == '\0');
+}
+
+/*
+ * Remove the oldest rotated files beyond the retention count. Candidates
+ * are found by turning every conversion of the name pattern into a
+ * wildcard, and kept only if the pattern can have produced their name.
+ */
+static void
+log_prune(const log_t *log)
+{
+	const char *	s;
+	char		pattern[MAXPATHLEN + 1];
+	struct log_old *old;
+	struct stat	sb;
+	glob_t		g;
+	size_t		n = 0, nold = 0;
+
+	for (s = log->rot->name; *s != '\0' && n < sizeof(pattern) - 2; s++) {
+		if (*s != '%' || s[1] == '\0') {
+			pattern[n++] = *s;
+		} else if (*++s == '%') {
+			pattern[n++] = '%';
+		} else {
+			if ((*s == 'E' || *s == 'O') && s[1] != '\0')
+				s++;
+			if (n == 0 || pattern[n - 1] != '*')
+				pattern[n++] = '*';
+		}
+	}
+	if (n == 0 || pattern[n - 1] != '*')
+		pattern[n++] = '*'; /* "-N" suffixes */
+	pattern[n] = '\0';
+
+	if (glob(pattern, GLOB_NOSORT, NULL, &g) != 0)
+		return;
+	if ((old = calloc(g.gl_pathc, sizeof(*old))) != NULL) {
+		for (size_t i = 0; i < g.gl_pathc; i++) {
+			if (!log_rotated(log->rot->name, g.gl_pathv[i]) ||
+			    stat(g.gl_pathv[i], &sb) == -1 || !S_ISREG(sb.st_mode) ||
+			    (sb.st_dev == log->dev && sb.st_ino == log->ino))
+				continue;
+			old[nold].mtime	 = sb.st_mtim;
+			old[nold++].path = g.gl_pathv[i];
+		}
+		qsort(old, nold, sizeof(*old), log_mtimecmp);
+		for (size_t i = log->rot->keep; i < nold; i++)
+			unlink(old[i].path);
+		free(old);
+	}
+	globfree(&g);
+}
+
+/*
+ * Rename the logfile after the rotation pattern and the current time and
+ * open a new one at its path. Whatever is written in between still goes
+ * to the renamed file, and log_swap() replaces the descriptor in place,
+ * so no record is lost or written to a closed descriptor. Files holding
+ * nothing but a header are not rotated.
+ */
+static int
+log_rotate(log_t *log)
+{
+	struct log_rot *rot = log->rot;
+	struct stat	sb;
+	struct tm	tm;
+	time_t		now = time(NULL);
+	char		name[MAXPATHLEN + 1];
+	size_t		len;
+
+	if (rot->secs > 0)
+		rot->next = (now / rot->secs + 1) * rot->secs;
+	if (log_cursize(log) <= (log->format == LOG_BINARY ? LOG_BIN_HDRSIZE : 0))
+		return (0);
+
+	localtime_r(&now, &tm);
+	if ((len = strftime(name, sizeof(name) - 8, rot->name, &tm)) == 0)
+		return (-1);
+	/* several rotations within the resolution of the pattern */
+	for (int i = 1; stat(name, &sb) == 0 && i < 10000; i++)
+		snprintf(name + len, sizeof(name) - len, "-%d", i);
+	if (rename(log->path, name) == -1)
+		return (-1);
+	if (log_swap(log) == -1) {
+		rename(name, log->path);
+		return (-1);
+	}
+	metric_add(M_LOG_ROTATIONS, 1);
+	if (rot->keep > 0)
+		log_prune(log);
+	return (0);
+}
+
+/*
+ * Keeper thread, for logs without a writer thread: rotates the file and
+ * reopens it when asked to. Direct writers only take the lock for mapped
+ * segments and compressed streams, which also move the size log_rotdue()
+ * reads; the descriptor itself is swapped under them.
+ */
+static void *
+log_keeper(void *arg)
+{
+	log_t *		log = arg;
+	struct timespec ts  = { 0, LOG_ROTCHECK * 1000000L };
+
+	while (!atomic_load(&log->rot->stop)) {
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&log->lock);
+		if (atomic_exchange(&log->reopen, false))
+			log_swap(log);
+		if (log_rotdue(log))
+			log_rotate(log);
+		pthread_mutex_unlock(&log->lock);
+	}
+	return (NULL);
+}
+
+#ifdef HAVE_URING
+/*
+ * Append a batch through io_uring with an fdatasync() linked to it, so the
+ * group commit costs no system call of its own. Short writes are finished
+ * with writev(). Returns -1 without having written anything if the ring
+ * fails.
+ */
+static int
+log_uput(log_t *log, struct uring *r, struct iovec *iov, int cnt)
+{
+	struct io_uring_sqe *sqe, *fsq;
+	struct io_uring_cqe *cqe;
+	ssize_t		     written = -1;
+	bool		     synced  = false;
+	unsigned int	     nsqes   = 2;
+
+	if ((sqe = uring_sqe(r)) == NULL || (fsq = uring_sqe(r)) == NULL)
+		return (-1);
+	sqe->opcode	 = IORING_OP_WRITEV;
+	sqe->flags	 = IOSQE_IO_LINK;
+	sqe->fd		 = log->fd;
+	sqe->addr	 = (uintptr_t)iov;
+	sqe->len	 = cnt;
+	sqe->off	 = (uint64_t)-1; /* at the file position, which is the end */
+	sqe->user_data	 = 1;
+	fsq->opcode	 = IORING_OP_FSYNC;
+	fsq->fd		 = log->fd;
+	fsq->fsync_flags = IORING_FSYNC_DATASYNC;
+	fsq->user_data	 = 2;
+
+	if (uring_submit(r, nsqes) < 0)
+		return (-1);
+	while (nsqes > 0) {
+		if ((cqe = uring_peek(r)) == NULL) {
+			uring_submit(r, nsqes);
+			continue;
+		}
+		if (cqe->user_data == 1)
+			written = cqe->res;
+		else
+			synced = cqe->res == 0;
+		uring_seen(r);
+		nsqes--;
+	}
+
+	if (written < 0) {
+		metric_add(M_LOG_WRITE_ERRORS, 1);
+		written = 0;
+	}
+	metric_add(M_LOG_BYTES, written);
+	while (cnt > 0 && (size_t)written >= iov->iov_len) {
+		written -= iov->iov_len;
+		iov++;
+		cnt--;
+	}
+	if (cnt > 0) {
+		iov->iov_base = (char *)iov->iov_base + written;
+		iov->iov_len -= written;
+		log_writev(log->fd, iov, cnt);
+	}
+	if (!synced)
+		fdatasync(log->fd);
+	metric_add(M_LOG_SYNCS, 1);
+	return (0);
+}
+#endif /* HAVE_URING */
+
+/*
+ * Write a batch of records and commit it as the durability policy asks.
+ * With a ring (r) batches carrying a group commit go through log_uput();
+ * the others are plain writev() calls, which the ring would only hand to
+ * a kernel worker thread for a file.
+ */
+static void
+log_batch(log_t *log, struct uring **r, struct iovec *iov, int cnt)
+{
+#ifdef HAVE_URING
+	if (*r != NULL && log->durability == LOG_GROUP && log->map_seg == 0 && log->zs == NULL) {
+		if (!log_syncdue(log, cnt)) {
+			log_writev(log->fd, iov, cnt);
+			return;
+		}
+		if (log_uput(log, *r, iov, cnt) == 0)
+			return;
+		/* give up on a failed ring, whatever it still queues is stale */
+		*r = NULL;
+		log_writev(log->fd, iov, cnt);
+		fdatasync(log->fd);
+		metric_add(M_LOG_SYNCS, 1);
+		return;
+	}
+#else
+	(void)r;
+#endif /* HAVE_URING */
+	log_put(log, iov, cnt);
+	log_sync(log, cnt);
+}
+
+/*
+ * Writer thread: drain the queue in batches of up to its batch size per
+ * writev() and sleep while it is empty.
+ */
+static void *
+log_writer(void *arg)
+{
+	log_t *		  log = arg;
+	struct log_queue *q   = log->queue;
+	struct iovec	  iov[LOG_MAXBATCH];
+	long long	  wait;
+	uint64_t	  start;
+	int		  n;
+	struct uring *	  r = NULL;
+#ifdef HAVE_URING
+	struct uring ring = { .fd = -1 };
+
+	if (log->uring && uring_init(&ring, 4) == 0)
+		r = &ring;
+#endif /* HAVE_URING */
+
+	while (1) {
+		if (atomic_exchange(&log->reopen, false))
+			log_swap(log);
+		if (log_rotdue(log))
+			log_rotate(log);
+
+		if ((n = logq_peek(q, iov)) > 0) {
+			start = lat_enabled ? lat_now() : 0;
+			log_batch(log, &r, iov, n);
+			if (lat_enabled)
+				lat_record(LAT_WRITE, start, lat_now());
+			logq_release(q, n);
+			continue;
+		}
+
+		if (!logq_running(q))
+			break;
+
+		/* flush a pending group commit whose time is up */
+		log_sync(log, 0);
+		if (log->durability == LOG_NONE)
+			log_zflush(log);
+
+		/* nothing to do, wait for producers (or a reopen request) */
+		wait = 100;
+		if (log->durability == LOG_GROUP && atomic_load(&log->unsynced) > 0) {
+			wait = log->sync_msecs - (log_msecs() - atomic_load(&log->synced_at));
+			wait = MAX(0, MIN(wait, 100));
+		}
+
+		logq_wait(q, wait);
+	}
+
+#ifdef HAVE_URING
+	if (ring.fd >= 0)
+		uring_free(&ring);
+#endif /* HAVE_URING */
+	return (NULL);
+}
+
 /*
  * create/open given logfile and initialize appropriate struct
  */
@@ -54,16 +865,8 @@ log_open(const char *path, mode_t mode)
 	 * try to create / append the file and make sure it is correctly
 	 * created
 	 */
-	if ((fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_SYNC, mode)) == -1)
-		return (NULL);
-	if (flock(fd, LOCK_EX) == -1) {
-		close(fd);
-		return (NULL);
-	}
-	if (stat(filename, &sb) == -1) {
-		close(fd);
+	if ((fd = log_openfd(filename, mode, O_WRONLY | O_SYNC, &sb)) == -1)
 		return (NULL);
-	}
 	/* initialize data structure */
 	lh = calloc(1, sizeof(log_t));
 
@@ -71,6 +874,12 @@ log_open(const char *path, mode_t mode)
 	lh->dev	 = sb.st_dev;
 	lh->ino	 = sb.st_ino;
 	lh->mode = sb.st_mode;
+
+	lh->durability = LOG_SYNC;
+	pthread_mutex_init(&lh->lock, NULL);
+	atomic_init(&lh->reopen, false);
+	atomic_init(&lh->unsynced, 0);
+	atomic_init(&lh->synced_at, log_msecs());
 	strncpy(lh->path, filename, strnlen(filename, MAXPATHLEN + 1));
 
 	return (lh);
@@ -82,10 +891,35 @@ log_open(const char *path, mode_t mode)
 void
 log_close(const log_t *log)
 {
+	struct log_queue *q;
+
 	if (!log_isopen(log))
 		return;
 
+	/* let the writer flush what is queued */
+	if ((q = log->queue) != NULL) {
+		logq_stop(q);
+		pthread_join(q->consumer, NULL);
+		logq_free(q);
+	}
+	if (log->rot != NULL) {
+		if (log->rot->keeping) {
+			atomic_store(&log->rot->stop, true);
+			pthread_join(log->rot->keeper, NULL);
+		}
+		free(log->rot);
+	}
+
+	log_zfinish((log_t *)log);
+	log_unmap((log_t *)log);
+	if (log->durability == LOG_GROUP && atomic_load(&log->unsynced) > 0)
+		fdatasync(log->fd);
 	close(log->fd);
+	if (log->zs != NULL) {
+		deflateEnd(&log->zs->strm);
+		free(log->zs);
+	}
+	pthread_mutex_destroy((pthread_mutex_t *)&log->lock);
 	free((void *)log);
 }
 
@@ -101,21 +935,25 @@ log_isopen(const log_t *log)
 }
 
 /*
- * close and open logfile, used when a HUP signal is received (mosly in case of log roration)
+ * Close and open the logfile in place, used when a HUP signal is received
+ * (mostly after an external log rotation). The handle stays the same, so
+ * threads writing through it carry on. With a writer or keeper thread this
+ * only flags the request for it; otherwise the file is reopened right away.
  */
 void
-log_reopen(log_t **log)
+log_reopen(log_t *lh)
 {
-	log_t *newlog;
+	if (!log_isopen(lh))
+		return;
 
-	if (!log_isopen(*log))
+	if (lh->queue != NULL || (lh->rot != NULL && lh->rot->keeping)) {
+		atomic_store(&lh->reopen, true);
 		return;
+	}
 
-	newlog = malloc(sizeof(log_t));
-	memcpy(newlog, *log, sizeof(log_t));
-	log_close(*log);
-	*log = log_open(newlog->path, newlog->mode);
-	free(newlog);
+	pthread_mutex_lock(&lh->lock);
+	log_swap(lh);
+	pthread_mutex_unlock(&lh->lock);
 }
 
 /*
@@ -125,19 +963,32 @@ log_reopen(log_t **log)
 void
 log_printf(const log_t *log, const char *format, ...)
 {
-	if (!log_isopen(log))
+	if (!log_isopen(log) || log->format != LOG_TEXT)
 		return;
 
-	va_list args;
-	char *	message;
-	char *	newline = "\n";
+	va_list	     args;
+	char *	     message;
+	char *	     newline = "\n";
+	struct iovec iov[2];
+
+	if (log->queue != NULL) {
+		va_start(args, format);
+		logq_vprintf(log->queue, NULL, 0, format, args);
+		va_end(args);
+		return;
+	}
 
 	va_start(args, format);
 	vasprintf(&message, format, args);
 	va_end(args);
 
-	write(log->fd, message, strnlen(message, MAX_MSG_SIZE));
-	write(log->fd, newline, sizeof(*newline));
+	/* message and newline go out in a single write */
+	iov[0].iov_base = message;
+	iov[0].iov_len	= strnlen(message, MAX_MSG_SIZE);
+	iov[1].iov_base = newline;
+	iov[1].iov_len	= sizeof(*newline);
+	log_put(log, iov, 2);
+	log_sync(log, 1);
 
 	free(message);
 }
@@ -148,32 +999,96 @@ log_printf(const log_t *log, const char *format, ...)
 void
 log_tsprintf(const log_t *log, const char *format, ...)
 {
-	if (!log_isopen(log))
+	if (!log_isopen(log) || log->format != LOG_TEXT)
 		return;
 
-	va_list	   args;
-	char *	   message;
-	char	   s_time[30];
-	time_t	   now;
-	struct tm *ltime;
-	size_t	   tsize;
-	char *	   newline = "\n";
-
-	va_start(args, format);
-	vasprintf(&message, format, args);
-	va_end(args);
+	va_list	     args;
+	char *	     message;
+	char	     s_time[30];
+	time_t	     now;
+	struct tm *  ltime;
+	size_t	     tsize;
+	char *	     newline = "\n";
+	struct iovec iov[3];
 
 	now   = time(NULL);
 	ltime = localtime(&now);
 	tsize = strftime(s_time, sizeof(s_time), "%Y-%m-%d %T %Z - ", ltime);
 
-	write(log->fd, s_time, tsize);
-	write(log->fd, message, strnlen(message, MAX_MSG_SIZE));
-	write(log->fd, newline, sizeof(*newline));
+	if (log->queue != NULL) {
+		va_start(args, format);
+		logq_vprintf(log->queue, s_time, tsize, format, args);
+		va_end(args);
+		return;
+	}
+
+	va_start(args, format);
+	vasprintf(&message, format, args);
+	va_end(args);
+
+	iov[0].iov_base = s_time;
+	iov[0].iov_len	= tsize;
+	iov[1].iov_base = message;
+	iov[1].iov_len	= strnlen(message, MAX_MSG_SIZE);
+	iov[2].iov_base = newline;
+	iov[2].iov_len	= sizeof(*newline);
+	log_put(log, iov, 3);
+	log_sync(log, 1);
 
 	free(message);
 }
 
+/*
+ * Write a record built by fmt, either straight into a slot of the async
+ * queue or into a stack buffer that is written out directly. No memory is
+ * allocated on the way. Text records get a newline appended, binary ones
+ * are written as they are.
+ */
+void
+log_emit(const log_t *log, log_fmt_t fmt, const void *arg)
+{
+	struct log_rec *rec;
+	struct iovec	iov;
+	char		buf[LOG_RECSIZE];
+	size_t		len;
+	uint64_t	t0 = 0, t1 = 0;
+	bool		text;
+
+	if (!log_isopen(log))
+		return;
+	text = log->format == LOG_TEXT;
+	if (lat_enabled)
+		t0 = lat_now();
+
+	if (log->queue != NULL) {
+		if ((rec = logq_get(log->queue)) == NULL)
+			return;
+		if (lat_enabled)
+			lat_record(LAT_ENQUEUE, t0, t1 = lat_now());
+		len = fmt(rec->data, LOG_RECSIZE - text, arg);
+		if (len > 0 && text)
+			rec->data[len++] = '\n';
+		rec->len = len;
+		logq_commit(log->queue, rec);
+		if (lat_enabled)
+			lat_record(LAT_FORMAT, t1, lat_now());
+		return;
+	}
+
+	if ((len = fmt(buf, sizeof(buf) - text, arg)) == 0)
+		return;
+	if (text)
+		buf[len++] = '\n';
+	if (lat_enabled)
+		lat_record(LAT_FORMAT, t0, t1 = lat_now());
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+	log_put(log, &iov, 1);
+	log_sync(log, 1);
+	if (lat_enabled)
+		lat_record(LAT_WRITE, t1, lat_now());
+}
+
 /*
  * check integrity of logfile with comparing filesystem stat with our use-specified settings
  */
@@ -195,3 +1110,238 @@ log_verify(const log_t *log)
 	}
 	return true;
 }
+
+/*
+ * Hand writing over to a dedicated thread. Callers of log_printf() only
+ * format into a slot of a lock-free queue of nrecs records (rounded up to a
+ * power of two), which the writer takes batch records (0: LOG_BATCH) at a
+ * time; policy decides what happens when the queue is full.
+ */
+int
+log_async(log_t *log, size_t nrecs, unsigned int batch, enum log_overflow policy)
+{
+	struct log_queue *q;
+
+	if (!log_isopen(log) || log->queue != NULL || log->rot != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((q = logq_new(nrecs, batch, policy)) == NULL)
+		return (-1);
+
+	log->queue = q;
+	if ((errno = pthread_create(&q->consumer, NULL, log_writer, log)) != 0) {
+		log->queue = NULL;
+		logq_free(q);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * number of records discarded because the async queue was full
+ */
+uint64_t
+log_drops(const log_t *log)
+{
+	if (log == NULL || log->queue == NULL)
+		return (0);
+	return (atomic_load_explicit(&log->queue->drops, memory_order_relaxed));
+}
+
+/*
+ * records written by the writer thread, their time in the queue and drops,
+ * all zero without one
+ */
+void
+log_stats(const log_t *log, struct logq_stats *st)
+{
+	if (log == NULL || log->queue == NULL) {
+		memset(st, 0, sizeof(*st));
+		return;
+	}
+	logq_stats(log->queue, st);
+}
+
+/*
+ * Select how written records reach stable storage. nrecs and msecs bound
+ * how many records (and for how long) LOG_GROUP leaves unsynced. Must be
+ * called before log_async().
+ */
+int
+log_durability(log_t *log, enum log_durability durability, unsigned int nrecs,
+    unsigned int msecs)
+{
+	if (!log_isopen(log) || log->queue != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	log->durability = durability;
+	log->sync_recs	= MAX(nrecs, 1);
+	log->sync_msecs = msecs;
+	atomic_store(&log->unsynced, 0);
+	atomic_store(&log->synced_at, log_msecs());
+
+	/* O_SYNC cannot be changed with fcntl(), so reopen the file */
+	return (log_swap(log));
+}
+
+/*
+ * Switch between text and binary records. Binary logs get a header when
+ * they are created and only take records from log_emit(). Must be called
+ * before log_async().
+ */
+int
+log_format(log_t *log, enum log_format format)
+{
+	struct stat sb;
+
+	if (!log_isopen(log) || log->queue != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (format == LOG_BINARY && log->zs == NULL &&
+	    (fstat(log->fd, &sb) == -1 || log_binhdr(log->fd, log->path, &sb) == -1))
+		return (-1);
+
+	log->format = format;
+	return (0);
+}
+
+/*
+ * Append through preallocated, memory-mapped segments of segsize bytes
+ * (rounded up to whole pages) instead of write(). Records are copied into
+ * the mapping and writeback is left to the page cache, subject to the
+ * durability policy. The file is cut back to its real length when a
+ * segment is abandoned, so until then readers see zero padding at its
+ * end. Must be called before log_async().
+ */
+int
+log_mmap(log_t *log, size_t segsize)
+{
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	if (!log_isopen(log) || log->queue != NULL || segsize > LOG_MAXSEG) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	segsize	     = MAX(segsize, LOG_MINSEG);
+	log->map_seg = (segsize + pagesz - 1) & ~(size_t)(pagesz - 1);
+
+	/* the descriptor has to be reopened for reading as well */
+	return (log_swap(log));
+}
+
+/*
+ * Let the writer thread append through io_uring (plain records only, not
+ * mapped segments or compressed streams), linking group commits to the
+ * write before them so a batch costs one system call. The writer falls
+ * back to writev() if the kernel refuses the ring. Must be called before
+ * log_async().
+ */
+int
+log_uring(log_t *log)
+{
+	if (!log_isopen(log) || log->queue != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+#ifdef HAVE_URING
+	log->uring = true;
+	return (0);
+#else
+	errno = ENOSYS;
+	return (-1);
+#endif /* HAVE_URING */
+}
+
+/*
+ * Compress the logfile on the fly with gzip at the given level (1-9).
+ * Records are deflated by whoever writes them, normally the writer thread,
+ * and the stream is flushed at the sync points of the durability policy
+ * (every batch for LOG_SYNC, every group commit for LOG_GROUP, whenever the
+ * writer runs idle for LOG_NONE), so the file can be decompressed up to the
+ * last flush while it is still being written. Must be called before
+ * log_format() and log_async().
+ */
+int
+log_compress(log_t *log, int level)
+{
+	struct log_zstream *z;
+
+	if (!log_isopen(log) || log->queue != NULL || log->zs != NULL || level < 1 ||
+	    level > 9) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((z = calloc(1, sizeof(*z))) == NULL)
+		return (-1);
+	/* 15 + 16: largest window, gzip wrapper */
+	if (deflateInit2(&z->strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(z);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	log->zs	    = z;
+	log->zlevel = level;
+	return (log_swap(log));
+}
+
+/*
+ * Rotate the logfile once it reaches size bytes and/or at every multiple
+ * of secs seconds (0: never), keeping the keep newest rotated files (0:
+ * all). Rotated files are named by the strftime() pattern name, in the
+ * directory of the logfile unless it has a path of its own; NULL appends
+ * LOG_ROTNAME to the logfile path. The writer thread rotates the file in
+ * between two batches, without a writer a keeper thread is started for
+ * it, which also takes over reopen requests. So this is worth calling even
+ * without rotation, after log_async().
+ */
+int
+log_rotation(log_t *log, size_t size, unsigned int secs, unsigned int keep, const char *name)
+{
+	struct log_rot *rot;
+	char		dir[MAXPATHLEN + 1];
+	int		n;
+
+	if (!log_isopen(log) || log->rot != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((rot = calloc(1, sizeof(*rot))) == NULL)
+		return (-1);
+
+	if (name == NULL) {
+		n = snprintf(rot->name, sizeof(rot->name), "%s%s", log->path, LOG_ROTNAME);
+	} else if (strchr(name, '/') == NULL) {
+		snprintf(dir, sizeof(dir), "%s", log->path);
+		n = snprintf(rot->name, sizeof(rot->name), "%s/%s", dirname(dir), name);
+	} else {
+		n = snprintf(rot->name, sizeof(rot->name), "%s", name);
+	}
+	if (n < 0 || (size_t)n >= sizeof(rot->name)) {
+		free(rot);
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	rot->size    = size;
+	rot->secs    = secs;
+	rot->keep    = keep;
+	rot->checked = log_msecs();
+	if (secs > 0)
+		rot->next = (time(NULL) / secs + 1) * secs;
+	atomic_init(&rot->stop, false);
+
+	rot->keeping = log->queue == NULL;
+	log->rot     = rot;
+	if (rot->keeping && (errno = pthread_create(&rot->keeper, NULL, log_keeper, log)) != 0) {
+		log->rot = NULL;
+		free(rot);
+		return (-1);
+	}
+	return (0);
+}
@@ -39,31 +39,101 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "logq.h"
+
 #define LOGPATH "/var/log"
 #define MAX_MSG_SIZE 65536
+#define LOG_MINSEG (64 * 1024) /* smallest mmap segment */
+#define LOG_MAXSEG (1024 * 1024 * 1024) /* largest mmap segment */
+#define LOG_ROTNAME ".%Y%m%d-%H%M%S" /* suffix of rotated files without a pattern */
+#define LOG_ROTCHECK 100	     /* msecs between checks whether rotation is due */
+
+/* when written records are forced to stable storage */
+enum log_durability {
+	LOG_SYNC,  /* every write, file is opened with O_SYNC */
+	LOG_GROUP, /* fdatasync() after sync_recs records or sync_msecs */
+	LOG_NONE   /* left to the kernel */
+};
+
+/*
+ * Layout of the files written in LOG_BINARY format. All integers are
+ * little-endian. The file starts with a header:
+ *
+ *	magic[8]	"FSIPDLOG"
+ *	version		uint16
+ *	reserved[6]	zero
+ *
+ * followed by length-prefixed records (see rec_bin() in record.c).
+ */
+#define LOG_BIN_MAGIC "FSIPDLOG"
+#define LOG_BIN_VERSION 1
+#define LOG_BIN_HDRSIZE 16
+
+enum log_format {
+	LOG_TEXT,  /* newline terminated lines */
+	LOG_BINARY /* header + length-prefixed records, see above */
+};
+
+struct log_rot;
+struct log_zstream;
+
+/* formats a record into buf (at most size bytes) and returns its length */
+typedef size_t (*log_fmt_t)(char *buf, size_t size, const void *arg);
 
 typedef struct _log_t {
-	int    fd;
-	char   path[MAXPATHLEN + 1];
-	dev_t  dev;
-	ino_t  ino;
-	mode_t mode;
+	int		    fd;
+	char		    path[MAXPATHLEN + 1];
+	dev_t		    dev;
+	ino_t		    ino;
+	mode_t		    mode;
+	struct log_queue *  queue;
+	enum log_format	    format;
+	enum log_durability durability;
+	unsigned int	    sync_recs;
+	unsigned int	    sync_msecs;
+	atomic_uint	    unsynced;  /* records written since last fdatasync() */
+	atomic_llong	    synced_at; /* CLOCK_MONOTONIC msecs of last fdatasync() */
+	size_t		    map_seg;   /* mmap segment size, 0 to use write() */
+	char *		    map;       /* current segment, NULL if none mapped yet */
+	off_t		    map_off;   /* file offset of the current segment */
+	size_t		    map_pos;   /* bytes used in the current segment */
+	struct log_zstream *zs;        /* deflate state, NULL if uncompressed */
+	int		    zlevel;    /* gzip compression level */
+	pthread_mutex_t	    lock;      /* serializes direct writes into the segment/stream */
+	bool		    uring;     /* writer thread appends through io_uring */
+	atomic_bool	    reopen;    /* asked for by log_reopen(), see there */
+	struct log_rot *    rot;       /* rotation settings, NULL if not set up */
 } log_t;
 
-log_t *log_open(const char *path, mode_t mode);
-void   log_close(const log_t *log);
-bool   log_isopen(const log_t *log);
-bool   log_verify(const log_t *log);
-void   log_reopen(log_t **log);
-void   log_printf(const log_t *log, const char *format, ...);
-void   log_tsprintf(const log_t *log, const char *format, ...);
+log_t *	 log_open(const char *path, mode_t mode);
+void	 log_close(const log_t *log);
+bool	 log_isopen(const log_t *log);
+bool	 log_verify(const log_t *log);
+void	 log_reopen(log_t *log);
+void	 log_printf(const log_t *log, const char *format, ...);
+void	 log_tsprintf(const log_t *log, const char *format, ...);
+void	 log_emit(const log_t *log, log_fmt_t fmt, const void *arg);
+int	 log_async(log_t *log, size_t nrecs, unsigned int batch, enum log_overflow policy);
+int	 log_durability(log_t *log, enum log_durability durability, unsigned int nrecs,
+    unsigned int msecs);
+int	 log_format(log_t *log, enum log_format format);
+int	 log_mmap(log_t *log, size_t segsize);
+int	 log_compress(log_t *log, int level);
+int	 log_uring(log_t *log);
+int	 log_rotation(log_t *log, size_t size, unsigned int secs, unsigned int keep,
+    const char *name);
+uint64_t log_drops(const log_t *log);
+void	 log_stats(const log_t *log, struct logq_stats *st);
 
 #endif /* _LOGFILE_H */
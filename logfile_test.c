@@ -24,44 +24,207 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <err.h>
 #include <errno.h>
+#include <glob.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "logfile.h"
 
+#define ASYNC_THREADS 4
+#define ASYNC_LINES 1000
+#define ROT_NAME "test.log.%Y%m%d-%H%M%S"
+#define ROT_GLOB "test.log.[0-9]*"
+#define ROT_ROUNDS 5
+
 /*
  * dummy program to test logfile functionality
  */
 
+void *
+async_writer(void *arg)
+{
+	log_t *lh = arg;
+
+	for (int i = 1; i <= ASYNC_LINES; i++)
+		log_printf(lh, "async message %d from %p", i, (void *)pthread_self());
+
+	return (NULL);
+}
+
+/*
+ * count lines in given (possibly gzipped) file, -1 if it contains NUL bytes
+ * (e.g. left over mmap padding)
+ */
+int
+count_lines(const char *path)
+{
+	gzFile f;
+	int    c, lines = 0;
+
+	if ((f = gzopen(path, "r")) == NULL)
+		return (-1);
+	while ((c = gzgetc(f)) != -1) {
+		if (c == '\n')
+			lines++;
+		if (c == '\0') {
+			lines = -1;
+			break;
+		}
+	}
+	gzclose(f);
+
+	return (lines);
+}
+
+/*
+ * write through rotation at every 16k with a keeper thread, into mapped
+ * segments of seg bytes unless 0, return the number of rotated files and
+ * the lines in all of them plus the live one
+ */
+int
+rotate_run(unsigned int keep, size_t seg, int *lines)
+{
+	log_t *		lh;
+	pthread_t	threads[ASYNC_THREADS];
+	glob_t		g;
+	struct timespec ts = { 0, 150 * 1000 * 1000 };
+	int		n;
+
+	if (glob(ROT_GLOB, 0, NULL, &g) == 0) {
+		for (size_t i = 0; i < g.gl_pathc; i++)
+			unlink(g.gl_pathv[i]);
+		globfree(&g);
+	}
+	unlink("test.log");
+	if ((lh = log_open("test.log", 0600)) == NULL)
+		err(EX_IOERR, "Cannot open log file");
+	if (seg > 0 && log_mmap(lh, seg) == -1)
+		err(EX_OSERR, "Cannot map log file");
+	if (log_rotation(lh, 16384, 0, keep, ROT_NAME) == -1)
+		err(EX_OSERR, "Cannot start log rotation");
+	for (int r = 0; r < ROT_ROUNDS; r++) {
+		for (int i = 0; i < ASYNC_THREADS; i++)
+			pthread_create(&threads[i], NULL, async_writer, lh);
+		for (int i = 0; i < ASYNC_THREADS; i++)
+			pthread_join(threads[i], NULL);
+		nanosleep(&ts, NULL);
+	}
+	log_close(lh);
+
+	*lines = count_lines("test.log");
+	if (glob(ROT_GLOB, 0, NULL, &g) != 0)
+		return (0);
+	for (size_t i = 0; i < g.gl_pathc; i++)
+		*lines += count_lines(g.gl_pathv[i]);
+	n = (int)g.gl_pathc;
+	for (size_t i = 0; i < g.gl_pathc; i++)
+		unlink(g.gl_pathv[i]);
+	globfree(&g);
+
+	return (n);
+}
+
 int
 main(void)
 {
-	log_t *lh;
+	log_t *	  lh;
+	pthread_t threads[ASYNC_THREADS];
+	int	  lines, n;
 
+	unlink("test.log");
 	if ((lh = log_open("test.log", 0600)) == NULL) {
 		err(EX_IOERR, "Cannot open log file");
 	}
 	if (!log_verify(lh))
 		err(errno, "Failed to verify integrity of log file");
 
-	log_printf(lh, "opened file handle: %d , inode: %llu", lh->fd, lh->ino);
-	printf("logfile: %s, handle: %d, inode: %llu, mode: %d\n", lh->path, lh->fd, lh->ino,
-	    lh->mode);
+	log_printf(lh, "opened file handle: %d , inode: %llu", lh->fd,
+	    (unsigned long long)lh->ino);
+	printf("logfile: %s, handle: %d, inode: %llu, mode: %d\n", lh->path, lh->fd,
+	    (unsigned long long)lh->ino, lh->mode);
 
-	log_reopen(&lh);
+	log_reopen(lh);
 	if (!log_verify(lh))
 		err(errno, "Failed to verify integrity of reopened log file");
 
-	log_printf(lh, "reopened file handle: %d , inode: %llu", lh->fd, lh->ino);
-	printf("logfile: %s, handle: %d, inode: %llu, mode: %d\n", lh->path, lh->fd, lh->ino,
-	    lh->mode);
+	log_printf(lh, "reopened file handle: %d , inode: %llu", lh->fd,
+	    (unsigned long long)lh->ino);
+	printf("logfile: %s, handle: %d, inode: %llu, mode: %d\n", lh->path, lh->fd,
+	    (unsigned long long)lh->ino, lh->mode);
 
 	for (int i = 1; i <= 4; i++)
 		log_tsprintf(lh, "This is a time stamped message %d", i);
 
+	/* several producers through the async queue, with a reopen in between */
+	if (log_durability(lh, LOG_GROUP, 100, 50) == -1)
+		err(EX_IOERR, "Cannot switch to group commit");
+	if (log_mmap(lh, LOG_MINSEG) == -1)
+		err(EX_IOERR, "Cannot switch to mmap segments");
+	if (log_async(lh, 16, 0, LOG_BLOCK) == -1)
+		err(EX_OSERR, "Cannot start log writer");
+	for (int i = 0; i < ASYNC_THREADS; i++)
+		pthread_create(&threads[i], NULL, async_writer, lh);
+	log_reopen(lh);
+	for (int i = 0; i < ASYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	log_tsprintf(lh, "async writer dropped %llu messages", (unsigned long long)log_drops(lh));
+
 	log_close(lh);
 
+	lines = count_lines("test.log");
+	printf("logfile: %s, lines: %d\n", "test.log", lines);
+	if (lines != 2 + 4 + ASYNC_THREADS * ASYNC_LINES + 1)
+		errx(EX_SOFTWARE, "unexpected number of lines in log file");
+
+	/* compressed, with producers writing directly and a reopen in between */
+	unlink("test.log.gz");
+	if ((lh = log_open("test.log.gz", 0600)) == NULL)
+		err(EX_IOERR, "Cannot open compressed log file");
+	if (log_compress(lh, 6) == -1)
+		err(EX_SOFTWARE, "Cannot compress log file");
+	for (int i = 0; i < ASYNC_THREADS; i++)
+		pthread_create(&threads[i], NULL, async_writer, lh);
+	for (int i = 0; i < ASYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	log_reopen(lh);
+	log_printf(lh, "reopened compressed log");
+
+	/* every record is flushed under LOG_SYNC, readable before the trailer */
+	lines = count_lines("test.log.gz");
+	printf("logfile: %s, lines: %d\n", "test.log.gz", lines);
+	if (lines != ASYNC_THREADS * ASYNC_LINES + 1)
+		errx(EX_SOFTWARE, "unexpected number of lines in compressed log file");
+	log_close(lh);
+
+	/* size based rotation, nothing lost while producers write directly */
+	n = rotate_run(0, 0, &lines);
+	printf("rotated: %d, lines: %d\n", n, lines);
+	if (n < 2)
+		errx(EX_SOFTWARE, "log file was not rotated");
+	if (lines != ROT_ROUNDS * ASYNC_THREADS * ASYNC_LINES)
+		errx(EX_SOFTWARE, "unexpected number of lines in rotated log files");
+
+	/* the same into mapped segments, whose size moves under the writers' lock */
+	n = rotate_run(0, LOG_MINSEG, &lines);
+	printf("rotated: %d, lines: %d\n", n, lines);
+	if (n < 2)
+		errx(EX_SOFTWARE, "mapped log file was not rotated");
+	if (lines != ROT_ROUNDS * ASYNC_THREADS * ASYNC_LINES)
+		errx(EX_SOFTWARE, "unexpected number of lines in rotated mapped log files");
+
+	/* retention */
+	n = rotate_run(2, 0, &lines);
+	printf("rotated: %d, lines: %d\n", n, lines);
+	if (n != 2)
+		errx(EX_SOFTWARE, "unexpected number of rotated log files kept");
+
 	return 0;
 }
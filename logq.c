@@ -0,0 +1,339 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "banned.h"
+#include "logq.h"
+
+/*
+ * The record queue behind the log writer and the sinks: producers format
+ * straight into a slot they reserve, without locks or allocations, and one
+ * consumer thread takes the records in order, a batch at a time, sleeping
+ * while there are none.
+ */
+
+const uint64_t logq_latbounds[LOGQ_LATBUCKETS - 1] = { 100000, 1000000, 10000000, 100000000,
+	1000000000 };
+
+static atomic_size_t logq_bytes; /* of all queues, at most LOGQ_MAXBYTES */
+
+static uint64_t
+logq_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* records of a queue asked for nrecs, a power of two */
+static size_t
+logq_slots(size_t nrecs)
+{
+	size_t size;
+
+	for (size = 2; size < nrecs; size <<= 1)
+		;
+	return (size);
+}
+
+/*
+ * bytes a queue of nrecs records takes, nrecs at most LOGQ_MAX
+ */
+size_t
+logq_size(size_t nrecs)
+{
+	return (logq_slots(nrecs) * sizeof(struct log_rec));
+}
+
+/*
+ * bytes left for queues within LOGQ_MAXBYTES
+ */
+size_t
+logq_room(void)
+{
+	return (LOGQ_MAXBYTES - atomic_load(&logq_bytes));
+}
+
+/*
+ * Set up a queue of nrecs records (rounded up to a power of two, at most
+ * LOGQ_MAX), handed to the consumer batch at a time (0: LOG_BATCH). NULL
+ * and errno on failure: EINVAL if it is too long, ENOBUFS if it does not
+ * fit into what is left of LOGQ_MAXBYTES.
+ */
+struct log_queue *
+logq_new(size_t nrecs, unsigned int batch, enum log_overflow policy)
+{
+	struct log_queue *q;
+	size_t		  size, bytes;
+
+	if (nrecs > LOGQ_MAX) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	size  = logq_slots(nrecs);
+	bytes = size * sizeof(*q->recs);
+	if (atomic_fetch_add(&logq_bytes, bytes) + bytes > LOGQ_MAXBYTES) {
+		atomic_fetch_sub(&logq_bytes, bytes);
+		errno = ENOBUFS;
+		return (NULL);
+	}
+
+	if ((q = calloc(1, sizeof(*q))) == NULL) {
+		atomic_fetch_sub(&logq_bytes, bytes);
+		return (NULL);
+	}
+	if ((q->recs = malloc(bytes)) == NULL) {
+		atomic_fetch_sub(&logq_bytes, bytes);
+		free(q);
+		return (NULL);
+	}
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&q->recs[i].seq, i);
+
+	q->mask	  = size - 1;
+	q->batch  = batch == 0 ? LOG_BATCH : MIN(batch, LOG_MAXBATCH);
+	q->policy = policy;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->drops, 0);
+	atomic_init(&q->done, 0);
+	atomic_init(&q->running, true);
+	atomic_init(&q->sleeping, false);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->wakeup, NULL);
+
+	return (q);
+}
+
+void
+logq_free(struct log_queue *q)
+{
+	atomic_fetch_sub(&logq_bytes, (q->mask + 1) * sizeof(*q->recs));
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->wakeup);
+	free(q->recs);
+	free(q);
+}
+
+/*
+ * claim a free slot in the queue, returns NULL if the queue is full
+ */
+static struct log_rec *
+logq_reserve(struct log_queue *q)
+{
+	struct log_rec *rec;
+	size_t		pos, seq;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (1) {
+		rec = &q->recs[pos & q->mask];
+		seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				return (rec);
+		} else if ((intptr_t)(seq - pos) < 0) {
+			return (NULL);
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * wake up the consumer if it is waiting for records
+ */
+static void
+logq_wake(struct log_queue *q)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->wakeup);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/*
+ * claim a slot according to the overflow policy, NULL if the record has to
+ * be dropped
+ */
+struct log_rec *
+logq_get(struct log_queue *q)
+{
+	struct timespec pause = { 0, 100000 };
+	struct log_rec *rec;
+
+	while ((rec = logq_reserve(q)) == NULL) {
+		if (q->policy == LOG_DROP) {
+			atomic_fetch_add_explicit(&q->drops, 1, memory_order_relaxed);
+			return (NULL);
+		}
+		logq_wake(q);
+		nanosleep(&pause, NULL);
+	}
+	return (rec);
+}
+
+/*
+ * publish a reserved slot to the consumer
+ */
+void
+logq_commit(struct log_queue *q, struct log_rec *rec)
+{
+	size_t seq = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+
+	rec->ts = logq_now();
+	atomic_store_explicit(&rec->seq, seq + 1, memory_order_release);
+	logq_wake(q);
+}
+
+/*
+ * check whether the slot at the consumer's position holds a record
+ */
+static bool
+logq_ready(struct log_queue *q, size_t pos)
+{
+	struct log_rec *rec = &q->recs[pos & q->mask];
+
+	return (atomic_load_explicit(&rec->seq, memory_order_acquire) == pos + 1);
+}
+
+/*
+ * Point iov (room for q->batch entries) at the next records in the queue,
+ * returns their number. They stay put until logq_release().
+ */
+int
+logq_peek(struct log_queue *q, struct iovec *iov)
+{
+	struct log_rec *rec;
+	unsigned int	n;
+
+	for (n = 0; n < q->batch && logq_ready(q, q->tail + n); n++) {
+		rec		= &q->recs[(q->tail + n) & q->mask];
+		iov[n].iov_base = rec->data;
+		iov[n].iov_len	= rec->len;
+	}
+	return ((int)n);
+}
+
+/*
+ * count one more record in the latency statistics, consumer only
+ */
+static void
+logq_latency(struct log_queue *q, uint64_t ns)
+{
+	int b = 0;
+
+	while (b < LOGQ_LATBUCKETS - 1 && ns > logq_latbounds[b])
+		b++;
+	atomic_store_explicit(&q->lat[b],
+	    atomic_load_explicit(&q->lat[b], memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_store_explicit(&q->lat_sum,
+	    atomic_load_explicit(&q->lat_sum, memory_order_relaxed) + ns, memory_order_relaxed);
+	if (ns > atomic_load_explicit(&q->lat_max, memory_order_relaxed))
+		atomic_store_explicit(&q->lat_max, ns, memory_order_relaxed);
+}
+
+/*
+ * hand the first n records back to the producers once they are consumed
+ */
+void
+logq_release(struct log_queue *q, int n)
+{
+	struct log_rec *rec;
+	uint64_t	now = logq_now();
+
+	for (int i = 0; i < n; i++, q->tail++) {
+		rec = &q->recs[q->tail & q->mask];
+		logq_latency(q, now - MIN(now, rec->ts));
+		atomic_store_explicit(&rec->seq, q->tail + q->mask + 1, memory_order_release);
+	}
+	atomic_store_explicit(&q->done, atomic_load_explicit(&q->done, memory_order_relaxed) + n,
+	    memory_order_relaxed);
+}
+
+/*
+ * sleep up to msecs until a record is ready, unless the queue is stopped
+ */
+void
+logq_wait(struct log_queue *q, long msecs)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&q->lock);
+	atomic_store(&q->sleeping, true);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!logq_ready(q, q->tail) && atomic_load(&q->running) && msecs > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += msecs * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+		}
+		pthread_cond_timedwait(&q->wakeup, &q->lock, &ts);
+	}
+	atomic_store(&q->sleeping, false);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * ask the consumer to finish once it has drained the queue
+ */
+void
+logq_stop(struct log_queue *q)
+{
+	atomic_store(&q->running, false);
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_signal(&q->wakeup);
+	pthread_mutex_unlock(&q->lock);
+}
+
+bool
+logq_running(struct log_queue *q)
+{
+	return (atomic_load(&q->running));
+}
+
+void
+logq_stats(const struct log_queue *q, struct logq_stats *st)
+{
+	uint64_t n = 0;
+
+	st->done    = atomic_load_explicit(&q->done, memory_order_relaxed);
+	st->drops   = atomic_load_explicit(&q->drops, memory_order_relaxed);
+	st->lat_sum = atomic_load_explicit(&q->lat_sum, memory_order_relaxed);
+	st->lat_max = atomic_load_explicit(&q->lat_max, memory_order_relaxed);
+	for (int b = 0; b < LOGQ_LATBUCKETS; b++)
+		st->lat[b] = n += atomic_load_explicit(&q->lat[b], memory_order_relaxed);
+}
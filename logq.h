@@ -0,0 +1,113 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOGQ_H
+#define _LOGQ_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RECSIZE 8448  /* largest record passed through a queue */
+#define LOG_BATCH 64	  /* default records handed to the consumer at once */
+#define LOG_MAXBATCH 1024 /* largest batch */
+#define LOGQ_MAX (1 << 14)	       /* largest queue, in records of LOG_RECSIZE bytes */
+#define LOGQ_MAXBYTES (256 << 20) /* all queues together */
+#define LOGQ_CACHELINE 64
+#define LOGQ_LATBUCKETS 6 /* 100us, 1ms, 10ms, 100ms, 1s and above */
+
+/* what to do when a queue is full */
+enum log_overflow {
+	LOG_BLOCK, /* wait for the consumer to catch up */
+	LOG_DROP   /* discard the record and count it */
+};
+
+/*
+ * A slot of a queue. The queue is the bounded ring by D. Vyukov with a
+ * single consumer: the slot at position pos can be taken by a producer
+ * while seq == pos and is ready for the consumer once seq == pos + 1.
+ */
+struct log_rec {
+	atomic_size_t seq;
+	size_t	      len;
+	uint64_t      ts; /* CLOCK_MONOTONIC nsecs when it was committed */
+	char	      data[LOG_RECSIZE];
+};
+
+/*
+ * Bounded multi-producer queue of records with one consumer thread, which
+ * takes up to batch records at a time. Delivery statistics are kept by
+ * the consumer, drops by the producers.
+ */
+struct log_queue {
+	struct log_rec *			 recs;
+	size_t					 mask;
+	unsigned int				 batch;
+	enum log_overflow			 policy;
+	_Alignas(LOGQ_CACHELINE) atomic_size_t	 head; /* next slot to reserve */
+	_Alignas(LOGQ_CACHELINE) size_t		 tail; /* next slot to consume, consumer only */
+	atomic_uint_least64_t			 done; /* records consumed */
+	atomic_uint_least64_t			 lat_sum; /* nsecs from commit to consumed */
+	atomic_uint_least64_t			 lat_max;
+	atomic_uint_least64_t			 lat[LOGQ_LATBUCKETS];
+	_Alignas(LOGQ_CACHELINE) atomic_uint_least64_t drops;
+	atomic_bool				 running;
+	atomic_bool				 sleeping;
+	pthread_mutex_t				 lock;
+	pthread_cond_t				 wakeup;
+	pthread_t				 consumer;
+};
+
+/* a snapshot of the statistics of a queue */
+struct logq_stats {
+	uint64_t done;
+	uint64_t drops;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	uint64_t lat[LOGQ_LATBUCKETS]; /* cumulative, as Prometheus buckets */
+};
+
+extern const uint64_t logq_latbounds[LOGQ_LATBUCKETS - 1]; /* nsecs */
+
+size_t		  logq_size(size_t nrecs);
+size_t		  logq_room(void);
+struct log_queue *logq_new(size_t nrecs, unsigned int batch, enum log_overflow policy);
+void		  logq_free(struct log_queue *q);
+struct log_rec *  logq_get(struct log_queue *q);
+void		  logq_commit(struct log_queue *q, struct log_rec *rec);
+int		  logq_peek(struct log_queue *q, struct iovec *iov);
+void		  logq_release(struct log_queue *q, int n);
+void		  logq_wait(struct log_queue *q, long msecs);
+void		  logq_stop(struct log_queue *q);
+bool		  logq_running(struct log_queue *q);
+void		  logq_stats(const struct log_queue *q, struct logq_stats *st);
+
+#endif /* _LOGQ_H */
@@ -0,0 +1,161 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "banned.h"
+#include "metrics.h"
+
+/*
+ * Counters are kept per thread and only summed up when they are read, so
+ * counting never bounces a cache line between threads. Counters of threads
+ * that exit stay registered and keep their totals.
+ */
+
+_Thread_local struct metrics *metrics_tls;
+
+static struct metrics *	registry[METRICS_THREADS];
+static int		nregistered;
+static pthread_mutex_t	registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics	overflow; /* shared by threads beyond METRICS_THREADS, racy */
+
+static const struct {
+	const char *name;
+	const char *help;
+} metric_info[M_NMETRICS] = {
+	[M_UDP_DATAGRAMS]     = { "fsipd_udp_datagrams_total", "UDP datagrams received." },
+	[M_UDP_BYTES]	      = { "fsipd_udp_bytes_total", "Bytes received in UDP datagrams." },
+	[M_UDP_BATCHES]	      = { "fsipd_udp_batches_total", "recvmmsg() calls returning data." },
+	[M_UDP_ERRORS]	      = { "fsipd_udp_errors_total", "Failed recvmmsg() calls." },
+	[M_TCP_ACCEPTED]      = { "fsipd_tcp_accepted_total", "TCP connections accepted." },
+	[M_TCP_ACCEPT_ERRORS] = { "fsipd_tcp_accept_errors_total",
+	    "TCP connections that could not be accepted or watched." },
+	[M_TCP_REQUESTS]      = { "fsipd_tcp_requests_total", "Requests read from TCP clients." },
+	[M_TCP_BYTES]	      = { "fsipd_tcp_bytes_total", "Bytes read from TCP clients." },
+	[M_TCP_INCOMPLETE]    = { "fsipd_tcp_incomplete_total",
+	    "TCP requests cut short by the peer or the buffer size." },
+	[M_TCP_IDLE]	      = { "fsipd_tcp_idle_total",
+	    "TCP clients closed after staying silent for the idle time." },
+	[M_TCP_TIMEOUTS]      = { "fsipd_tcp_timeouts_total",
+	    "TCP clients closed for not sending their request in time." },
+	[M_TCP_EVICTED]	      = { "fsipd_tcp_evicted_total",
+	    "Oldest TCP clients closed to make room in a full connection table." },
+	[M_TCP_BUFFERS]	      = { "fsipd_tcp_buffers_total",
+	    "TCP read buffers allocated, never more than the connection table size." },
+	[M_REQ_UNPARSED]      = { "fsipd_requests_unparsed_total",
+	    "Requests that could not be parsed as SIP." },
+	[M_REQ_FILTERED]      = { "fsipd_requests_filtered_total",
+	    "Requests not logged because of their method." },
+	[M_LOG_BYTES]	      = { "fsipd_log_bytes_total", "Bytes appended to the log file." },
+	[M_LOG_WRITE_ERRORS]  = { "fsipd_log_write_errors_total", "Failed log file writes." },
+	[M_LOG_SYNCS]	      = { "fsipd_log_syncs_total", "fdatasync() calls on the log file." },
+	[M_LOG_ROTATIONS]     = { "fsipd_log_rotations_total", "Log files rotated (-R)." },
+	[M_SYSLOG_MESSAGES]   = { "fsipd_syslog_messages_total",
+	    "Messages sent to the syslog socket (-S)." },
+	[M_SYSLOG_BATCHES]    = { "fsipd_syslog_batches_total",
+	    "sendmmsg() calls to the syslog socket." },
+	[M_SYSLOG_DROPPED]    = { "fsipd_syslog_dropped_total",
+	    "Syslog messages dropped because the socket was full or failed." },
+	[M_SYSLOG_ERRORS]     = { "fsipd_syslog_errors_total",
+	    "Failed sendmmsg() calls other than a full socket." },
+	[M_REPLIES]	      = { "fsipd_replies_total", "Replies sent to UDP requests (-r)." },
+	[M_REPLY_BATCHES]     = { "fsipd_reply_batches_total",
+	    "sendmmsg() calls sending replies." },
+	[M_REPLY_DROPPED]     = { "fsipd_replies_dropped_total",
+	    "Replies not sent, too long or refused by the socket." },
+	[M_CAP_BLOCKS]	      = { "fsipd_capture_blocks_total",
+	    "Blocks of packets read from the capture ring (-c)." },
+	[M_CAP_PACKETS]	      = { "fsipd_capture_packets_total", "Packets captured." },
+	[M_CAP_PAYLOADS]      = { "fsipd_capture_payloads_total",
+	    "Captured packets with a payload for a captured port." },
+	[M_CAP_BYTES]	      = { "fsipd_capture_bytes_total",
+	    "Bytes of captured packets with a payload." },
+	[M_CAP_DROPS]	      = { "fsipd_capture_drops_total",
+	    "Packets the kernel dropped because the capture ring was full." },
+};
+
+/*
+ * give the calling thread its own counters
+ */
+struct metrics *
+metrics_register(void)
+{
+	struct metrics *mt;
+
+	pthread_mutex_lock(&registry_lock);
+	if (nregistered < METRICS_THREADS &&
+	    (mt = aligned_alloc(METRICS_CACHELINE, sizeof(*mt))) != NULL) {
+		memset(mt, 0, sizeof(*mt));
+		registry[nregistered++] = mt;
+	} else {
+		mt = &overflow;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return (metrics_tls = mt);
+}
+
+/*
+ * total of counter m over all threads
+ */
+uint64_t
+metrics_sum(enum metric m)
+{
+	uint64_t sum;
+
+	sum = atomic_load_explicit(&overflow.v[m], memory_order_relaxed);
+	pthread_mutex_lock(&registry_lock);
+	for (int i = 0; i < nregistered; i++)
+		sum += atomic_load_explicit(&registry[i]->v[m], memory_order_relaxed);
+	pthread_mutex_unlock(&registry_lock);
+
+	return (sum);
+}
+
+/*
+ * Write all counters into buf in the Prometheus text exposition format.
+ * Returns the length written, which is less than size.
+ */
+size_t
+metrics_render(char *buf, size_t size)
+{
+	size_t n = 0;
+	int    len;
+
+	for (int m = 0; m < M_NMETRICS && n < size; m++) {
+		len = snprintf(buf + n, size - n, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		    metric_info[m].name, metric_info[m].help, metric_info[m].name,
+		    metric_info[m].name, (unsigned long long)metrics_sum(m));
+		if (len < 0 || (size_t)len >= size - n)
+			break;
+		n += len;
+	}
+
+	return (n);
+}
@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_THREADS 1024 /* threads with their own counters */
+#define METRICS_CACHELINE 64
+
+/* counters, see metrics.c for their names */
+enum metric {
+	M_UDP_DATAGRAMS,
+	M_UDP_BYTES,
+	M_UDP_BATCHES,
+	M_UDP_ERRORS,
+	M_TCP_ACCEPTED,
+	M_TCP_ACCEPT_ERRORS,
+	M_TCP_REQUESTS,
+	M_TCP_BYTES,
+	M_TCP_INCOMPLETE,
+	M_TCP_IDLE,
+	M_TCP_TIMEOUTS,
+	M_TCP_EVICTED,
+	M_TCP_BUFFERS,
+	M_REQ_UNPARSED,
+	M_REQ_FILTERED,
+	M_LOG_BYTES,
+	M_LOG_WRITE_ERRORS,
+	M_LOG_SYNCS,
+	M_LOG_ROTATIONS,
+	M_SYSLOG_MESSAGES,
+	M_SYSLOG_BATCHES,
+	M_SYSLOG_DROPPED,
+	M_SYSLOG_ERRORS,
+	M_REPLIES,
+	M_REPLY_BATCHES,
+	M_REPLY_DROPPED,
+	M_CAP_BLOCKS,
+	M_CAP_PACKETS,
+	M_CAP_PAYLOADS,
+	M_CAP_BYTES,
+	M_CAP_DROPS,
+	M_NMETRICS
+};
+
+/*
+ * Counters of one thread, written by that thread only and aligned to whole
+ * cache lines so that threads never share one.
+ */
+struct metrics {
+	alignas(METRICS_CACHELINE) atomic_uint_least64_t v[M_NMETRICS];
+};
+
+extern _Thread_local struct metrics *metrics_tls;
+
+struct metrics *metrics_register(void);
+uint64_t	metrics_sum(enum metric m);
+size_t		metrics_render(char *buf, size_t size);
+
+/*
+ * Add n to counter m of the calling thread. A plain load and store are
+ * enough for a single writer, so this costs no more than an increment.
+ */
+static inline void
+metric_add(enum metric m, uint64_t n)
+{
+	struct metrics *mt = metrics_tls;
+
+	if (__builtin_expect(mt == NULL, 0))
+		mt = metrics_register();
+	atomic_store_explicit(&mt->v[m],
+	    atomic_load_explicit(&mt->v[m], memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#endif /* _METRICS_H */
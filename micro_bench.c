@@ -0,0 +1,341 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logfile.h"
+#include "request.h"
+#include "scan.h"
+
+/*
+ * Microbenchmarks of the logfile API and the request path. Every case is
+ * warmed up, then run several times; the result of each run is its mean
+ * time per operation, and every operation (or chunk of very cheap ones)
+ * is timed on its own for latency percentiles, which include the ~20ns of
+ * reading the clock. Log cases run against a tmpfs and a disk directory.
+ * Results are printed as JSON.
+ */
+
+#define BENCH_LOG "micro_bench.log"
+
+struct bench {
+	const char *name;
+	const char *variant;
+	bool	    logged; /* runs against a log file in each target directory */
+	int	    scale;  /* multiplies the number of operations */
+	int	    chunk;  /* operations per latency sample */
+	void (*op)(int i);
+};
+
+static const char request[] = "OPTIONS sip:100@127.0.0.1 SIP/2.0\r\n"
+			      "Via: SIP/2.0/UDP 127.0.0.1:5061;branch=z9hG4bK-1234567890\r\n"
+			      "From: \"sipvicious\"<sip:100@1.1.1.1>;tag=6434396633623535\r\n"
+			      "To: \"sipvicious\"<sip:100@1.1.1.1>\r\n"
+			      "Call-ID: 1234567890123456789012\r\n"
+			      "CSeq: 1 OPTIONS\r\n"
+			      "Max-Forwards: 70\r\n"
+			      "User-Agent: friendly-scanner\r\n"
+			      "Accept: application/sdp\r\n"
+			      "Content-Length: 0\r\n\r\n";
+
+static char		  padded[sizeof(request) + 8];
+static char		  buf[sizeof(request)];
+static struct sockaddr_in src;
+
+static void
+op_printf(int i)
+{
+	log_printf(lfh, "From: 127.0.0.1:%d (UDP4) - Message: \"OPTIONS sip:100@127.0.0.1\"", i);
+}
+
+static void
+op_tsprintf(int i)
+{
+	log_tsprintf(lfh, "From: 127.0.0.1:%d (UDP4) - Message: \"OPTIONS sip:100@127.0.0.1\"", i);
+}
+
+static void
+op_reopen(int i)
+{
+	(void)i;
+	log_reopen(lfh);
+}
+
+/* chomp() cuts the string, put back the byte it overwrote */
+static void
+op_chomp(int i)
+{
+	size_t len = sizeof(padded) - 1;
+	char * s;
+
+	(void)i;
+	s		       = chomp(padded, &len);
+	s[len]		       = ' ';
+	padded[sizeof(padded) - 1] = '\0';
+}
+
+static void
+op_request(int i)
+{
+	(void)i;
+	memcpy(buf, request, sizeof(request));
+	process_request(AF_INET, (struct sockaddr *)&src, SOCK_DGRAM, buf, sizeof(request) - 1);
+}
+
+static struct bench benches[] = {
+	{ "chomp", "-", false, 1000, 64, op_chomp },
+	{ "log_printf", "sync", true, 1, 1, op_printf },
+	{ "log_printf", "none", true, 10, 1, op_printf },
+	{ "log_printf", "async", true, 10, 1, op_printf },
+	{ "log_tsprintf", "sync", true, 1, 1, op_tsprintf },
+	{ "log_tsprintf", "none", true, 10, 1, op_tsprintf },
+	{ "log_tsprintf", "async", true, 10, 1, op_tsprintf },
+	{ "log_reopen", "sync", true, 1, 1, op_reopen },
+	{ "process_request", "csv", true, 10, 1, op_request },
+	{ "process_request", "sip", true, 10, 1, op_request },
+	{ "process_request", "binary", true, 10, 1, op_request },
+};
+
+static int nruns = 5, nops = 1000, nwarmup = 100;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+percentile(const double *v, size_t n, double p)
+{
+	size_t i = (size_t)(p / 100 * n);
+
+	return (v[i < n ? i : n - 1]);
+}
+
+/*
+ * open the log for a case in dir, configured after its variant
+ */
+static void
+setup(const struct bench *b, const char *dir)
+{
+	char path[MAXPATHLEN];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, BENCH_LOG);
+	unlink(path);
+	if ((lfh = log_open(path, 0644)) == NULL)
+		err(EX_CANTCREAT, "%s", path);
+
+	parse_sip     = false;
+	log_format_fn = format_csv;
+	if (strcmp(b->variant, "sip") == 0) {
+		parse_sip     = true;
+		log_format_fn = format_sip;
+	} else if (strcmp(b->variant, "binary") == 0) {
+		log_format(lfh, LOG_BINARY);
+		log_format_fn = format_binary;
+	}
+	if (strcmp(b->variant, "sync") != 0)
+		log_durability(lfh, LOG_NONE, 0, 0);
+	if (strcmp(b->variant, "async") == 0)
+		log_async(lfh, 1024, 0, LOG_BLOCK);
+}
+
+static void
+teardown(const char *dir)
+{
+	char path[MAXPATHLEN];
+
+	log_close(lfh);
+	lfh = NULL;
+	snprintf(path, sizeof(path), "%s/%s", dir, BENCH_LOG);
+	unlink(path);
+}
+
+/*
+ * run a case and print its JSON object
+ */
+static void
+run(const struct bench *b, const char *target, const char *dir, bool first)
+{
+	size_t	ops	 = (size_t)nops * b->scale;
+	size_t	nsamples = ops / b->chunk, k = 0;
+	double *samples, runs[nruns], t0, t;
+
+	if ((samples = malloc(nruns * nsamples * sizeof(*samples))) == NULL)
+		err(EX_OSERR, "malloc");
+	if (b->logged)
+		setup(b, dir);
+
+	for (int i = 0; i < nwarmup * b->scale; i++)
+		b->op(i);
+	for (int r = 0; r < nruns; r++) {
+		t0 = now();
+		for (size_t s = 0; s < nsamples; s++) {
+			t = now();
+			for (int c = 0; c < b->chunk; c++)
+				b->op(c);
+			samples[k++] = (now() - t) / b->chunk;
+		}
+		runs[r] = (now() - t0) / (nsamples * b->chunk);
+	}
+
+	if (b->logged)
+		teardown(dir);
+
+	qsort(runs, nruns, sizeof(runs[0]), cmp_double);
+	qsort(samples, k, sizeof(samples[0]), cmp_double);
+	printf("%s    {\"name\": \"%s\", \"variant\": \"%s\", \"target\": \"%s\", "
+	       "\"ops\": %zu, \"runs\": %d,\n"
+	       "     \"ns_per_op\": {\"min\": %.1f, \"median\": %.1f, \"max\": %.1f}, "
+	       "\"ops_per_sec\": %.0f,\n"
+	       "     \"latency_ns\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+	       "\"max\": %.1f}}",
+	    first ? "" : ",\n", b->name, b->variant, target, nsamples * b->chunk, nruns, runs[0],
+	    runs[nruns / 2], runs[nruns - 1], 1e9 / runs[nruns / 2], percentile(samples, k, 50),
+	    percentile(samples, k, 90), percentile(samples, k, 99), percentile(samples, k, 99.9),
+	    samples[k - 1]);
+	fflush(stdout);
+	free(samples);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: micro_bench [-t tmpfs dir] [-d disk dir] [-r runs] [-n ops] [-w warmup]\n"
+	    "                   [-b name]\n"
+	    "\t-t: tmpfs directory for log cases (default: /dev/shm, \"\" to skip)\n"
+	    "\t-d: disk directory for log cases (default: ., \"\" to skip)\n"
+	    "\t-r: runs per case (default: 5)\n"
+	    "\t-n: operations per run, scaled up for cheap cases (default: 1000)\n"
+	    "\t-w: warmup operations, scaled the same way (default: 100)\n"
+	    "\t-b: only run cases whose name starts with this\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *targets[2][2] = { { "tmpfs", "/dev/shm" }, { "disk", "." } };
+	const char *only	  = NULL;
+	char	    host[256]	  = "";
+	struct stat sb;
+	bool	    first = true;
+	int	    opt;
+
+	while ((opt = getopt(argc, argv, "t:d:r:n:w:b:h")) != -1) {
+		switch (opt) {
+		case 't':
+			targets[0][1] = optarg;
+			break;
+		case 'd':
+			targets[1][1] = optarg;
+			break;
+		case 'r':
+			nruns = atoi(optarg);
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'w':
+			nwarmup = atoi(optarg);
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nruns < 1 || nops < 1 || nwarmup < 0)
+		usage();
+
+	scan_init();
+	memcpy(padded, "  \t", 3);
+	memcpy(padded + 3, request, sizeof(request) - 1);
+	memset(padded + 3 + sizeof(request) - 1, ' ', sizeof(padded) - 3 - sizeof(request));
+	padded[sizeof(padded) - 1] = '\0';
+	src.sin_family		   = AF_INET;
+	src.sin_port		   = htons(5061);
+	src.sin_addr.s_addr	   = htonl(INADDR_LOOPBACK);
+
+	gethostname(host, sizeof(host) - 1);
+	printf("{\"benchmark\": \"micro_bench\", \"host\": \"%s\", \"timestamp\": %ld, "
+	       "\"results\": [\n",
+	    host, (long)time(NULL));
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (only != NULL && strncmp(benches[i].name, only, strlen(only)) != 0)
+			continue;
+		if (!benches[i].logged) {
+			run(&benches[i], "-", NULL, first);
+			first = false;
+			continue;
+		}
+		for (int t = 0; t < 2; t++) {
+			if (*targets[t][1] == '\0')
+				continue;
+			if (stat(targets[t][1], &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+				warnx("skipping %s, %s is not a directory", targets[t][0],
+				    targets[t][1]);
+				targets[t][1] = "";
+				continue;
+			}
+			run(&benches[i], targets[t][0], targets[t][1], first);
+			first = false;
+		}
+	}
+	printf("\n]}\n");
+
+	return (0);
+}
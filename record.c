@@ -0,0 +1,609 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "agg.h"
+#include "banned.h"
+#include "hh.h"
+#include "record.h"
+#include "sipparse.h"
+
+#ifdef CLOCK_REALTIME_COARSE
+#define REC_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define REC_CLOCK CLOCK_REALTIME
+#endif
+
+/*
+ * Per-thread copy of the current epoch as a decimal string, so the clock is
+ * only formatted once a second.
+ */
+static _Thread_local struct {
+	time_t sec;
+	size_t len;
+	char   str[24];
+} epoch_cache = { -1, 0, "" };
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void
+put_le32(char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void
+put_le64(char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t
+get_le32(const char *p)
+{
+	uint32_t v = 0;
+
+	for (int i = 3; i >= 0; i--)
+		v = (v << 8) | (uint8_t)p[i];
+	return (v);
+}
+
+static uint64_t
+get_le64(const char *p)
+{
+	uint64_t v = 0;
+
+	for (int i = 7; i >= 0; i--)
+		v = (v << 8) | (uint8_t)p[i];
+	return (v);
+}
+
+/*
+ * write v in decimal, returns number of characters written
+ */
+static size_t
+fmt_uint(char *buf, uint64_t v)
+{
+	char   tmp[20];
+	size_t n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+
+	for (size_t i = 0; i < n; i++)
+		buf[i] = tmp[n - 1 - i];
+
+	return (n);
+}
+
+static size_t
+fmt_octet(char *buf, unsigned int v)
+{
+	if (v >= 100) {
+		buf[0] = '0' + v / 100;
+		buf[1] = '0' + v / 10 % 10;
+		buf[2] = '0' + v % 10;
+		return (3);
+	}
+	if (v >= 10) {
+		buf[0] = '0' + v / 10;
+		buf[1] = '0' + v % 10;
+		return (2);
+	}
+	buf[0] = '0' + v;
+	return (1);
+}
+
+static size_t
+fmt_ipv4(char *buf, const uint8_t *a)
+{
+	size_t n;
+
+	n	 = fmt_octet(buf, a[0]);
+	buf[n++] = '.';
+	n += fmt_octet(buf + n, a[1]);
+	buf[n++] = '.';
+	n += fmt_octet(buf + n, a[2]);
+	buf[n++] = '.';
+	n += fmt_octet(buf + n, a[3]);
+
+	return (n);
+}
+
+/*
+ * 16-bit group in lowercase hex without leading zeros
+ */
+static size_t
+fmt_hex16(char *buf, unsigned int v)
+{
+	size_t n = 0;
+	int    shift;
+
+	for (shift = 12; shift > 0 && (v >> shift) == 0; shift -= 4)
+		;
+	for (; shift >= 0; shift -= 4)
+		buf[n++] = hexdigits[(v >> shift) & 0xf];
+
+	return (n);
+}
+
+/*
+ * IPv6 address in the form produced by inet_ntop(): the longest run of two
+ * or more zero groups is compressed and IPv4-mapped/compatible addresses end
+ * in dotted quad notation.
+ */
+static size_t
+fmt_ipv6(char *buf, const uint8_t *a)
+{
+	unsigned int words[8];
+	int	     best = -1, bestlen = 0, cur = -1, curlen = 0;
+	size_t	     n	  = 0;
+
+	for (int i = 0; i < 8; i++) {
+		words[i] = (a[2 * i] << 8) | a[2 * i + 1];
+		if (words[i] == 0) {
+			if (cur == -1) {
+				cur    = i;
+				curlen = 0;
+			}
+			if (++curlen > bestlen) {
+				best	= cur;
+				bestlen = curlen;
+			}
+		} else {
+			cur = -1;
+		}
+	}
+	if (bestlen < 2)
+		best = -1;
+
+	for (int i = 0; i < 8; i++) {
+		if (best != -1 && i >= best && i < best + bestlen) {
+			if (i == best)
+				buf[n++] = ':';
+			continue;
+		}
+		if (i != 0)
+			buf[n++] = ':';
+		if (i == 6 && best == 0 && (bestlen == 6 || (bestlen == 5 && words[5] == 0xffff)))
+			return (n + fmt_ipv4(buf + n, a + 12));
+		n += fmt_hex16(buf + n, words[i]);
+	}
+	if (best != -1 && best + bestlen == 8)
+		buf[n++] = ':';
+
+	return (n);
+}
+
+/*
+ * name of the transport protocol as used in log records
+ */
+const char *
+rec_proto(int proto)
+{
+	switch (proto) {
+	case SOCK_STREAM:
+		return ("TCP");
+	case SOCK_DGRAM:
+		return ("UDP");
+	case SOCK_RAW:
+		return ("RAW");
+	default:
+		return ("UNKNOWN");
+	}
+}
+
+/*
+ * current epoch in seconds, from the coarse clock records are stamped with
+ */
+time_t
+rec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(REC_CLOCK, &ts);
+	if (ts.tv_sec != epoch_cache.sec) {
+		epoch_cache.len = fmt_uint(epoch_cache.str, (uint64_t)ts.tv_sec);
+		epoch_cache.sec = ts.tv_sec;
+	}
+
+	return (ts.tv_sec);
+}
+
+/*
+ * current epoch in decimal (up to 20 characters, not NUL-terminated)
+ */
+size_t
+rec_epoch(char *buf)
+{
+	rec_now();
+	memcpy(buf, epoch_cache.str, epoch_cache.len);
+
+	return (epoch_cache.len);
+}
+
+/*
+ * Format the address of sa into buf (at least REC_ADDRSTRLEN bytes, result
+ * is NUL-terminated) and store its port in host order. Returns the length
+ * of the address, 0 for unsupported address families.
+ */
+size_t
+rec_addr(char *buf, const struct sockaddr *sa, uint16_t *port)
+{
+	const struct sockaddr_in * s_in;
+	const struct sockaddr_in6 *s_in6;
+	size_t			   n;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		s_in  = (const struct sockaddr_in *)sa;
+		n     = fmt_ipv4(buf, (const uint8_t *)&s_in->sin_addr);
+		*port = ntohs(s_in->sin_port);
+		break;
+	case AF_INET6:
+		s_in6 = (const struct sockaddr_in6 *)sa;
+		n     = fmt_ipv6(buf, s_in6->sin6_addr.s6_addr);
+		*port = ntohs(s_in6->sin6_port);
+		break;
+	default:
+		buf[0] = '\0';
+		return (0);
+	}
+	buf[n] = '\0';
+
+	return (n);
+}
+
+/*
+ * Room needed after a field of the SIP CSV record: k more quoted fields
+ * with their commas, the content length and the quoted message.
+ */
+#define REC_SIPFIELDS 8
+#define REC_SIPTAIL(k) ((k) * 3 + 1 + 20 + 1 + 2)
+
+/*
+ * the fixed columns of a CSV record: epoch,proto,src ip,src port,
+ */
+static size_t
+rec_head(char *buf, const struct sip_event *ev)
+{
+	const char *pname;
+	uint16_t    port;
+	size_t	    n, plen;
+	char	    family;
+
+	switch (ev->src->sa_family) {
+	case AF_INET:
+		family = '4';
+		break;
+	case AF_INET6:
+		family = '6';
+		break;
+	default:
+		return (0);
+	}
+
+	if (ev->ts == 0)
+		n = rec_epoch(buf);
+	else
+		n = fmt_uint(buf, ev->ts / 1000000000);
+	buf[n++] = ',';
+	pname	 = rec_proto(ev->proto);
+	plen	 = strlen(pname);
+	memcpy(buf + n, pname, plen);
+	n += plen;
+	buf[n++] = family;
+	buf[n++] = ',';
+	n += rec_addr(buf + n, ev->src, &port);
+	buf[n++] = ',';
+	n += fmt_uint(buf + n, port);
+	buf[n++] = ',';
+
+	return (n);
+}
+
+/*
+ * append len bytes of s in double quotes, truncated to leave room bytes
+ * free at the end of buf
+ */
+static size_t
+rec_quote(char *buf, size_t n, size_t size, size_t room, const char *s, size_t len)
+{
+	size_t avail = size - n - 2 - room;
+
+	if (len > avail)
+		len = avail;
+	buf[n++] = '"';
+	memcpy(buf + n, s, len);
+	n += len;
+	buf[n++] = '"';
+
+	return (n);
+}
+
+/*
+ * Build the CSV record for ev into buf without any allocation:
+ *
+ *	epoch,proto,src ip,src port,"message"
+ *
+ * The message is truncated to fit into size bytes. Returns the length of
+ * the record (not NUL-terminated), 0 if the address family is unsupported
+ * or buf is too small to hold anything but the message.
+ */
+size_t
+rec_csv(char *buf, size_t size, const struct sip_event *ev)
+{
+	size_t n;
+
+	if (size < REC_HEADMAX)
+		return (0);
+	if ((n = rec_head(buf, ev)) == 0)
+		return (0);
+
+	return (rec_quote(buf, n, size, 0, ev->msg, ev->len));
+}
+
+/*
+ * Build the CSV record of a parsed SIP message, with the fields picked out
+ * by sip_parse() in front of the message:
+ *
+ *	epoch,proto,src ip,src port,"method","request-uri","call-id","from",
+ *	"to","cseq","user-agent","via",content-length,"message"
+ *
+ * Responses have their status code in place of the method. The spans in
+ * ev->sip point into ev->msg. Fields missing from the message are left
+ * empty, all of them if ev->sip is NULL. Fields and message are truncated
+ * to fit into size bytes.
+ */
+size_t
+rec_sipcsv(char *buf, size_t size, const struct sip_event *ev)
+{
+	static const struct sip_span none;
+	const struct sip_msg *	     sip = ev->sip;
+	const struct sip_span *	     f[REC_SIPFIELDS];
+	size_t			     n;
+
+	if (size < REC_HEADMAX + REC_SIPTAIL(REC_SIPFIELDS))
+		return (0);
+	if ((n = rec_head(buf, ev)) == 0)
+		return (0);
+
+	for (int i = 0; i < REC_SIPFIELDS; i++)
+		f[i] = &none;
+	if (sip != NULL) {
+		f[0] = &sip->method;
+		f[1] = &sip->uri;
+		f[2] = &sip->hdr[SIP_CALLID];
+		f[3] = &sip->hdr[SIP_FROM];
+		f[4] = &sip->hdr[SIP_TO];
+		f[5] = &sip->hdr[SIP_CSEQ];
+		f[6] = &sip->hdr[SIP_UA];
+		f[7] = &sip->hdr[SIP_VIA];
+	}
+
+	for (int i = 0; i < REC_SIPFIELDS; i++) {
+		if (i == 0 && sip != NULL && sip->status != 0) {
+			buf[n++] = '"';
+			n += fmt_uint(buf + n, sip->status);
+			buf[n++] = '"';
+		} else {
+			n = rec_quote(buf, n, size, REC_SIPTAIL(REC_SIPFIELDS - 1 - i),
+			    ev->msg + f[i]->off, f[i]->len);
+		}
+		buf[n++] = ',';
+	}
+	if (sip != NULL && sip->content_length >= 0)
+		n += fmt_uint(buf + n, sip->content_length);
+	buf[n++] = ',';
+
+	return (rec_quote(buf, n, size, 0, ev->msg, ev->len));
+}
+
+/*
+ * Build the CSV summary of an aggregate entry into buf:
+ *
+ *	first seen,last seen,count,proto,src ip,"key"
+ *
+ * Returns its length (not NUL-terminated), 0 if buf is smaller than
+ * REC_AGGMAX or the address family is unsupported.
+ */
+size_t
+rec_agg(char *buf, size_t size, const struct agg_entry *entry)
+{
+	const char *pname;
+	uint16_t    port;
+	size_t	    n, plen;
+	char	    family;
+
+	if (size < REC_AGGMAX)
+		return (0);
+	switch (entry->src.sa.sa_family) {
+	case AF_INET:
+		family = '4';
+		break;
+	case AF_INET6:
+		family = '6';
+		break;
+	default:
+		return (0);
+	}
+
+	n	 = fmt_uint(buf, entry->first);
+	buf[n++] = ',';
+	n += fmt_uint(buf + n, entry->last);
+	buf[n++] = ',';
+	n += fmt_uint(buf + n, entry->count);
+	buf[n++] = ',';
+	pname = rec_proto(entry->proto);
+	plen  = strlen(pname);
+	memcpy(buf + n, pname, plen);
+	n += plen;
+	buf[n++] = family;
+	buf[n++] = ',';
+	n += rec_addr(buf + n, &entry->src.sa, &port);
+	buf[n++] = ',';
+
+	return (rec_quote(buf, n, size, 0, entry->key, entry->keylen));
+}
+
+/*
+ * Build the heavy-hitter record of item, ranked rank at time ts, into buf:
+ *
+ *	epoch,top,dimension,rank,count,"key"
+ *
+ * Source addresses are formatted, other keys logged as they are. Returns
+ * the length of the record, 0 if size is less than REC_TOPMAX.
+ */
+size_t
+rec_top(char *buf, size_t size, time_t ts, int rank, const struct hh_item *item)
+{
+	const char *dname;
+	char	    addr[REC_ADDRSTRLEN];
+	size_t	    n, len;
+
+	if (size < REC_TOPMAX)
+		return (0);
+
+	n = fmt_uint(buf, ts);
+	memcpy(buf + n, ",top,", 5);
+	n += 5;
+	dname = hh_dimname(item->dim);
+	len   = strlen(dname);
+	memcpy(buf + n, dname, len);
+	n += len;
+	buf[n++] = ',';
+	n += fmt_uint(buf + n, rank);
+	buf[n++] = ',';
+	n += fmt_uint(buf + n, item->count);
+	buf[n++] = ',';
+
+	if (item->dim != HH_SRC)
+		return (rec_quote(buf, n, size, 0, item->key, item->keylen));
+	if (item->keylen == 4)
+		len = fmt_ipv4(addr, (const uint8_t *)item->key);
+	else if (item->keylen == 16)
+		len = fmt_ipv6(addr, (const uint8_t *)item->key);
+	else
+		len = 0;
+	return (rec_quote(buf, n, size, 0, addr, len));
+}
+
+/*
+ * Build the binary record for ev into buf:
+ *
+ *	length		uint32, size of the record after this field
+ *	timestamp	uint64, nanoseconds since the epoch
+ *	proto		uint8, SOCK_STREAM, SOCK_DGRAM or SOCK_RAW
+ *	family		uint8, AF_INET or AF_INET6
+ *	salen		uint16, size of the sockaddr that follows
+ *	sockaddr	salen bytes, struct sockaddr_in or sockaddr_in6 as is
+ *	message		up to the end of the record
+ *
+ * Integers are little-endian, the sockaddr is kept in host layout. The
+ * message is truncated to fit into size bytes. Returns the total length,
+ * 0 if the address family is unsupported or buf is too small.
+ */
+size_t
+rec_bin(char *buf, size_t size, const struct sip_event *ev)
+{
+	struct timespec ts;
+	uint64_t	stamp;
+	size_t		salen, len;
+
+	switch (ev->src->sa_family) {
+	case AF_INET:
+		salen = sizeof(struct sockaddr_in);
+		break;
+	case AF_INET6:
+		salen = sizeof(struct sockaddr_in6);
+		break;
+	default:
+		return (0);
+	}
+	if (size < REC_BINHEAD + salen)
+		return (0);
+
+	if ((stamp = ev->ts) == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	len = ev->len < size - REC_BINHEAD - salen ? ev->len : size - REC_BINHEAD - salen;
+
+	put_le32(buf, REC_BINHEAD - 4 + salen + len);
+	put_le64(buf + 4, stamp);
+	buf[12] = ev->proto;
+	buf[13] = ev->src->sa_family == AF_INET ? 4 : 6;
+	buf[14] = salen & 0xff;
+	buf[15] = salen >> 8;
+	memcpy(buf + REC_BINHEAD, ev->src, salen);
+	memcpy(buf + REC_BINHEAD + salen, ev->msg, len);
+
+	return (REC_BINHEAD + salen + len);
+}
+
+/*
+ * Decode the binary record at the start of buf (len bytes available). The
+ * address is copied into ss, the message points into buf. Returns the size
+ * of the record, 0 if buf holds an incomplete or malformed record.
+ */
+size_t
+rec_frombin(const char *buf, size_t len, struct sip_event *ev, struct sockaddr_storage *ss)
+{
+	size_t reclen, salen;
+
+	if (len < REC_BINHEAD)
+		return (0);
+	reclen = get_le32(buf) + 4;
+	salen  = (uint8_t)buf[14] | (uint8_t)buf[15] << 8;
+	if (reclen > len || salen > sizeof(*ss) || REC_BINHEAD + salen > reclen)
+		return (0);
+
+	memset(ss, 0, sizeof(*ss));
+	memcpy(ss, buf + REC_BINHEAD, salen);
+	ss->ss_family = buf[13] == 4 ? AF_INET : AF_INET6;
+
+	ev->ts	  = get_le64(buf + 4);
+	ev->proto = (uint8_t)buf[12];
+	ev->src	  = (struct sockaddr *)ss;
+	ev->msg	  = buf + REC_BINHEAD + salen;
+	ev->len	  = reclen - REC_BINHEAD - salen;
+	ev->sip	  = NULL;
+
+	return (reclen);
+}
@@ -0,0 +1,71 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_ADDRSTRLEN 46 /* same as INET6_ADDRSTRLEN */
+#define REC_HEADMAX 96	  /* upper bound of a CSV record without its message */
+
+#define REC_BINHEAD 16 /* fixed part of a binary record */
+#define REC_AGGMAX 256 /* upper bound of an aggregate summary record */
+#define REC_TOPMAX 256 /* upper bound of a heavy-hitter record */
+
+struct agg_entry;
+struct hh_item;
+struct sip_msg;
+
+/*
+ * a received request, as handed to the record formatters
+ */
+struct sip_event {
+	uint64_t	       ts; /* nanoseconds since the epoch, 0 for now */
+	const struct sockaddr *src;
+	int		       proto; /* SOCK_STREAM, SOCK_DGRAM or SOCK_RAW */
+	const char *	       msg;
+	size_t		       len;
+	const struct sip_msg * sip; /* fields parsed from msg, NULL if not parsed */
+};
+
+const char *rec_proto(int proto);
+time_t	    rec_now(void);
+size_t	    rec_epoch(char *buf);
+size_t	    rec_addr(char *buf, const struct sockaddr *sa, uint16_t *port);
+size_t	    rec_csv(char *buf, size_t size, const struct sip_event *ev);
+size_t	    rec_sipcsv(char *buf, size_t size, const struct sip_event *ev);
+size_t	    rec_agg(char *buf, size_t size, const struct agg_entry *entry);
+size_t	    rec_top(char *buf, size_t size, time_t ts, int rank, const struct hh_item *item);
+size_t	    rec_bin(char *buf, size_t size, const struct sip_event *ev);
+size_t	    rec_frombin(const char *buf, size_t len, struct sip_event *ev,
+	       struct sockaddr_storage *ss);
+
+#endif /* _RECORD_H */
@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+/*
+ * Check the allocation-free record builder against inet_ntop() and compare
+ * its cost per record with the former time()/inet_ntop()/vasprintf() path.
+ */
+
+#define MSG "OPTIONS sip:100@192.0.2.1 SIP/2.0"
+
+static const char *samples[] = { "::", "::1", "1::", "::ffff:192.0.2.1", "::192.0.2.1",
+	"2001:db8::1", "2001:db8:0:0:1:0:0:1", "fe80::1:0:0:0", "2001:0:0:1::", "1:0:1:0:1:0:1:0",
+	"ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", "::ffff:0:0", "0:0:0:0:0:1:0:0" };
+
+static volatile size_t sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * compare rec_addr() with inet_ntop() for one address
+ */
+static void
+check(const struct sockaddr *sa)
+{
+	char	 want[INET6_ADDRSTRLEN], got[REC_ADDRSTRLEN];
+	uint16_t port;
+
+	if (sa->sa_family == AF_INET)
+		inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, want,
+		    sizeof(want));
+	else
+		inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, want,
+		    sizeof(want));
+
+	rec_addr(got, sa, &port);
+	if (strcmp(want, got) != 0)
+		errx(EX_SOFTWARE, "address mismatch: inet_ntop() \"%s\", rec_addr() \"%s\"", want,
+		    got);
+}
+
+static void
+random_v6(struct sockaddr_in6 *s_in6)
+{
+	for (int i = 0; i < 16; i += 2) {
+		/* plenty of zero groups to exercise compression */
+		if (random() % 3 == 0) {
+			s_in6->sin6_addr.s6_addr[i]	= 0;
+			s_in6->sin6_addr.s6_addr[i + 1] = 0;
+		} else {
+			s_in6->sin6_addr.s6_addr[i]	= random() % 3 ? 0 : random();
+			s_in6->sin6_addr.s6_addr[i + 1] = random();
+		}
+	}
+}
+
+static void
+old_path(const struct sockaddr *sa, const char *msg)
+{
+	const struct sockaddr_in * s_in;
+	const struct sockaddr_in6 *s_in6;
+	char			   addr_str[46];
+	char *			   message;
+
+	if (sa->sa_family == AF_INET6) {
+		s_in6 = (const struct sockaddr_in6 *)sa;
+		inet_ntop(AF_INET6, &s_in6->sin6_addr, addr_str, sizeof(addr_str));
+		asprintf(&message, "%ld,%s6,%s,%d,\"%s\"", time(NULL), "UDP", addr_str,
+		    ntohs(s_in6->sin6_port), msg);
+	} else {
+		s_in = (const struct sockaddr_in *)sa;
+		asprintf(&message, "%ld,%s4,%s,%d,\"%s\"", time(NULL), "UDP",
+		    inet_ntoa(s_in->sin_addr), ntohs(s_in->sin_port), msg);
+	}
+	sink += strlen(message);
+	free(message);
+}
+
+static void
+new_path(const struct sockaddr *sa, const char *msg)
+{
+	struct sip_event ev;
+	char		 buf[512];
+
+	ev.ts	 = 0;
+	ev.src	 = sa;
+	ev.proto = SOCK_DGRAM;
+	ev.msg	 = msg;
+	ev.len	 = strlen(msg);
+	ev.sip	 = NULL;
+	sink += rec_csv(buf, sizeof(buf), &ev);
+}
+
+static double
+bench(void (*fn)(const struct sockaddr *, const char *), const struct sockaddr *sa, long iters)
+{
+	double start = now();
+
+	for (long i = 0; i < iters; i++)
+		fn(sa, MSG);
+
+	return ((now() - start) / iters);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in  s_in;
+	struct sockaddr_in6 s_in6;
+	long		    iters = 1000000;
+	double		    t_old, t_new;
+	int		    opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: record_bench [-n iterations]\n");
+			exit(EX_USAGE);
+		}
+	}
+
+	memset(&s_in, 0, sizeof(s_in));
+	memset(&s_in6, 0, sizeof(s_in6));
+	s_in.sin_family	  = AF_INET;
+	s_in6.sin6_family = AF_INET6;
+	s_in.sin_port	  = htons(5060);
+	s_in6.sin6_port	  = htons(40123);
+
+	/* correctness first */
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		inet_pton(AF_INET6, samples[i], &s_in6.sin6_addr);
+		check((struct sockaddr *)&s_in6);
+	}
+	for (int i = 0; i < 1000000; i++) {
+		s_in.sin_addr.s_addr = random();
+		check((struct sockaddr *)&s_in);
+		random_v6(&s_in6);
+		check((struct sockaddr *)&s_in6);
+	}
+	printf("rec_addr() matches inet_ntop()\n");
+
+	inet_pton(AF_INET, "198.51.100.123", &s_in.sin_addr);
+	inet_pton(AF_INET6, "2001:db8:85a3::8a2e:370:7334", &s_in6.sin6_addr);
+
+	printf("%-6s %14s %14s %8s\n", "family", "vasprintf ns", "rec_csv ns", "speedup");
+	t_old = bench(old_path, (struct sockaddr *)&s_in, iters);
+	t_new = bench(new_path, (struct sockaddr *)&s_in, iters);
+	printf("%-6s %14.1f %14.1f %7.2fx\n", "IPv4", t_old, t_new, t_old / t_new);
+	t_old = bench(old_path, (struct sockaddr *)&s_in6, iters);
+	t_new = bench(new_path, (struct sockaddr *)&s_in6, iters);
+	printf("%-6s %14.1f %14.1f %7.2fx\n", "IPv6", t_old, t_new, t_old / t_new);
+
+	return (0);
+}
@@ -0,0 +1,297 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "metrics.h"
+#include "reply.h"
+
+/*
+ * Stateless responder. Scanners that get no answer tend to move on after
+ * one OPTIONS, so UDP requests can be answered the way a PBX would: OPTIONS
+ * and most other requests get a 200 OK, REGISTER a 401 with a digest
+ * challenge and INVITE a 100 Trying followed by the same 401, asking for
+ * the credentials that are worth logging. ACK and responses get nothing.
+ *
+ * The status line and the headers that never change are rendered once;
+ * a reply is then put together from them and the Via, From, To, Call-ID
+ * and CSeq values of the request, with plain copies. Replies are queued
+ * per thread and sent to the socket the request came in on with one
+ * sendmmsg() per receive batch, dropping what the socket cannot take.
+ */
+
+enum reply_kind { REPLY_TRYING, REPLY_OK, REPLY_UNAUTH, REPLY_NKINDS };
+
+/* a reply up to the Via value, and from the end of CSeq on */
+struct reply_tmpl {
+	char   head[64];
+	size_t headlen;
+	char   tail[512];
+	size_t taillen;
+	bool   tag; /* add a To tag, for final responses */
+};
+
+struct reply_batch {
+	unsigned int		n;
+	int			fd;
+	struct mmsghdr		msgs[REPLY_BATCH];
+	struct iovec		iov[REPLY_BATCH];
+	struct sockaddr_storage addrs[REPLY_BATCH];
+	char			bufs[REPLY_BATCH][REPLY_MAX];
+};
+
+static struct reply_tmpl		 tmpl[REPLY_NKINDS];
+static _Thread_local int		 reply_fd = -1;
+static _Thread_local struct reply_batch *reply_tls;
+
+/*
+ * render the fixed parts of every reply, with a nonce for this run
+ */
+void
+reply_init(void)
+{
+	static const struct {
+		const char *status;
+		const char *headers;
+		bool	    tag;
+	} kinds[REPLY_NKINDS] = {
+		[REPLY_TRYING] = { "100 Trying", "", false },
+		[REPLY_OK]     = { "200 OK",
+			"Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, SUBSCRIBE, NOTIFY, INFO, "
+			"PUBLISH, MESSAGE\r\nSupported: replaces, timer\r\n"
+			"Accept: application/sdp\r\n",
+			true },
+		[REPLY_UNAUTH] = { "401 Unauthorized", "WWW-Authenticate: Digest algorithm=MD5, "
+			"realm=\"" REPLY_REALM "\", nonce=\"%08lx%08lx\"\r\n", true },
+	};
+	struct timespec ts;
+	char		hdrs[256];
+	int		n;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (int i = 0; i < REPLY_NKINDS; i++) {
+		n = snprintf(tmpl[i].head, sizeof(tmpl[i].head), "SIP/2.0 %s\r\nVia: ",
+		    kinds[i].status);
+		tmpl[i].headlen = n;
+		snprintf(hdrs, sizeof(hdrs), kinds[i].headers, (unsigned long)ts.tv_sec,
+		    (unsigned long)(ts.tv_nsec ^ getpid()));
+		n = snprintf(tmpl[i].tail, sizeof(tmpl[i].tail),
+		    "\r\n%sServer: " REPLY_SERVER "\r\nContent-Length: 0\r\n\r\n", hdrs);
+		tmpl[i].taillen = n;
+		tmpl[i].tag	= kinds[i].tag;
+	}
+}
+
+/*
+ * answer the requests handled by the calling thread on UDP socket fd
+ * from now on
+ */
+void
+reply_socket(int fd)
+{
+	reply_flush();
+	reply_fd = fd;
+}
+
+/*
+ * batch of the calling thread, NULL if it cannot be allocated
+ */
+static struct reply_batch *
+reply_batch(void)
+{
+	struct reply_batch *b;
+
+	if ((b = reply_tls) != NULL)
+		return (b);
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return (NULL);
+	for (int i = 0; i < REPLY_BATCH; i++) {
+		b->iov[i].iov_base	      = b->bufs[i];
+		b->msgs[i].msg_hdr.msg_iov    = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name   = &b->addrs[i];
+	}
+	return (reply_tls = b);
+}
+
+/* FNV-1a, for To tags that stay the same across retransmissions */
+static uint32_t
+reply_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return (h);
+}
+
+/*
+ * Put together a reply of kind k to req in buf. Returns its length, 0 if
+ * it would not fit.
+ */
+static size_t
+reply_render(char *buf, enum reply_kind k, const char *req, const struct sip_msg *msg)
+{
+	static const struct {
+		const char *name;
+		size_t	    len;
+	} sep[SIP_CSEQ + 1] = {
+		[SIP_VIA]    = { "", 0 },
+		[SIP_FROM]   = { "\r\nFrom: ", 8 },
+		[SIP_TO]     = { "\r\nTo: ", 6 },
+		[SIP_CALLID] = { "\r\nCall-ID: ", 11 },
+		[SIP_CSEQ]   = { "\r\nCSeq: ", 8 },
+	};
+	const struct reply_tmpl *t = &tmpl[k];
+	const struct sip_span *	 to = &msg->hdr[SIP_TO], *callid = &msg->hdr[SIP_CALLID];
+	size_t			 len = t->headlen + t->taillen + sizeof(";tag=12345678");
+	char *			 p   = buf;
+
+	for (int h = SIP_VIA; h <= SIP_CSEQ; h++)
+		len += sep[h].len + msg->hdr[h].len;
+	if (len > REPLY_MAX)
+		return (0);
+
+	memcpy(p, t->head, t->headlen);
+	p += t->headlen;
+	for (int h = SIP_VIA; h <= SIP_CSEQ; h++) {
+		memcpy(p, sep[h].name, sep[h].len);
+		p += sep[h].len;
+		memcpy(p, req + msg->hdr[h].off, msg->hdr[h].len);
+		p += msg->hdr[h].len;
+		if (h != SIP_TO || !t->tag || memmem(req + to->off, to->len, ";tag=", 5) != NULL)
+			continue;
+		p += snprintf(p, 14, ";tag=%08x", reply_hash(req + callid->off, callid->len));
+	}
+	memcpy(p, t->tail, t->taillen);
+	p += t->taillen;
+	return (p - buf);
+}
+
+/*
+ * queue a reply of kind k to dst, sending the batch once it is full
+ */
+static void
+reply_queue(struct reply_batch *b, enum reply_kind k, const struct sockaddr *dst,
+    const char *req, const struct sip_msg *msg)
+{
+	size_t len;
+
+	if ((len = reply_render(b->bufs[b->n], k, req, msg)) == 0) {
+		metric_add(M_REPLY_DROPPED, 1);
+		return;
+	}
+	b->iov[b->n].iov_len			= len;
+	b->msgs[b->n].msg_hdr.msg_namelen	= dst->sa_family == AF_INET6 ?
+		      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	memcpy(&b->addrs[b->n], dst, b->msgs[b->n].msg_hdr.msg_namelen);
+	if (++b->n == REPLY_BATCH)
+		reply_flush();
+}
+
+/*
+ * Answer a parsed request received on the socket set with reply_socket().
+ * Returns the number of replies queued.
+ */
+int
+reply(const struct sockaddr *dst, const char *req, const struct sip_msg *msg)
+{
+	struct reply_batch *b;
+	const char *	    method = req + msg->method.off;
+	size_t		    len	   = msg->method.len;
+
+	if (reply_fd < 0 || len == 0 || (len == 3 && memcmp(method, "ACK", 3) == 0))
+		return (0);
+	for (int h = SIP_VIA; h <= SIP_CSEQ; h++) {
+		if (msg->hdr[h].len == 0)
+			return (0); /* nothing to route or match the reply with */
+	}
+	if ((b = reply_batch()) == NULL) {
+		metric_add(M_REPLY_DROPPED, 1);
+		return (0);
+	}
+
+	if (len == 6 && memcmp(method, "INVITE", 6) == 0) {
+		reply_queue(b, REPLY_TRYING, dst, req, msg);
+		reply_queue(b, REPLY_UNAUTH, dst, req, msg);
+		return (2);
+	}
+	if (len == 8 && memcmp(method, "REGISTER", 8) == 0)
+		reply_queue(b, REPLY_UNAUTH, dst, req, msg);
+	else
+		reply_queue(b, REPLY_OK, dst, req, msg);
+	return (1);
+}
+
+/*
+ * Send the replies the calling thread has queued. Those the socket cannot
+ * take right now are dropped.
+ */
+void
+reply_flush(void)
+{
+	struct reply_batch *b = reply_tls;
+	unsigned int	    sent = 0;
+	int		    n;
+
+	if (b == NULL || b->n == 0)
+		return;
+
+	while (sent < b->n) {
+		if ((n = sendmmsg(reply_fd, b->msgs + sent, b->n - sent, MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* a source that cannot be answered (port 0) must not hold up the rest */
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				metric_add(M_REPLY_DROPPED, 1);
+				sent++;
+				continue;
+			}
+			break;
+		}
+		metric_add(M_REPLY_BATCHES, 1);
+		metric_add(M_REPLIES, n);
+		sent += n;
+	}
+	metric_add(M_REPLY_DROPPED, b->n - sent);
+	b->n = 0;
+}
@@ -0,0 +1,335 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "agg.h"
+#include "banned.h"
+#include "hh.h"
+#include "latency.h"
+#include "metrics.h"
+#include "record.h"
+#include "reply.h"
+#include "request.h"
+#include "scan.h"
+#include "sink.h"
+#include "sipparse.h"
+#include "slog.h"
+
+/*
+ * The request path: trim, parse, filter, count and log whatever a
+ * listener received. Kept apart from the listeners so that it can be
+ * benchmarked on its own.
+ */
+
+_Atomic(log_t *) lfh;
+bool	     use_syslog	   = false;
+int	     syslog_pri	   = -1;
+struct slog *slog	   = NULL;
+log_fmt_t    log_format_fn = NULL;
+bool	     parse_sip	   = false;
+bool	     respond	   = false;
+char *	     methods[MAX_METHODS];
+int	     nmethods = 0;
+unsigned int agg_secs = 0;
+size_t	     agg_size = AGG_ENTRIES;
+unsigned int top_secs = 0;
+struct hh *  hh;
+
+/*
+ * Aggregation tables and heavy-hitter shards, one per receiving thread,
+ * created on first use
+ */
+static _Thread_local struct agg *     agg_tls;
+static struct agg *		      agg_tables[AGG_TABLES];
+static int			      nagg;
+static pthread_mutex_t		      agg_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct hh_shard *hh_tls;
+
+/*
+ * Trim string from whitespace characters. len holds the size of the buffer
+ * and is set to the length of the returned string, which is cut at the
+ * first NUL as before.
+ */
+char *
+chomp(char *s, size_t *len)
+{
+	size_t lead, n;
+
+	n    = strnlen(s, *len);
+	lead = scan_lspace(s, n);
+	n    = lead + scan_rspace(s + lead, n - lead);
+
+	s[n] = '\0';
+	*len = n - lead;
+
+	return (s + lead);
+}
+
+
+/*
+ * log_emit() callbacks building the CSV or binary record of a request
+ */
+size_t
+format_csv(char *buf, size_t size, const void *arg)
+{
+	return (rec_csv(buf, size, arg));
+}
+
+size_t
+format_binary(char *buf, size_t size, const void *arg)
+{
+	return (rec_bin(buf, size, arg));
+}
+
+size_t
+format_sip(char *buf, size_t size, const void *arg)
+{
+	return (rec_sipcsv(buf, size, arg));
+}
+
+static size_t
+format_agg(char *buf, size_t size, const void *arg)
+{
+	return (rec_agg(buf, size, arg));
+}
+
+/*
+ * the syslog message of a request, as with -s
+ */
+size_t
+format_syslog(char *buf, size_t size, const void *arg)
+{
+	const struct sip_event *ev = arg;
+	char			addr[REC_ADDRSTRLEN];
+	uint16_t		port;
+	int			n;
+
+	rec_addr(addr, ev->src, &port);
+	n = snprintf(buf, size, "From: %s:%d (%s%c) - Message: \"%s\"", addr, port,
+	    rec_proto(ev->proto), ev->src->sa_family == AF_INET ? '4' : '6', ev->msg);
+	return (n < 0 ? 0 : MIN((size_t)n, size - 1));
+}
+
+/*
+ * write the summary of a flushed or evicted aggregate
+ */
+static void
+agg_emit(const struct agg_entry *entry, void *arg)
+{
+	char   buf[REC_AGGMAX + 1];
+	size_t len;
+
+	(void)arg;
+	if (use_syslog) {
+		len	 = rec_agg(buf, REC_AGGMAX, entry);
+		buf[len] = '\0';
+		syslog_msg("%s", buf);
+	} else {
+		log_emit(lfh, format_agg, entry);
+		sinks_emit(format_agg, format_agg, entry);
+	}
+}
+
+/*
+ * aggregation table of the calling thread, NULL if it cannot be allocated
+ */
+static struct agg *
+agg_table(void)
+{
+	if (agg_tls != NULL)
+		return (agg_tls);
+
+	pthread_mutex_lock(&agg_lock);
+	if (nagg < AGG_TABLES && (agg_tls = agg_new(agg_size, agg_emit, NULL)) != NULL)
+		agg_tables[nagg++] = agg_tls;
+	pthread_mutex_unlock(&agg_lock);
+
+	return (agg_tls);
+}
+
+/*
+ * emit the summaries of all threads
+ */
+void
+agg_flushall(void)
+{
+	pthread_mutex_lock(&agg_lock);
+	for (int i = 0; i < nagg; i++)
+		agg_flush(agg_tables[i]);
+	pthread_mutex_unlock(&agg_lock);
+	syslog_flush();
+}
+
+/*
+ * send a message to syslog, through the native sink if there is one
+ */
+void
+syslog_msg(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (slog != NULL)
+		slog_vprintf(slog, fmt, ap);
+	else
+		vsyslog(syslog_pri, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Send the messages the calling thread has queued for the native sink.
+ * Listeners call this after every batch they received.
+ */
+void
+syslog_flush(void)
+{
+	if (slog != NULL)
+		slog_flush(slog);
+}
+
+
+/*
+ * count the source, method and user agent of a request as heavy hitters
+ */
+static void
+count_top(const struct sockaddr *src, const struct sip_msg *sip, const char *str)
+{
+	if (hh_tls == NULL && (hh_tls = hh_shard_new(hh)) == NULL)
+		return;
+
+	if (src->sa_family == AF_INET6)
+		hh_add(hh_tls, HH_SRC, &((const struct sockaddr_in6 *)src)->sin6_addr,
+		    sizeof(struct in6_addr));
+	else
+		hh_add(hh_tls, HH_SRC, &((const struct sockaddr_in *)src)->sin_addr,
+		    sizeof(struct in_addr));
+	if (sip == NULL)
+		return;
+	if (sip->method.len > 0)
+		hh_add(hh_tls, HH_METHOD, str + sip->method.off, sip->method.len);
+	if (sip->hdr[SIP_UA].len > 0)
+		hh_add(hh_tls, HH_UA, str + sip->hdr[SIP_UA].off, sip->hdr[SIP_UA].len);
+}
+
+
+/*
+ * check the method of a parsed request against the -M list, responses
+ * and anything that is not SIP never match
+ */
+static bool
+method_wanted(const char *str, const struct sip_msg *msg)
+{
+	if (msg == NULL || msg->method.len == 0)
+		return (false);
+
+	for (int i = 0; i < nmethods; i++) {
+		if (strlen(methods[i]) == msg->method.len &&
+		    memcmp(methods[i], str + msg->method.off, msg->method.len) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * log a request of len bytes in str (NUL-terminated at len)
+ */
+void
+process_request(int af, struct sockaddr *src, int proto, char *str, size_t len)
+{
+	struct sip_event ev;
+	struct sip_msg	 msg, *sip = NULL;
+	struct agg *	 agg;
+	char		 addr_str[REC_ADDRSTRLEN];
+	uint16_t	 port;
+	uint64_t	 t0 = lat_enabled ? lat_now() : 0;
+
+#ifdef PF_INET6
+	if (af != AF_INET && af != AF_INET6)
+		return;
+#else
+	if (af != AF_INET)
+		return;
+#endif /* PF_INET6 */
+
+	str = chomp(str, &len);
+
+	/* fields point into str */
+	if (parse_sip) {
+		if (sip_parse(str, len, &msg) == 0)
+			sip = &msg;
+		else
+			metric_add(M_REQ_UNPARSED, 1);
+	}
+	if (respond && proto == SOCK_DGRAM && sip != NULL)
+		reply(src, str, sip);
+	if (nmethods > 0 && !method_wanted(str, sip)) {
+		metric_add(M_REQ_FILTERED, 1);
+		return;
+	}
+	if (top_secs > 0)
+		count_top(src, sip, str);
+	if (lat_enabled)
+		lat_record(LAT_PARSE, t0, lat_now());
+
+	/* count requests by source and method (or first line) instead of logging them */
+	if (agg_secs > 0 && (agg = agg_table()) != NULL) {
+		if (sip != NULL && sip->method.len > 0)
+			agg_add(agg, src, proto, str + sip->method.off, sip->method.len, rec_now());
+		else
+			agg_add(agg, src, proto, str, scan_eol(str, len), rec_now());
+		return;
+	}
+
+	if (use_syslog) {
+		rec_addr(addr_str, src, &port);
+		syslog_msg("From: %s:%d (%s%c) - Message: \"%s\"", addr_str, port,
+		    rec_proto(proto), af == AF_INET ? '4' : '6', str);
+	} else {
+		ev.ts	 = 0;
+		ev.src	 = src;
+		ev.proto = proto;
+		ev.msg	 = str;
+		ev.len	 = len;
+		ev.sip	 = sip;
+		log_emit(lfh, log_format_fn, &ev);
+		sinks_emit(log_format_fn, format_syslog, &ev);
+	}
+}
+
@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _REQUEST_H
+#define _REQUEST_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "logfile.h"
+
+#define MAX_METHODS 32
+#define AGG_TABLES 1024 /* receiving threads that may aggregate */
+
+struct hh;
+struct slog;
+
+/*
+ * Settings of the request path, set up by fsipd before any request is
+ * processed.
+ */
+extern _Atomic(log_t *) lfh; /* use between epoch_enter() and epoch_exit() */
+extern bool	    use_syslog;
+extern int	    syslog_pri;
+extern struct slog * slog; /* native syslog sink (-S), NULL: syslog(3) */
+extern log_fmt_t    log_format_fn;
+extern bool	    parse_sip;		  /* run requests through sip_parse() */
+extern bool	    respond;		  /* answer UDP requests (-r) */
+extern char *	    methods[MAX_METHODS]; /* only log these methods (-M) */
+extern int	    nmethods;
+extern unsigned int agg_secs; /* aggregate and flush every agg_secs, 0: off */
+extern size_t	    agg_size;
+extern unsigned int top_secs; /* report heavy hitters every top_secs, 0: off */
+extern struct hh *  hh;
+
+char * chomp(char *s, size_t *len);
+void   process_request(int af, struct sockaddr *src, int proto, char *str, size_t len);
+void   agg_flushall(void);
+void   syslog_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void   syslog_flush(void);
+size_t format_csv(char *buf, size_t size, const void *arg);
+size_t format_binary(char *buf, size_t size, const void *arg);
+size_t format_sip(char *buf, size_t size, const void *arg);
+size_t format_syslog(char *buf, size_t size, const void *arg);
+
+#endif /* _REQUEST_H */
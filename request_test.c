@@ -0,0 +1,140 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "request.h"
+#include "slog.h"
+
+#define REQUESTS 3
+#define SOURCES 200 /* many more summaries than a UNIX datagram socket queues */
+
+/*
+ * Aggregate requests from SOURCES addresses and a few from 127.0.0.1 with
+ * syslog as the output (-a with -S), flush the tables the way fsipd does
+ * at shutdown and check that a slow reader gets every summary, whole.
+ */
+
+int	    fd;
+int	    received;
+bool	    found;
+const char *want = ",3,UDP4,127.0.0.1,\"OPTIONS sip:x SIP/2.0\"";
+
+void *
+reader(void *arg)
+{
+	struct timespec pause = { 0, 200000 };
+	char		msg[1024];
+	ssize_t		n;
+
+	(void)arg;
+	while ((n = recv(fd, msg, sizeof(msg) - 1, 0)) > 0) {
+		msg[n] = '\0';
+		received++;
+		if (n >= (ssize_t)strlen(want) && strcmp(msg + n - strlen(want), want) == 0)
+			found = true;
+		nanosleep(&pause, NULL);
+	}
+
+	return (NULL);
+}
+
+void
+request(struct sockaddr_in *src, in_addr_t addr)
+{
+	char req[64];
+
+	src->sin_addr.s_addr = htonl(addr);
+	snprintf(req, sizeof(req), "OPTIONS sip:x SIP/2.0");
+	process_request(AF_INET, (struct sockaddr *)src, SOCK_DGRAM, req, strlen(req));
+}
+
+int
+main(void)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in src;
+	struct timeval	   tv = { .tv_sec = 1 };
+	pthread_t	   thr;
+	char		   path[sizeof(sun.sun_path)];
+
+	snprintf(path, sizeof(path), "/tmp/request_test.%d", (int)getpid());
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+	    bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "cannot bind %s", path);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	syslog_pri = LOG_USER | LOG_NOTICE;
+	if ((slog = slog_open(path, syslog_pri)) == NULL)
+		err(1, "slog_open %s", path);
+	use_syslog = true;
+	agg_secs   = 60;
+	agg_size   = 1024;
+
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	src.sin_port   = htons(5060);
+	for (int i = 0; i < REQUESTS; i++)
+		request(&src, INADDR_LOOPBACK);
+	for (int i = 0; i < SOURCES; i++)
+		request(&src, 0x0a000001 + i);
+
+	if ((errno = pthread_create(&thr, NULL, reader, NULL)) != 0)
+		err(1, "pthread_create");
+	slog_drain(slog);
+	agg_flushall();
+	pthread_join(thr, NULL);
+	unlink(path);
+
+	if (received != SOURCES + 1)
+		errx(1, "received %d of %d summaries", received, SOURCES + 1);
+	if (!found)
+		errx(1, "no summary ending in %s", want);
+
+	return (0);
+}
@@ -0,0 +1,298 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "banned.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif /* __x86_64__ || __i386__ */
+
+/*
+ * Each kernel comes in a scalar, an SSE2 and an AVX2 flavour. The vector
+ * ones turn a block of input into a bit mask of interesting bytes and
+ * leave the tail shorter than a block to the scalar code. The flavour is
+ * picked once at startup by scan_init(), until then the scalar code runs.
+ */
+
+static inline bool
+is_space(unsigned char c)
+{
+	return (c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t');
+}
+
+static size_t
+eol_scalar(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && s[i] != '\r' && s[i] != '\n'; i++)
+		;
+	return (i);
+}
+
+static size_t
+hdrdelim_scalar(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && s[i] != ':' && s[i] != '\r' && s[i] != '\n'; i++)
+		;
+	return (i);
+}
+
+static size_t
+lspace_scalar(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && is_space(s[i]); i++)
+		;
+	return (i);
+}
+
+static size_t
+rspace_scalar(const char *s, size_t len)
+{
+	while (len > 0 && is_space(s[len - 1]))
+		len--;
+	return (len);
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Forward scan: offset of the first byte whose bit is set in mask(block).
+ * What is left after the last full block is covered by a block overlapping
+ * the previous one, inputs shorter than a block go to the next smaller
+ * flavour. Backward scan: length up to the last byte whose bit is set.
+ */
+#define SCAN_FWD(name, isa, vec, width, load, mask, tail)                              \
+	static __attribute__((target(isa))) size_t name(const char *s, size_t len)     \
+	{                                                                              \
+		size_t	 i;                                                            \
+		uint32_t m;                                                            \
+                                                                                       \
+		if (len < width)                                                       \
+			return (tail(s, len));                                         \
+		for (i = 0; i + width <= len; i += width) {                            \
+			if ((m = mask(load((const vec *)(s + i)))) != 0)               \
+				return (i + __builtin_ctz(m));                         \
+		}                                                                      \
+		if (i == len)                                                          \
+			return (len);                                                  \
+		m = mask(load((const vec *)(s + len - width))) >> (width - (len - i)); \
+		return (m != 0 ? i + __builtin_ctz(m) : len);                          \
+	}
+
+#define SCAN_BWD(name, isa, vec, width, load, mask, tail)                          \
+	static __attribute__((target(isa))) size_t name(const char *s, size_t len) \
+	{                                                                          \
+		uint32_t m;                                                        \
+                                                                                   \
+		for (; len >= width; len -= width) {                               \
+			if ((m = mask(load((const vec *)(s + len - width)))) != 0) \
+				return (len - width + 32 - __builtin_clz(m));      \
+		}                                                                  \
+		return (tail(s, len));                                             \
+	}
+
+static inline __attribute__((target("sse2"))) uint32_t
+sse2_eol(__m128i v)
+{
+	return (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+	    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))));
+}
+
+static inline __attribute__((target("sse2"))) uint32_t
+sse2_hdrdelim(__m128i v)
+{
+	return (sse2_eol(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(':'))));
+}
+
+/* whitespace is 9..13 or space: subtract 9 and compare unsigned with 4 */
+static inline __attribute__((target("sse2"))) uint32_t
+sse2_nonspace(__m128i v)
+{
+	__m128i x = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i ws;
+
+	ws = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8('\r' - '\t')), x),
+	    _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	return (~_mm_movemask_epi8(ws) & 0xffff);
+}
+
+static inline __attribute__((target("avx2"))) uint32_t
+avx2_eol(__m256i v)
+{
+	return (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+	    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))));
+}
+
+static inline __attribute__((target("avx2"))) uint32_t
+avx2_hdrdelim(__m256i v)
+{
+	return (avx2_eol(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))));
+}
+
+static inline __attribute__((target("avx2"))) uint32_t
+avx2_nonspace(__m256i v)
+{
+	__m256i x = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	__m256i ws;
+
+	ws = _mm256_or_si256(
+	    _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8('\r' - '\t')), x),
+	    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	return (~(uint32_t)_mm256_movemask_epi8(ws));
+}
+
+SCAN_FWD(eol_sse2, "sse2", __m128i, 16, _mm_loadu_si128, sse2_eol, eol_scalar)
+SCAN_FWD(hdrdelim_sse2, "sse2", __m128i, 16, _mm_loadu_si128, sse2_hdrdelim, hdrdelim_scalar)
+SCAN_FWD(lspace_sse2, "sse2", __m128i, 16, _mm_loadu_si128, sse2_nonspace, lspace_scalar)
+SCAN_BWD(rspace_sse2, "sse2", __m128i, 16, _mm_loadu_si128, sse2_nonspace, rspace_scalar)
+
+/*
+ * 16 byte blocks for the tails of the AVX2 kernels, VEX encoded to avoid
+ * the penalty of mixing them with legacy SSE code
+ */
+SCAN_FWD(eol_avx16, "avx2", __m128i, 16, _mm_loadu_si128, sse2_eol, eol_scalar)
+SCAN_FWD(hdrdelim_avx16, "avx2", __m128i, 16, _mm_loadu_si128, sse2_hdrdelim, hdrdelim_scalar)
+SCAN_FWD(lspace_avx16, "avx2", __m128i, 16, _mm_loadu_si128, sse2_nonspace, lspace_scalar)
+SCAN_BWD(rspace_avx16, "avx2", __m128i, 16, _mm_loadu_si128, sse2_nonspace, rspace_scalar)
+
+SCAN_FWD(eol_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, avx2_eol, eol_avx16)
+SCAN_FWD(hdrdelim_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, avx2_hdrdelim, hdrdelim_avx16)
+SCAN_FWD(lspace_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, avx2_nonspace, lspace_avx16)
+SCAN_BWD(rspace_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, avx2_nonspace, rspace_avx16)
+
+#endif /* SCAN_X86 */
+
+/*
+ * the flavours, best first
+ */
+static const struct scan_impl {
+	const char *name;
+	size_t (*eol)(const char *, size_t);
+	size_t (*hdrdelim)(const char *, size_t);
+	size_t (*lspace)(const char *, size_t);
+	size_t (*rspace)(const char *, size_t);
+} impls[] = {
+#ifdef SCAN_X86
+	{ "avx2", eol_avx2, hdrdelim_avx2, lspace_avx2, rspace_avx2 },
+	{ "sse2", eol_sse2, hdrdelim_sse2, lspace_sse2, rspace_sse2 },
+#endif /* SCAN_X86 */
+	{ "scalar", eol_scalar, hdrdelim_scalar, lspace_scalar, rspace_scalar },
+};
+
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static const struct scan_impl *impl = &impls[NIMPLS - 1];
+
+/*
+ * whether the CPU we run on can execute the named flavour
+ */
+static bool
+scan_supported(const char *name)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "avx2") == 0)
+		return (__builtin_cpu_supports("avx2"));
+	if (strcmp(name, "sse2") == 0)
+		return (__builtin_cpu_supports("sse2"));
+#endif /* SCAN_X86 */
+	return (strcmp(name, "scalar") == 0);
+}
+
+/*
+ * Use the best flavour the CPU supports. Call once at startup before any
+ * threads are started.
+ */
+void
+scan_init(void)
+{
+	for (size_t i = 0; i < NIMPLS; i++) {
+		if (scan_supported(impls[i].name)) {
+			impl = &impls[i];
+			return;
+		}
+	}
+}
+
+/*
+ * use the named flavour (for tests and benchmarks), -1 if it is unknown or
+ * not supported by the CPU
+ */
+int
+scan_select(const char *name)
+{
+	for (size_t i = 0; i < NIMPLS; i++) {
+		if (strcmp(impls[i].name, name) == 0 && scan_supported(name)) {
+			impl = &impls[i];
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * name of the flavour in use
+ */
+const char *
+scan_name(void)
+{
+	return (impl->name);
+}
+
+size_t
+scan_eol(const char *s, size_t len)
+{
+	return (impl->eol(s, len));
+}
+
+size_t
+scan_hdrdelim(const char *s, size_t len)
+{
+	return (impl->hdrdelim(s, len));
+}
+
+size_t
+scan_lspace(const char *s, size_t len)
+{
+	return (impl->lspace(s, len));
+}
+
+size_t
+scan_rspace(const char *s, size_t len)
+{
+	return (impl->rspace(s, len));
+}
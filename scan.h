@@ -0,0 +1,50 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Delimiter scanning over received messages, 16 or 32 bytes at a time
+ * where the CPU allows. scan_eol() returns the offset of the first CR or
+ * LF in s[0..len), scan_hdrdelim() that of the first ':', CR or LF and
+ * scan_lspace() that of the first byte that is not whitespace, all of them
+ * len if there is none. scan_rspace() returns the length of s without
+ * trailing whitespace. Whitespace is what isspace() accepts in the C
+ * locale.
+ */
+size_t	    scan_eol(const char *s, size_t len);
+size_t	    scan_hdrdelim(const char *s, size_t len);
+size_t	    scan_lspace(const char *s, size_t len);
+size_t	    scan_rspace(const char *s, size_t len);
+
+void	    scan_init(void);
+int	    scan_select(const char *name);
+const char *scan_name(void);
+
+#endif /* _SCAN_H */
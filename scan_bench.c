@@ -0,0 +1,303 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+/*
+ * Check the vector scan kernels against the scalar ones, then compare the
+ * former isspace() based chomp() with the scan based one, and splitting a
+ * message into lines, on typical SIP payloads.
+ */
+
+#define MAXPAYLOAD 8192
+
+static const char *flavours[] = { "scalar", "sse2", "avx2" };
+
+#define NFLAVOURS (sizeof(flavours) / sizeof(flavours[0]))
+
+static const char options[] =
+    "OPTIONS sip:100@192.0.2.1 SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 198.51.100.7:5071;branch=z9hG4bK-2553131048;rport\r\n"
+    "Content-Length: 0\r\n"
+    "From: \"sipvicious\"<sip:100@1.1.1.1>;tag=6434396633623535\r\n"
+    "Accept: application/sdp\r\n"
+    "User-Agent: friendly-scanner\r\n"
+    "To: \"sipvicious\"<sip:100@1.1.1.1>\r\n"
+    "Contact: sip:100@198.51.100.7:5071\r\n"
+    "CSeq: 1 OPTIONS\r\n"
+    "Call-ID: 843412393958129447391421\r\n"
+    "Max-Forwards: 70\r\n"
+    "\r\n";
+
+static const char invite[] =
+    "INVITE sip:bob@biloxi.example.com SIP/2.0\r\n"
+    "Via: SIP/2.0/TCP client.atlanta.example.com:5060;branch=z9hG4bK74bf9\r\n"
+    "Max-Forwards: 70\r\n"
+    "From: Alice <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+    "To: Bob <sip:bob@biloxi.example.com>\r\n"
+    "Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+    "CSeq: 1 INVITE\r\n"
+    "Contact: <sip:alice@client.atlanta.example.com;transport=tcp>\r\n"
+    "Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, NOTIFY, MESSAGE\r\n"
+    "User-Agent: SomePhone/4.2.1 (build 1043)\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 151\r\n"
+    "\r\n"
+    "v=0\r\n"
+    "o=alice 2890844526 2890844526 IN IP4 client.atlanta.example.com\r\n"
+    "s=-\r\n"
+    "c=IN IP4 192.0.2.101\r\n"
+    "t=0 0\r\n"
+    "m=audio 49172 RTP/AVP 0\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n"
+    "\r\n";
+
+static const char padding[] =
+    "X-Padding: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n";
+
+static struct {
+	const char *name;
+	char	    data[MAXPAYLOAD];
+	size_t	    len;
+} payloads[] = {
+	{ "line", "OPTIONS sip:100@192.0.2.1 SIP/2.0\r\n", 0 },
+	{ "options", "", 0 },
+	{ "invite", "", 0 },
+	{ "8k", "", 0 },
+};
+
+#define NPAYLOADS (sizeof(payloads) / sizeof(payloads[0]))
+
+static volatile size_t sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * chomp() as it was
+ */
+static size_t
+old_chomp(char *s)
+{
+	int i;
+
+	while (isspace(*s))
+		s++;
+	if (*s == 0)
+		return 0;
+	i = strlen(s);
+	while ((i > 0) && (isspace(s[i - 1])))
+		i--;
+	s[i] = '\0';
+
+	return i;
+}
+
+static size_t
+new_chomp(char *s, size_t len)
+{
+	size_t lead, n;
+
+	n    = strnlen(s, len);
+	lead = scan_lspace(s, n);
+	n    = lead + scan_rspace(s + lead, n - lead);
+	s[n] = '\0';
+
+	return (n - lead);
+}
+
+/*
+ * number of lines in s
+ */
+static size_t
+split(const char *s, size_t len)
+{
+	size_t lines = 0;
+
+	for (size_t off = 0; off < len; lines++) {
+		off += scan_eol(s + off, len - off);
+		off += off < len && s[off] == '\r';
+		off += off < len && s[off] == '\n';
+	}
+	return (lines);
+}
+
+/*
+ * compare every kernel of the selected flavour with the scalar one on
+ * random buffers full of delimiters
+ */
+static void
+check(const char *flavour)
+{
+	static const char alphabet[] = " \t\r\n\v\f:aZ09-;";
+	char		  buf[200];
+	size_t		  len, want[4], got[4];
+
+	for (int iter = 0; iter < 200000; iter++) {
+		len = random() % sizeof(buf);
+		for (size_t i = 0; i < len; i++)
+			buf[i] = random() % 4 ? alphabet[random() % (sizeof(alphabet) - 1)] :
+						random();
+
+		scan_select("scalar");
+		want[0] = scan_eol(buf, len);
+		want[1] = scan_hdrdelim(buf, len);
+		want[2] = scan_lspace(buf, len);
+		want[3] = scan_rspace(buf, len);
+		scan_select(flavour);
+		got[0] = scan_eol(buf, len);
+		got[1] = scan_hdrdelim(buf, len);
+		got[2] = scan_lspace(buf, len);
+		got[3] = scan_rspace(buf, len);
+		if (memcmp(want, got, sizeof(want)) != 0)
+			errx(EX_SOFTWARE, "%s: kernels disagree with the scalar code", flavour);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char   buf[MAXPAYLOAD];
+	size_t len;
+	long   iters = 1000000;
+	double start, copy, t;
+	int    opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: scan_bench [-n iterations]\n");
+			exit(EX_USAGE);
+		}
+	}
+
+	memcpy(payloads[1].data, options, sizeof(options));
+	memcpy(payloads[2].data, invite, sizeof(invite));
+	/* an INVITE padded with long lines up to the receive buffer size */
+	len = sizeof(invite) - 1;
+	memcpy(payloads[3].data, invite, len);
+	while (len + sizeof(padding) < MAXPAYLOAD - 100) {
+		memcpy(payloads[3].data + len, padding, sizeof(padding) - 1);
+		len += sizeof(padding) - 1;
+	}
+	memcpy(payloads[3].data + len, "\r\n", 3);
+	for (size_t i = 0; i < NPAYLOADS; i++)
+		payloads[i].len = strlen(payloads[i].data);
+
+	for (size_t k = 1; k < NFLAVOURS; k++) {
+		if (scan_select(flavours[k]) == 0) {
+			check(flavours[k]);
+			printf("%s kernels match the scalar code\n", flavours[k]);
+		}
+	}
+
+	printf("\n%-8s %6s %10s", "chomp", "bytes", "old ns");
+	for (size_t k = 0; k < NFLAVOURS; k++)
+		printf(" %9s", flavours[k]);
+	printf("\n");
+	for (size_t i = 0; i < NPAYLOADS; i++) {
+		/* both versions write into the buffer, so it is copied every time */
+		start = now();
+		for (long n = 0; n < iters; n++) {
+			memcpy(buf, payloads[i].data, payloads[i].len + 1);
+			sink += buf[n & 7];
+		}
+		copy = (now() - start) / iters;
+
+		start = now();
+		for (long n = 0; n < iters; n++) {
+			memcpy(buf, payloads[i].data, payloads[i].len + 1);
+			sink += old_chomp(buf);
+		}
+		printf("%-8s %6zu %10.1f", payloads[i].name, payloads[i].len,
+		    (now() - start) / iters - copy);
+
+		for (size_t k = 0; k < NFLAVOURS; k++) {
+			if (scan_select(flavours[k]) == -1) {
+				printf(" %9s", "-");
+				continue;
+			}
+			start = now();
+			for (long n = 0; n < iters; n++) {
+				memcpy(buf, payloads[i].data, payloads[i].len + 1);
+				sink += new_chomp(buf, sizeof(buf));
+			}
+			t = (now() - start) / iters - copy;
+			printf(" %9.1f", t);
+		}
+		printf("\n");
+	}
+
+	printf("\n%-8s %6s %10s", "split", "bytes", "memchr ns");
+	for (size_t k = 0; k < NFLAVOURS; k++)
+		printf(" %9s", flavours[k]);
+	printf("\n");
+	for (size_t i = 1; i < NPAYLOADS; i++) {
+		start = now();
+		for (long n = 0; n < iters; n++) {
+			const char *p = payloads[i].data, *end = p + payloads[i].len, *nl;
+
+			for (; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+				sink++;
+		}
+		printf("%-8s %6zu %10.1f", payloads[i].name, payloads[i].len,
+		    (now() - start) / iters);
+
+		for (size_t k = 0; k < NFLAVOURS; k++) {
+			if (scan_select(flavours[k]) == -1) {
+				printf(" %9s", "-");
+				continue;
+			}
+			start = now();
+			for (long n = 0; n < iters; n++)
+				sink += split(payloads[i].data, payloads[i].len);
+			printf(" %9.1f", (now() - start) / iters);
+		}
+		printf("\n");
+	}
+
+	return (0);
+}
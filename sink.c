@@ -0,0 +1,482 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "logq.h"
+#include "sink.h"
+#include "slog.h"
+
+/*
+ * Outputs besides the log file (-O): syslog and local UNIX datagram
+ * sockets. Each one has a queue of its own, taken batch records at a time
+ * by a sender thread of its own, so that the receiving threads only format
+ * a record into a slot per sink and a sink that falls behind fills its own
+ * queue only. When it is full, the overflow policy of that sink decides
+ * between waiting and dropping. The log file keeps the queue of its writer
+ * thread (log_async()), which works the same way.
+ */
+
+struct sink {
+	enum sink_kind		  kind;
+	char			  name[MAXPATHLEN]; /* "syslog" or the socket path */
+	struct log_queue *	  q;
+	bool			  newline; /* end text records with one (sockets) */
+	int			  fd;	   /* SINK_SOCKET, -1 while not connected */
+	long long		  retry;   /* msecs of the next attempt to connect */
+	struct slog *		  slog;	   /* SINK_SYSLOG, NULL: syslog(3) */
+	int			  pri;
+	atomic_uint_least64_t	  lost; /* dequeued but not delivered */
+};
+
+static struct sink sinks[SINK_MAX];
+static int	   nsinks;
+static int	   nstarted; /* sinks whose sender thread is running */
+static atomic_int  nlive;    /* sinks records are handed to, 0 once stopped */
+
+static long long
+sink_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * a number from 1 to max at s, 0 if there is none or it is out of range
+ */
+static size_t
+sink_number(const char *s, char **end, size_t max)
+{
+	unsigned long n;
+
+	if (*s < '0' || *s > '9')
+		return (0);
+	errno = 0;
+	n     = strtoul(s, end, 10);
+	if (errno != 0 || n > max)
+		return (0);
+	return (n);
+}
+
+/*
+ * Parse sink[:qlen[:batch[:block|drop]]], where sink is "file", "syslog"
+ * or the path of a UNIX datagram socket (containing a slash). Unset fields
+ * are left 0, see struct sink_cfg.
+ */
+int
+sink_parse(const char *spec, struct sink_cfg *cfg)
+{
+	const char *p;
+	char *	    end;
+	size_t	    len;
+
+	memset(cfg, 0, sizeof(*cfg));
+	len = (p = strchr(spec, ':')) != NULL ? (size_t)(p - spec) : strlen(spec);
+	if (len == 4 && strncmp(spec, "file", 4) == 0) {
+		cfg->kind = SINK_FILE;
+	} else if (len == 6 && strncmp(spec, "syslog", 6) == 0) {
+		cfg->kind = SINK_SYSLOG;
+	} else if (memchr(spec, '/', len) != NULL && len < sizeof(cfg->path) &&
+	    len < sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		cfg->kind = SINK_SOCKET;
+		memcpy(cfg->path, spec, len);
+	} else {
+		return (-1);
+	}
+
+	if (p != NULL) {
+		if ((cfg->qlen = sink_number(p + 1, &end, LOGQ_MAX)) == 0)
+			return (-1);
+		p = end;
+	}
+	if (p != NULL && *p == ':') {
+		if ((cfg->batch = sink_number(p + 1, &end, LOG_MAXBATCH)) == 0)
+			return (-1);
+		p = end;
+	}
+	if (p != NULL && *p == ':') {
+		if (strcmp(p + 1, "block") == 0)
+			cfg->policy = LOG_BLOCK;
+		else if (strcmp(p + 1, "drop") == 0)
+			cfg->policy = LOG_DROP;
+		else
+			return (-1);
+		cfg->has_policy = true;
+		p += strlen(p);
+	}
+	return (p == NULL || *p == '\0' ? 0 : -1);
+}
+
+/*
+ * add a syslog or socket sink, the log file is set up with log_async()
+ */
+int
+sink_add(const struct sink_cfg *cfg)
+{
+	struct sink *s;
+
+	if (cfg->kind == SINK_FILE || nsinks == SINK_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (int i = 0; i < nsinks; i++) {
+		if (sinks[i].kind == cfg->kind &&
+		    (cfg->kind == SINK_SYSLOG || strcmp(sinks[i].name, cfg->path) == 0)) {
+			errno = EEXIST;
+			return (-1);
+		}
+	}
+
+	s = &sinks[nsinks];
+	memset(s, 0, sizeof(*s));
+	s->kind = cfg->kind;
+	s->fd	= -1;
+	snprintf(s->name, sizeof(s->name), "%s", cfg->kind == SINK_SYSLOG ? "syslog" : cfg->path);
+	if ((s->q = logq_new(cfg->qlen > 0 ? cfg->qlen : SINK_QLEN, cfg->batch,
+		 cfg->has_policy ? cfg->policy : LOG_DROP)) == NULL)
+		return (-1);
+	atomic_init(&s->lost, 0);
+	nsinks++;
+	return (0);
+}
+
+/*
+ * (re)connect a socket sink, at most once every SINK_RETRY msecs
+ */
+static int
+sink_connect(struct sink *s)
+{
+	struct sockaddr_un sun;
+	long long	   now = sink_msecs();
+	int		   fd;
+
+	if (s->fd >= 0)
+		return (0);
+	if (now < s->retry)
+		return (-1);
+	s->retry = now + SINK_RETRY;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, s->name, strlen(s->name));
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return (-1);
+	}
+	s->fd = fd;
+	return (0);
+}
+
+/*
+ * Send a batch of records, one datagram each. The socket blocks under
+ * LOG_BLOCK so that a slow reader holds back this sink's queue; under
+ * LOG_DROP a busy reader gets SINK_WAIT msecs to make room, then the rest
+ * of the batch is lost. Records are lost as well while nobody listens on
+ * the path.
+ */
+static void
+sink_sendsock(struct sink *s, struct iovec *iov, int cnt)
+{
+	struct mmsghdr msgs[LOG_MAXBATCH];
+	struct pollfd  pfd;
+	int	       flags = s->q->policy == LOG_DROP ? MSG_DONTWAIT : 0;
+	int	       sent = 0, n;
+
+	memset(msgs, 0, cnt * sizeof(*msgs));
+	for (int i = 0; i < cnt; i++) {
+		msgs[i].msg_hdr.msg_iov	   = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < cnt && sink_connect(s) == 0) {
+		if ((n = sendmmsg(s->fd, msgs + sent, cnt - sent, flags)) >= 0) {
+			sent += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			pfd = (struct pollfd){ .fd = s->fd, .events = POLLOUT };
+			if (poll(&pfd, 1, SINK_WAIT) > 0)
+				continue;
+		} else {
+			/* the reader went away, find it again later */
+			close(s->fd);
+			s->fd = -1;
+		}
+		break;
+	}
+	atomic_fetch_add_explicit(&s->lost, cnt - sent, memory_order_relaxed);
+}
+
+static void
+sink_slog(struct sink *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	slog_vprintf(s->slog, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Hand a batch of records to syslog. The native sink (-S) waits a while
+ * for a busy daemon and counts its own drops; syslog(3) blocks.
+ */
+static void
+sink_sendlog(struct sink *s, struct iovec *iov, int cnt)
+{
+	for (int i = 0; i < cnt; i++) {
+		if (s->slog != NULL)
+			sink_slog(s, "%.*s", (int)iov[i].iov_len, (char *)iov[i].iov_base);
+		else
+			syslog(s->pri, "%.*s", (int)iov[i].iov_len, (char *)iov[i].iov_base);
+	}
+	if (s->slog != NULL)
+		slog_drain(s->slog);
+}
+
+/*
+ * Sender thread of a sink: drains its queue a batch at a time, skipping
+ * empty records, and sleeps while it is empty.
+ */
+static void *
+sink_sender(void *arg)
+{
+	struct sink *s = arg;
+	struct iovec iov[LOG_MAXBATCH];
+	int	     n, cnt;
+
+	if (s->slog != NULL)
+		slog_drain(s->slog);
+	while (1) {
+		if ((n = logq_peek(s->q, iov)) > 0) {
+			cnt = 0;
+			for (int i = 0; i < n; i++) {
+				if (iov[i].iov_len > 0)
+					iov[cnt++] = iov[i];
+			}
+			if (cnt > 0 && s->kind == SINK_SOCKET)
+				sink_sendsock(s, iov, cnt);
+			else if (cnt > 0)
+				sink_sendlog(s, iov, cnt);
+			logq_release(s->q, n);
+			continue;
+		}
+		if (!logq_running(s->q))
+			break;
+		logq_wait(s->q, 100);
+	}
+	return (NULL);
+}
+
+/*
+ * Start the sender threads, syslog sinks go through slog if not NULL or
+ * else syslog(3) with priority pri. Records are handed to the sinks from
+ * now on; text records sent to sockets get a newline.
+ */
+int
+sinks_start(struct slog *slog, int pri, bool text)
+{
+	struct sink *s;
+
+	for (int i = 0; i < nsinks; i++) {
+		s	   = &sinks[i];
+		s->slog	   = s->kind == SINK_SYSLOG ? slog : NULL;
+		s->pri	   = pri;
+		s->newline = text && s->kind == SINK_SOCKET;
+		if (s->kind == SINK_SOCKET)
+			sink_connect(s);
+		if ((errno = pthread_create(&s->q->consumer, NULL, sink_sender, s)) != 0)
+			return (-1);
+		nstarted++;
+	}
+	atomic_store(&nlive, nsinks);
+	return (0);
+}
+
+/*
+ * Format a record for every sink: fmt builds the one for sockets, text the
+ * line for syslog. Called within an epoch section, see sinks_stop().
+ */
+void
+sinks_emit(log_fmt_t fmt, log_fmt_t text, const void *arg)
+{
+	struct log_rec *rec;
+	struct sink *	s;
+	size_t		len;
+	int		n = atomic_load_explicit(&nlive, memory_order_acquire);
+
+	for (int i = 0; i < n; i++) {
+		s = &sinks[i];
+		if ((rec = logq_get(s->q)) == NULL)
+			continue;
+		len = (s->kind == SINK_SYSLOG ? text : fmt)(rec->data, LOG_RECSIZE - 1, arg);
+		if (len > 0 && s->newline)
+			rec->data[len++] = '\n';
+		rec->len = len;
+		logq_commit(s->q, rec);
+	}
+}
+
+/*
+ * Stop handing records to the sinks. Once no thread can still be inside
+ * sinks_emit() (see epoch_wait()), sinks_close() sends what is queued.
+ */
+void
+sinks_stop(void)
+{
+	atomic_store(&nlive, 0);
+}
+
+void
+sinks_close(void)
+{
+	struct sink *s;
+
+	for (int i = 0; i < nsinks; i++) {
+		s = &sinks[i];
+		logq_stop(s->q);
+		if (i < nstarted)
+			pthread_join(s->q->consumer, NULL);
+		if (s->fd >= 0)
+			close(s->fd);
+	}
+}
+
+/*
+ * append a sink label value to buf, with quotes and backslashes escaped
+ */
+static size_t
+sink_label(char *buf, size_t size, const char *name)
+{
+	size_t len = 0;
+
+	for (; *name != '\0' && len + 2 < size; name++) {
+		if (*name == '"' || *name == '\\')
+			buf[len++] = '\\';
+		buf[len++] = *name;
+	}
+	buf[len] = '\0';
+	return (len);
+}
+
+/*
+ * append to the metrics in buf, false once they do not fit any more
+ */
+static bool
+sink_printf(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int	n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= size - *len) {
+		buf[*len] = '\0';
+		return (false);
+	}
+	*len += n;
+	return (true);
+}
+
+/*
+ * Prometheus metrics of the log file (if it has a writer thread) and of
+ * every sink: records delivered and dropped, and how long records spend in
+ * the queue until they are written or sent. Returns the length written,
+ * which is less than size.
+ */
+size_t
+sinks_render(char *buf, size_t size, const log_t *file)
+{
+	struct logq_stats st;
+	char		  label[2 * MAXPATHLEN];
+	size_t		  len	= 0;
+	bool		  fits	= true;
+	bool		  logq	= file != NULL && file->queue != NULL;
+
+	if (size == 0 || (!logq && nsinks == 0))
+		return (0);
+	fits = sink_printf(buf, size, &len,
+	    "# HELP fsipd_sink_records_total Records taken off the queue of each output.\n"
+	    "# TYPE fsipd_sink_records_total counter\n"
+	    "# HELP fsipd_sink_dropped_total Records dropped by a full queue or a failed send.\n"
+	    "# TYPE fsipd_sink_dropped_total counter\n"
+	    "# HELP fsipd_sink_latency_seconds Time from queueing a record to writing or sending "
+	    "it.\n"
+	    "# TYPE fsipd_sink_latency_seconds histogram\n"
+	    "# HELP fsipd_sink_latency_max_seconds Longest time a record was queued.\n"
+	    "# TYPE fsipd_sink_latency_max_seconds gauge\n");
+
+	for (int i = logq ? -1 : 0; i < nsinks && fits; i++) {
+		if (i < 0) {
+			log_stats(file, &st);
+			sink_label(label, sizeof(label), "file");
+		} else {
+			logq_stats(sinks[i].q, &st);
+			st.drops += atomic_load_explicit(&sinks[i].lost, memory_order_relaxed);
+			sink_label(label, sizeof(label), sinks[i].name);
+		}
+		fits = sink_printf(buf, size, &len,
+		    "fsipd_sink_records_total{sink=\"%s\"} %llu\n"
+		    "fsipd_sink_dropped_total{sink=\"%s\"} %llu\n",
+		    label, (unsigned long long)st.done, label, (unsigned long long)st.drops);
+		for (int b = 0; b < LOGQ_LATBUCKETS - 1 && fits; b++)
+			fits = sink_printf(buf, size, &len,
+			    "fsipd_sink_latency_seconds_bucket{sink=\"%s\",le=\"%g\"} %llu\n",
+			    label, logq_latbounds[b] / 1e9, (unsigned long long)st.lat[b]);
+		if (fits)
+			fits = sink_printf(buf, size, &len,
+			    "fsipd_sink_latency_seconds_bucket{sink=\"%s\",le=\"+Inf\"} "
+			    "%llu\n"
+			    "fsipd_sink_latency_seconds_sum{sink=\"%s\"} %.9f\n"
+			    "fsipd_sink_latency_seconds_count{sink=\"%s\"} %llu\n"
+			    "fsipd_sink_latency_max_seconds{sink=\"%s\"} %.9f\n",
+			    label, (unsigned long long)st.lat[LOGQ_LATBUCKETS - 1],
+			    label, st.lat_sum / 1e9,
+			    label, (unsigned long long)st.lat[LOGQ_LATBUCKETS - 1],
+			    label, st.lat_max / 1e9);
+	}
+	return (len);
+}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <sys/param.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "logfile.h"
+
+#define SINK_MAX 8	 /* sinks besides the log file */
+#define SINK_QLEN 2048	 /* default records queued per sink */
+#define SINK_RETRY 1000	 /* msecs between attempts to reach a socket */
+#define SINK_WAIT  100	 /* msecs a dropping sink waits for a busy reader */
+#define SINK_RENDERMAX 16384 /* room for the metrics of every sink */
+
+enum sink_kind {
+	SINK_FILE,   /* the log file (-l), with the queue of its writer thread */
+	SINK_SYSLOG, /* syslog, through -S if given */
+	SINK_SOCKET  /* a local UNIX datagram socket, one record per datagram */
+};
+
+/* an output as given with -O sink[:qlen[:batch[:block|drop]]] */
+struct sink_cfg {
+	enum sink_kind	  kind;
+	char		  path[MAXPATHLEN]; /* SINK_SOCKET */
+	size_t		  qlen;	  /* 0: default */
+	unsigned int	  batch;  /* 0: LOG_BATCH */
+	enum log_overflow policy; /* if has_policy, else LOG_DROP (-o for the file) */
+	bool		  has_policy;
+};
+
+struct slog;
+
+int    sink_parse(const char *spec, struct sink_cfg *cfg);
+int    sink_add(const struct sink_cfg *cfg);
+int    sinks_start(struct slog *slog, int pri, bool text);
+void   sinks_emit(log_fmt_t fmt, log_fmt_t text, const void *arg);
+void   sinks_stop(void);
+void   sinks_close(void);
+size_t sinks_render(char *buf, size_t size, const log_t *file);
+
+#endif /* _SINK_H */
@@ -0,0 +1,245 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "banned.h"
+#include "scan.h"
+#include "sipparse.h"
+
+/*
+ * A small SIP parser for logging. It picks the start line and a few header
+ * fields out of a message without copying or modifying it and without
+ * relying on NUL termination. It is lenient: lines that are not proper
+ * headers are skipped, only a broken start line makes it fail. Lines may
+ * end in CRLF or a bare LF, folded header lines are kept in the value.
+ * Line ends, colons and whitespace are found with the scan_*() kernels.
+ */
+
+static const struct {
+	const char *name;  /* lower case */
+	size_t	    len;
+	char	    compact; /* compact form of RFC 3261 7.3.3, 0 if none */
+} hdrtab[SIP_NHDRS] = {
+	[SIP_VIA]    = { "via", 3, 'v' },
+	[SIP_FROM]   = { "from", 4, 'f' },
+	[SIP_TO]     = { "to", 2, 't' },
+	[SIP_CALLID] = { "call-id", 7, 'i' },
+	[SIP_CSEQ]   = { "cseq", 4, 0 },
+	[SIP_UA]     = { "user-agent", 10, 0 },
+	[SIP_CLEN]   = { "content-length", 14, 'l' },
+};
+
+static const char *hdrnames[SIP_NHDRS] = { "Via", "From", "To", "Call-ID", "CSeq", "User-Agent",
+	"Content-Length" };
+
+/*
+ * token characters of RFC 3261 25.1
+ */
+static inline bool
+is_token(unsigned char c)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+		return (true);
+	return (memchr("-.!%*_+`'~", c, 10) != NULL);
+}
+
+static inline void
+set_span(struct sip_span *sp, const char *buf, const char *start, const char *end)
+{
+	sp->off = start - buf;
+	sp->len = end - start;
+}
+
+/*
+ * Find the end of the line starting at p. Returns the position of its line
+ * terminator (or end) and stores the start of the next line in next. A CR
+ * only ends a line together with an LF.
+ */
+static const char *
+line_end(const char *p, const char *end, const char **next)
+{
+	const char *q = p;
+
+	while ((q += scan_eol(q, end - q)) < end) {
+		if (*q == '\n') {
+			*next = q + 1;
+			return (q);
+		}
+		if (q + 1 < end && q[1] == '\n') {
+			*next = q + 2;
+			return (q);
+		}
+		q++;
+	}
+	*next = end;
+	return (end > p && end[-1] == '\r' ? end - 1 : end);
+}
+
+/*
+ * compare p with a lower case name, as p holds no CR setting 0x20 only
+ * folds letters
+ */
+static inline bool
+name_eq(const char *p, const char *name, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if ((p[i] | 0x20) != name[i])
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * which of the interesting headers the token p[0..len) names, -1 if none
+ */
+static int
+hdr_lookup(const char *p, size_t len)
+{
+	for (int i = 0; i < SIP_NHDRS; i++) {
+		if (len == 1 && hdrtab[i].compact != 0 && (p[0] | 0x20) == hdrtab[i].compact)
+			return (i);
+		if (len == hdrtab[i].len && name_eq(p, hdrtab[i].name, len))
+			return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Request-Line or Status-Line
+ */
+static int
+parse_start(const char *buf, const char *p, const char *eol, struct sip_msg *msg)
+{
+	const char *s;
+	int	    status = 0;
+
+	if (eol - p > 4 && memcmp(p, "SIP/", 4) == 0) {
+		for (p += 4; p < eol && *p != ' '; p++)
+			;
+		if (eol - p < 4 || p[0] != ' ' || (eol - p > 4 && p[4] != ' '))
+			return (-1);
+		for (int i = 1; i <= 3; i++) {
+			if (p[i] < '0' || p[i] > '9')
+				return (-1);
+			status = status * 10 + p[i] - '0';
+		}
+		msg->status = status;
+		return (0);
+	}
+
+	for (s = p; p < eol && is_token(*p); p++)
+		;
+	if (p == s || p == eol || *p != ' ')
+		return (-1);
+	set_span(&msg->method, buf, s, p);
+
+	for (s = ++p; p < eol && *p != ' '; p++)
+		;
+	if (p == s || eol - p < 5 || memcmp(p, " SIP/", 5) != 0)
+		return (-1);
+	set_span(&msg->uri, buf, s, p);
+
+	return (0);
+}
+
+/*
+ * a header line, possibly folded over several lines ending at eol
+ */
+static void
+parse_header(const char *buf, const char *p, const char *eol, struct sip_msg *msg,
+    unsigned int *seen)
+{
+	const char *s, *n;
+	long	    clen;
+	int	    idx;
+
+	s = p;
+	p += scan_hdrdelim(p, eol - p);
+	if (p == eol || *p != ':')
+		return;
+	for (n = p; n > s && (n[-1] == ' ' || n[-1] == '\t'); n--)
+		;
+	if ((idx = hdr_lookup(s, n - s)) == -1 || (*seen & (1u << idx)))
+		return;
+
+	p++;
+	p += scan_lspace(p, eol - p);
+	eol = p + scan_rspace(p, eol - p);
+	set_span(&msg->hdr[idx], buf, p, eol);
+	*seen |= 1u << idx;
+
+	if (idx != SIP_CLEN)
+		return;
+	for (clen = 0; p < eol && *p >= '0' && *p <= '9' && clen < 100000000; p++)
+		clen = clen * 10 + *p - '0';
+	msg->content_length = p == eol && eol > buf + msg->hdr[idx].off ? clen : -1;
+}
+
+/*
+ * Parse the SIP message in buf[0..len). Returns 0 if it starts with a
+ * valid Request-Line or Status-Line, -1 otherwise. Headers are parsed up
+ * to the empty line or the end of the buffer, so a truncated message still
+ * yields the fields that made it in.
+ */
+int
+sip_parse(const char *buf, size_t len, struct sip_msg *msg)
+{
+	const char * end = buf + len;
+	const char * p, *eol, *next;
+	unsigned int seen = 0;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->content_length = -1;
+
+	eol = line_end(buf, end, &next);
+	if (parse_start(buf, buf, eol, msg) == -1)
+		return (-1);
+
+	for (p = next; p < end; p = next) {
+		if (*p == '\r' || *p == '\n') {
+			line_end(p, end, &next);
+			msg->hdrlen = next - buf;
+			break;
+		}
+		eol = line_end(p, end, &next);
+		while (next < end && (*next == ' ' || *next == '\t'))
+			eol = line_end(next, end, &next);
+		parse_header(buf, p, eol, msg, &seen);
+	}
+
+	return (0);
+}
+
+/*
+ * canonical name of a header field
+ */
+const char *
+sip_hdrname(enum sip_hdr hdr)
+{
+	return (hdrnames[hdr]);
+}
@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIPPARSE_H
+#define _SIPPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * part of the parsed message, as an offset into the receive buffer
+ */
+struct sip_span {
+	uint32_t off;
+	uint32_t len;
+};
+
+/* header fields picked out of a message, first occurrence wins */
+enum sip_hdr {
+	SIP_VIA,
+	SIP_FROM,
+	SIP_TO,
+	SIP_CALLID,
+	SIP_CSEQ,
+	SIP_UA,
+	SIP_CLEN,
+	SIP_NHDRS
+};
+
+/*
+ * A parsed SIP message. Nothing is copied, the spans point into the buffer
+ * that was parsed and are only valid as long as it is. Fields that are not
+ * present have a zero length.
+ */
+struct sip_msg {
+	struct sip_span	method;         /* request method, empty for responses */
+	struct sip_span	uri;            /* Request-URI, empty for responses */
+	int		status;         /* response status code, 0 for requests */
+	struct sip_span	hdr[SIP_NHDRS]; /* header values without surrounding LWS */
+	long		content_length; /* -1 if missing or invalid */
+	size_t		hdrlen;         /* bytes up to the empty line, 0 if not seen */
+};
+
+int	    sip_parse(const char *buf, size_t len, struct sip_msg *msg);
+const char *sip_hdrname(enum sip_hdr hdr);
+
+#endif /* _SIPPARSE_H */
@@ -0,0 +1,153 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "sipparse.h"
+
+/*
+ * Throughput of sip_parse() in messages per second on a few typical
+ * messages, from a scanner's OPTIONS probe to a full INVITE with SDP.
+ */
+
+static const struct {
+	const char *name;
+	const char *msg;
+} samples[] = {
+	{ "OPTIONS", "OPTIONS sip:100@192.0.2.1 SIP/2.0\r\n"
+		     "Via: SIP/2.0/UDP 198.51.100.7:5071;branch=z9hG4bK-2553131048;rport\r\n"
+		     "Content-Length: 0\r\n"
+		     "From: \"sipvicious\"<sip:100@1.1.1.1>;tag=6434396633623535\r\n"
+		     "Accept: application/sdp\r\n"
+		     "User-Agent: friendly-scanner\r\n"
+		     "To: \"sipvicious\"<sip:100@1.1.1.1>\r\n"
+		     "Contact: sip:100@198.51.100.7:5071\r\n"
+		     "CSeq: 1 OPTIONS\r\n"
+		     "Call-ID: 843412393958129447391421\r\n"
+		     "Max-Forwards: 70\r\n"
+		     "\r\n" },
+	{ "REGISTER", "REGISTER sip:registrar.example.com SIP/2.0\r\n"
+		      "v: SIP/2.0/UDP 192.0.2.4:5060;branch=z9hG4bKnashds7\r\n"
+		      "Max-Forwards: 70\r\n"
+		      "t: Bob <sip:bob@example.com>\r\n"
+		      "f: Bob <sip:bob@example.com>;tag=456248\r\n"
+		      "i: 843817637684230@998sdasdh09\r\n"
+		      "CSeq: 1826 REGISTER\r\n"
+		      "m: <sip:bob@192.0.2.4>\r\n"
+		      "Expires: 7200\r\n"
+		      "l: 0\r\n"
+		      "\r\n" },
+	{ "INVITE", "INVITE sip:bob@biloxi.example.com SIP/2.0\r\n"
+		    "Via: SIP/2.0/TCP client.atlanta.example.com:5060;branch=z9hG4bK74bf9\r\n"
+		    "Max-Forwards: 70\r\n"
+		    "From: Alice <sip:alice@atlanta.example.com>;tag=9fxced76sl\r\n"
+		    "To: Bob <sip:bob@biloxi.example.com>\r\n"
+		    "Call-ID: 3848276298220188511@atlanta.example.com\r\n"
+		    "CSeq: 1 INVITE\r\n"
+		    "Contact: <sip:alice@client.atlanta.example.com;transport=tcp>\r\n"
+		    "Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, NOTIFY, MESSAGE\r\n"
+		    "Supported: replaces, timer\r\n"
+		    "User-Agent: SomePhone/4.2.1 (build 1043)\r\n"
+		    "Content-Type: application/sdp\r\n"
+		    "Content-Length: 151\r\n"
+		    "\r\n"
+		    "v=0\r\n"
+		    "o=alice 2890844526 2890844526 IN IP4 client.atlanta.example.com\r\n"
+		    "s=-\r\n"
+		    "c=IN IP4 192.0.2.101\r\n"
+		    "t=0 0\r\n"
+		    "m=audio 49172 RTP/AVP 0\r\n"
+		    "a=rtpmap:0 PCMU/8000\r\n" },
+	{ "200 OK", "SIP/2.0 200 OK\r\n"
+		    "Via: SIP/2.0/UDP server10.biloxi.example.com;branch=z9hG4bKnashds8\r\n"
+		    "To: Bob <sip:bob@biloxi.example.com>;tag=a6c85cf\r\n"
+		    "From: Alice <sip:alice@atlanta.example.com>;tag=1928301774\r\n"
+		    "Call-ID: a84b4c76e66710\r\n"
+		    "CSeq: 63104 OPTIONS\r\n"
+		    "Content-Length: 0\r\n"
+		    "\r\n" },
+};
+
+static volatile size_t sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sip_msg msg;
+	long	       iters = 1000000;
+	double	       start, ns;
+	size_t	       len;
+	int	       opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: sipparse_bench [-n iterations]\n");
+			exit(EX_USAGE);
+		}
+	}
+
+	scan_init();
+	printf("scan kernels: %s\n", scan_name());
+	printf("%-10s %6s %10s %14s %10s\n", "message", "bytes", "ns/msg", "msgs/sec", "MB/s");
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		len = strlen(samples[i].msg);
+		if (sip_parse(samples[i].msg, len, &msg) != 0 || msg.hdrlen == 0)
+			errx(EX_SOFTWARE, "%s: sample does not parse", samples[i].name);
+
+		start = now();
+		for (long n = 0; n < iters; n++) {
+			sip_parse(samples[i].msg, len, &msg);
+			sink += msg.hdr[SIP_CALLID].len;
+		}
+		ns = (now() - start) / iters;
+		printf("%-10s %6zu %10.1f %14.0f %10.1f\n", samples[i].name, len, ns, 1e9 / ns,
+		    len * 1e3 / ns);
+	}
+
+	return (0);
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "scan.h"
+#include "sipparse.h"
+
+/*
+ * Corpus test of the SIP parser: check the fields of a set of messages,
+ * then feed it every truncation and lots of random mutations of them and
+ * make sure it stays within the buffer. Inputs are copied into buffers of
+ * their exact size, so an overread shows up under valgrind or ASan. Every
+ * input is parsed with each scan kernel flavour the CPU supports, which
+ * all have to agree.
+ */
+
+#define MUTATIONS 200000
+
+struct testcase {
+	const char *msg;
+	int	    ret;
+	const char *method;
+	const char *uri;
+	int	    status;
+	const char *hdr[SIP_NHDRS]; /* Via, From, To, Call-ID, CSeq, User-Agent, Content-Length */
+	long	    clen;
+	bool	    complete;
+};
+
+static const struct testcase corpus[] = {
+	{ "INVITE sip:bob@biloxi.example.com SIP/2.0\r\n"
+	  "Via: SIP/2.0/UDP pc33.atlanta.example.com;branch=z9hG4bK776asdhds\r\n"
+	  "Max-Forwards: 70\r\n"
+	  "To: Bob <sip:bob@biloxi.example.com>\r\n"
+	  "From: Alice <sip:alice@atlanta.example.com>;tag=1928301774\r\n"
+	  "Call-ID: a84b4c76e66710@pc33.atlanta.example.com\r\n"
+	  "CSeq: 314159 INVITE\r\n"
+	  "User-Agent: friendly-scanner\r\n"
+	  "Content-Type: application/sdp\r\n"
+	  "Content-Length: 4\r\n"
+	  "\r\n"
+	  "v=0\n",
+	    0, "INVITE", "sip:bob@biloxi.example.com", 0,
+	    { "SIP/2.0/UDP pc33.atlanta.example.com;branch=z9hG4bK776asdhds",
+		"Alice <sip:alice@atlanta.example.com>;tag=1928301774",
+		"Bob <sip:bob@biloxi.example.com>", "a84b4c76e66710@pc33.atlanta.example.com",
+		"314159 INVITE", "friendly-scanner", "4" },
+	    4, true },
+	/* compact forms, bare LF, odd case, two Via headers */
+	{ "REGISTER sip:registrar.example.com SIP/2.0\n"
+	  "v: SIP/2.0/UDP 192.0.2.4:5060;branch=z9hG4bKnashds7\n"
+	  "VIA: SIP/2.0/UDP 192.0.2.5\n"
+	  "t: <sip:100@registrar.example.com>\n"
+	  "f:<sip:100@registrar.example.com>;tag=a73kszlfl\n"
+	  "i: 1j9FpLxk3uxtm8tn@192.0.2.4\n"
+	  "cseq: 1 REGISTER\n"
+	  "l: 0\n"
+	  "\n",
+	    0, "REGISTER", "sip:registrar.example.com", 0,
+	    { "SIP/2.0/UDP 192.0.2.4:5060;branch=z9hG4bKnashds7",
+		"<sip:100@registrar.example.com>;tag=a73kszlfl", "<sip:100@registrar.example.com>",
+		"1j9FpLxk3uxtm8tn@192.0.2.4", "1 REGISTER", NULL, "0" },
+	    0, true },
+	{ "SIP/2.0 200 OK\r\n"
+	  "Via: SIP/2.0/UDP server10.biloxi.example.com;branch=z9hG4bKnashds8\r\n"
+	  "Call-ID: a84b4c76e66710\r\n"
+	  "CSeq: 1 OPTIONS\r\n"
+	  "Content-Length:   42  \r\n"
+	  "\r\n",
+	    0, NULL, NULL, 200,
+	    { "SIP/2.0/UDP server10.biloxi.example.com;branch=z9hG4bKnashds8", NULL, NULL,
+		"a84b4c76e66710", "1 OPTIONS", NULL, "42" },
+	    42, true },
+	/* folded header, invalid Content-Length, no empty line */
+	{ "OPTIONS sip:100@192.0.2.1 SIP/2.0\r\n"
+	  "From: \"sipvicious\"\r\n"
+	  " <sip:100@1.1.1.1>;tag=6434396633623535\r\n"
+	  "Content-Length: 12a\r\n"
+	  "User-Agent : sipcli/v1.8\r\n",
+	    0, "OPTIONS", "sip:100@192.0.2.1", 0,
+	    { NULL, "\"sipvicious\"\r\n <sip:100@1.1.1.1>;tag=6434396633623535", NULL, NULL, NULL,
+		"sipcli/v1.8", "12a" },
+	    -1, false },
+	/* what the old code logged as the whole message */
+	{ "OPTIONS sip:x SIP/2.0", 0, "OPTIONS", "sip:x", 0, { NULL }, -1, false },
+	{ "SIP/2.0 100\r\n\r\n", 0, NULL, NULL, 100, { NULL }, -1, true },
+	{ "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n", -1, NULL, NULL, 0, { NULL }, -1, false },
+	{ "\r\n\r\n", -1, NULL, NULL, 0, { NULL }, -1, false },
+	{ "", -1, NULL, NULL, 0, { NULL }, -1, false },
+	{ "SIP/2.0 20 OK\r\n", -1, NULL, NULL, 0, { NULL }, -1, false },
+	{ "INVITE  sip:x SIP/2.0\r\n", -1, NULL, NULL, 0, { NULL }, -1, false },
+	{ "INV\x01TE sip:x SIP/2.0\r\n", -1, NULL, NULL, 0, { NULL }, -1, false },
+};
+
+#define NCORPUS (sizeof(corpus) / sizeof(corpus[0]))
+
+static const char *flavours[] = { "scalar", "sse2", "avx2" };
+static const char *usable[3];
+static int	   nusable;
+
+static void
+check_span(const char *name, const char *buf, struct sip_span sp, const char *want)
+{
+	size_t wlen = want == NULL ? 0 : strlen(want);
+
+	if (sp.len != wlen || (wlen > 0 && memcmp(buf + sp.off, want, wlen) != 0))
+		errx(EX_SOFTWARE, "%s: got \"%.*s\", want \"%s\"", name, (int)sp.len, buf + sp.off,
+		    want == NULL ? "" : want);
+}
+
+static void
+check_case(const struct testcase *tc)
+{
+	struct sip_msg msg;
+	size_t	       len = strlen(tc->msg);
+	int	       ret;
+
+	ret = sip_parse(tc->msg, len, &msg);
+	if (ret != tc->ret)
+		errx(EX_SOFTWARE, "\"%.20s\": sip_parse() returned %d, want %d", tc->msg, ret,
+		    tc->ret);
+	if (ret == -1)
+		return;
+
+	check_span("method", tc->msg, msg.method, tc->method);
+	check_span("uri", tc->msg, msg.uri, tc->uri);
+	for (int i = 0; i < SIP_NHDRS; i++)
+		check_span(sip_hdrname(i), tc->msg, msg.hdr[i], tc->hdr[i]);
+	if (msg.status != tc->status)
+		errx(EX_SOFTWARE, "status: got %d, want %d", msg.status, tc->status);
+	if (msg.content_length != tc->clen)
+		errx(EX_SOFTWARE, "content length: got %ld, want %ld", msg.content_length,
+		    tc->clen);
+	if ((msg.hdrlen != 0) != tc->complete ||
+	    (msg.hdrlen != 0 && tc->msg[msg.hdrlen - 1] != '\n'))
+		errx(EX_SOFTWARE, "\"%.20s\": header length %zu", tc->msg, msg.hdrlen);
+}
+
+/*
+ * parse len bytes of data from an exactly sized copy and check that every
+ * span lies within it
+ */
+static void
+parse_bounded(const char *data, size_t len)
+{
+	struct sip_msg msg[3];
+	char *	       buf;
+	int	       ret[3] = { -1, -1, -1 };
+
+	if ((buf = malloc(len > 0 ? len : 1)) == NULL)
+		err(EX_OSERR, "malloc");
+	memcpy(buf, data, len);
+
+	for (int k = 0; k < nusable; k++) {
+		scan_select(usable[k]);
+		ret[k] = sip_parse(buf, len, &msg[k]);
+		if (ret[k] != ret[0] || memcmp(&msg[k], &msg[0], sizeof(msg[0])) != 0)
+			errx(EX_SOFTWARE, "%s and %s disagree on \"%.*s\"", usable[0], usable[k],
+			    (int)len, buf);
+	}
+
+	if (ret[0] == 0) {
+		if (msg[0].method.off + msg[0].method.len > len ||
+		    msg[0].uri.off + msg[0].uri.len > len || msg[0].hdrlen > len)
+			errx(EX_SOFTWARE, "start line out of bounds");
+		for (int i = 0; i < SIP_NHDRS; i++) {
+			if (msg[0].hdr[i].off + msg[0].hdr[i].len > len)
+				errx(EX_SOFTWARE, "%s out of bounds", sip_hdrname(i));
+		}
+		if (msg[0].status < 0 || msg[0].status > 999)
+			errx(EX_SOFTWARE, "bogus status %d", msg[0].status);
+	}
+	free(buf);
+}
+
+/*
+ * flip, overwrite, insert or delete a few bytes, or splice in a bit of
+ * another message
+ */
+static size_t
+mutate(char *buf, size_t len, size_t size)
+{
+	static const char interesting[] = "\r\n :\t\0SIP/2.0";
+	const char *	  other;
+	size_t		  pos, n;
+
+	for (int k = 1 + random() % 4; k > 0; k--) {
+		pos = len > 0 ? random() % len : 0;
+		switch (random() % 6) {
+		case 0:
+			if (len > 0)
+				buf[pos] ^= 1 << (random() % 8);
+			break;
+		case 1:
+			if (len > 0)
+				buf[pos] = interesting[random() % (sizeof(interesting) - 1)];
+			break;
+		case 2:
+			if (len < size) {
+				memmove(buf + pos + 1, buf + pos, len - pos);
+				buf[pos] = interesting[random() % (sizeof(interesting) - 1)];
+				len++;
+			}
+			break;
+		case 3:
+			if (len > 0) {
+				n = 1 + random() % (len - pos);
+				memmove(buf + pos, buf + pos + n, len - pos - n);
+				len -= n;
+			}
+			break;
+		case 4:
+			len = pos;
+			break;
+		default:
+			other = corpus[random() % NCORPUS].msg;
+			n     = strlen(other);
+			n     = n > 0 ? random() % n : 0;
+			if (n > size - pos)
+				n = size - pos;
+			memcpy(buf + pos, other, n);
+			if (pos + n > len)
+				len = pos + n;
+			break;
+		}
+	}
+	return (len);
+}
+
+int
+main(void)
+{
+	char   buf[4096];
+	size_t len;
+
+	for (size_t k = 0; k < sizeof(flavours) / sizeof(flavours[0]); k++) {
+		if (scan_select(flavours[k]) == -1)
+			continue;
+		usable[nusable++] = flavours[k];
+		for (size_t i = 0; i < NCORPUS; i++)
+			check_case(&corpus[i]);
+		printf("sipparse: %zu corpus messages parsed as expected (%s)\n", NCORPUS,
+		    flavours[k]);
+	}
+
+	for (size_t i = 0; i < NCORPUS; i++) {
+		len = strlen(corpus[i].msg);
+		for (size_t n = 0; n <= len; n++)
+			parse_bounded(corpus[i].msg, n);
+	}
+
+	srandom(5060);
+	for (int i = 0; i < MUTATIONS; i++) {
+		len = strlen(corpus[i % NCORPUS].msg);
+		memcpy(buf, corpus[i % NCORPUS].msg, len);
+		len = mutate(buf, len, sizeof(buf));
+		parse_bounded(buf, len);
+	}
+	printf("sipparse: %d mutated messages stayed in bounds, %d flavours agree\n", MUTATIONS,
+	    nusable);
+
+	return (0);
+}
@@ -0,0 +1,290 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "metrics.h"
+#include "slog.h"
+
+/*
+ * Native syslog sink: RFC 5424 messages sent to a UNIX datagram socket or
+ * a UDP port. Every thread collects its messages in a batch of its own
+ * and sends them with one sendmmsg(), which its owner triggers once it is
+ * done with what it received (or when the batch is full). The socket never
+ * blocks: whatever does not fit into the socket buffer is dropped and
+ * counted, so a slow syslog daemon cannot stall the listeners. The socket
+ * is not connected, so a restarted daemon is found again at its address.
+ */
+
+struct slog {
+	int			fd;
+	int			pri;
+	struct sockaddr_storage addr;
+	socklen_t		addrlen;
+	char			host[256];
+};
+
+/* messages of one thread waiting to be sent */
+struct slog_batch {
+	unsigned int   n;
+	int	       pid;
+	int	       wait;	  /* msecs a send waits for the socket, see slog_drain() */
+	time_t	       sec;	  /* second of the cached timestamp */
+	char	       stamp[32]; /* YYYY-MM-DDThh:mm:ss */
+	struct mmsghdr msgs[SLOG_BATCH];
+	struct iovec   iov[SLOG_BATCH];
+	char	       bufs[SLOG_BATCH][SLOG_MSGMAX];
+};
+
+static _Thread_local struct slog_batch *slog_tls;
+
+static void slog_send(struct slog *s, int wait);
+
+/*
+ * resolve host[:port], [v6addr][:port] or a bare IPv6 address
+ */
+static int
+slog_resolve(struct slog *s, const char *dest)
+{
+	struct addrinfo hints, *res;
+	char		host[256];
+	const char *	port = SLOG_PORT, *colon;
+	size_t		len;
+	int		error;
+
+	if (*dest == '[') {
+		if ((colon = strchr(dest, ']')) == NULL)
+			return (-1);
+		len = colon - dest - 1;
+		dest++;
+		if (colon[1] == ':')
+			port = colon + 2;
+	} else if ((colon = strchr(dest, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+		len  = colon - dest;
+		port = colon + 1;
+	} else {
+		len = strlen(dest);
+	}
+	if (len >= sizeof(host))
+		return (-1);
+	memcpy(host, dest, len);
+	host[len] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family	  = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+		errno = error == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+		return (-1);
+	}
+	memcpy(&s->addr, res->ai_addr, res->ai_addrlen);
+	s->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return (0);
+}
+
+/*
+ * Open a sink for messages of priority pri to dest, the path of a UNIX
+ * datagram socket if it contains a slash, or else host[:port] for UDP.
+ * Returns NULL and sets errno on failure.
+ */
+struct slog *
+slog_open(const char *dest, int pri)
+{
+	struct sockaddr_un *sun;
+	struct slog *	    s;
+	int		    sndbuf = SLOG_SNDBUF;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return (NULL);
+	s->pri = pri;
+	if (gethostname(s->host, sizeof(s->host) - 1) < 0 || *s->host == '\0')
+		memcpy(s->host, "-", 2);
+
+	if (strchr(dest, '/') != NULL) {
+		sun = (struct sockaddr_un *)&s->addr;
+		if (strlen(dest) >= sizeof(sun->sun_path)) {
+			free(s);
+			errno = ENAMETOOLONG;
+			return (NULL);
+		}
+		sun->sun_family = AF_UNIX;
+		memcpy(sun->sun_path, dest, strlen(dest) + 1);
+		s->addrlen = sizeof(*sun);
+	} else if (slog_resolve(s, dest) < 0) {
+		free(s);
+		return (NULL);
+	}
+
+	if ((s->fd = socket(s->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		free(s);
+		return (NULL);
+	}
+	/* absorb bursts, the default is only a couple of hundred messages */
+	setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	return (s);
+}
+
+/*
+ * batch of the calling thread, NULL if it cannot be allocated
+ */
+static struct slog_batch *
+slog_batch(void)
+{
+	struct slog_batch *b;
+
+	if ((b = slog_tls) != NULL)
+		return (b);
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return (NULL);
+	b->pid = getpid();
+	b->sec = -1;
+	for (int i = 0; i < SLOG_BATCH; i++) {
+		b->iov[i].iov_base		= b->bufs[i];
+		b->msgs[i].msg_hdr.msg_iov	= &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen	= 1;
+	}
+	return (slog_tls = b);
+}
+
+/*
+ * Queue a message for sending. The timestamp is formatted once a second,
+ * only the microseconds change in between.
+ */
+void
+slog_vprintf(struct slog *s, const char *fmt, va_list ap)
+{
+	struct slog_batch *b;
+	struct timespec	   ts;
+	struct tm	   tm;
+	char *		   buf;
+	int		   len, n;
+
+	if ((b = slog_batch()) == NULL) {
+		metric_add(M_SYSLOG_DROPPED, 1);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (ts.tv_sec != b->sec) {
+		gmtime_r(&ts.tv_sec, &tm);
+		strftime(b->stamp, sizeof(b->stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+		b->sec = ts.tv_sec;
+	}
+
+	buf = b->bufs[b->n];
+	len = snprintf(buf, SLOG_MSGMAX, "<%d>1 %s.%06ldZ %s fsipd %d - - ", s->pri, b->stamp,
+	    ts.tv_nsec / 1000, s->host, b->pid);
+	if (len < SLOG_MSGMAX && (n = vsnprintf(buf + len, SLOG_MSGMAX - len, fmt, ap)) > 0)
+		len += n;
+	if (len >= SLOG_MSGMAX)
+		len = SLOG_MSGMAX - 1;
+	b->iov[b->n++].iov_len = len;
+
+	if (b->n == SLOG_BATCH)
+		slog_send(s, b->wait);
+}
+
+/*
+ * Send the batch of the calling thread. Messages the socket cannot take
+ * within wait msecs are dropped.
+ */
+static void
+slog_send(struct slog *s, int wait)
+{
+	struct timespec	   pause = { 0, 1000000 };
+	struct slog_batch *b	 = slog_tls;
+	unsigned int	   sent	 = 0;
+	int		   n;
+
+	if (b == NULL || b->n == 0)
+		return;
+
+	for (unsigned int i = 0; i < b->n; i++) {
+		b->msgs[i].msg_hdr.msg_name    = &s->addr;
+		b->msgs[i].msg_hdr.msg_namelen = s->addrlen;
+	}
+	while (sent < b->n) {
+		if ((n = sendmmsg(s->fd, b->msgs + sent, b->n - sent, MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait-- > 0) {
+				nanosleep(&pause, NULL);
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				metric_add(M_SYSLOG_ERRORS, 1);
+			break;
+		}
+		metric_add(M_SYSLOG_BATCHES, 1);
+		sent += n;
+	}
+	metric_add(M_SYSLOG_MESSAGES, sent);
+	metric_add(M_SYSLOG_DROPPED, b->n - sent);
+	b->n = 0;
+}
+
+/* send right away, blocks only after slog_drain() in the calling thread */
+void
+slog_flush(struct slog *s)
+{
+	struct slog_batch *b = slog_tls;
+
+	slog_send(s, b != NULL ? b->wait : 0);
+}
+
+/*
+ * Send, waiting up to SLOG_WAIT msecs for a daemon that falls behind, and
+ * from now on wait as long whenever the calling thread fills or flushes
+ * its batch. For threads that may block, such as the sender of a syslog
+ * sink (-O) or the one shutting fsipd down.
+ */
+void
+slog_drain(struct slog *s)
+{
+	struct slog_batch *b;
+
+	if ((b = slog_batch()) != NULL)
+		b->wait = SLOG_WAIT;
+	slog_send(s, SLOG_WAIT);
+}
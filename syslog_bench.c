@@ -0,0 +1,231 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Stand-in syslog daemon for benchmarking the native syslog sink (fsipd
+ * -S): receive datagrams on a UNIX socket or a loopback UDP port with
+ * recvmmsg(), check that they look like RFC 5424 messages and report the
+ * rate every second. Stops once nothing arrived for a while after the
+ * first message, or on SIGINT.
+ */
+
+#define BUFSIZE 2048
+#define BATCH 64
+#define RCVBUF (8 << 20)
+
+static volatile sig_atomic_t stop;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/*
+ * "<PRI>1 " with PRI of at most three digits
+ */
+static bool
+rfc5424(const char *msg, size_t len)
+{
+	size_t i = 1;
+
+	if (len < 5 || msg[0] != '<')
+		return (false);
+	while (i < len && i < 4 && isdigit((unsigned char)msg[i]))
+		i++;
+	return (i > 1 && i + 2 < len && msg[i] == '>' && msg[i + 1] == '1' && msg[i + 2] == ' ');
+}
+
+/*
+ * bind a datagram socket to a UNIX socket path or a loopback UDP port
+ */
+static int
+listen_on(const char *dest)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *  sa;
+	socklen_t	   salen;
+	int		   fd, rcvbuf = RCVBUF;
+	char *		   end;
+	long		   port;
+
+	if (strchr(dest, '/') != NULL) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(dest) >= sizeof(sun.sun_path))
+			errx(EX_USAGE, "socket path too long: %s", dest);
+		memcpy(sun.sun_path, dest, strlen(dest));
+		unlink(dest);
+		sa    = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	} else {
+		port = strtol(dest, &end, 10);
+		if (*end != '\0' || port < 1 || port > 65535)
+			errx(EX_USAGE, "not a socket path or port: %s", dest);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family	    = AF_INET;
+		sin.sin_port	    = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa		    = (struct sockaddr *)&sin;
+		salen		    = sizeof(sin);
+	}
+
+	if ((fd = socket(sa->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		err(EX_OSERR, "socket");
+	/* the maximum is capped by net.core.rmem_max, best effort */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval) { 0, 100000 },
+	    sizeof(struct timeval));
+	if (bind(fd, sa, salen) < 0)
+		err(EX_OSERR, "bind %s", dest);
+
+	return (fd);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: syslog_bench [-i seconds] [-b batch] [-q] path|port\n"
+	    "\t-i: stop after this many idle seconds following the first message (default: 2)\n"
+	    "\t-b: datagrams received per recvmmsg() (default: %d)\n"
+	    "\t-q: only print the totals\n",
+	    BATCH);
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char    bufs[BATCH][BUFSIZE];
+	struct mmsghdr msgs[BATCH];
+	struct iovec   iov[BATCH];
+	unsigned long  total = 0, bytes = 0, malformed = 0, tick = 0;
+	double	       idle = 2, first = 0, last = 0, mark, t;
+	bool	       quiet = false;
+	int	       batch = BATCH, fd, n, opt;
+
+	while ((opt = getopt(argc, argv, "i:b:qh")) != -1) {
+		switch (opt) {
+		case 'i':
+			idle = atof(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > BATCH)
+				errx(EX_USAGE, "batch must be between 1 and %d", BATCH);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 || idle <= 0)
+		usage();
+
+	fd = listen_on(argv[optind]);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < batch; i++) {
+		iov[i].iov_base		   = bufs[i];
+		iov[i].iov_len		   = BUFSIZE;
+		msgs[i].msg_hdr.msg_iov	   = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	mark = now();
+	while (!stop) {
+		n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, NULL);
+		t = now();
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			err(EX_OSERR, "recvmmsg");
+		if (n > 0) {
+			if (total == 0)
+				first = t;
+			last = t;
+			total += n;
+			for (int i = 0; i < n; i++) {
+				bytes += msgs[i].msg_len;
+				if (!rfc5424(bufs[i], msgs[i].msg_len))
+					malformed++;
+			}
+		}
+		if (total > 0 && t - last >= idle)
+			break;
+		if (t - mark >= 1) {
+			if (!quiet && total > tick)
+				printf("%12.0f msg/s\n", (total - tick) / (t - mark));
+			tick = total;
+			mark = t;
+		}
+	}
+
+	if (strchr(argv[optind], '/') != NULL)
+		unlink(argv[optind]);
+	printf("received %lu messages (%lu bytes, %lu malformed)", total, bytes, malformed);
+	if (last > first)
+		printf(", %.0f msg/s", total / (last - first));
+	printf("\n");
+
+	return (0);
+}
@@ -0,0 +1,209 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Measure loopback UDP receive rate of a plain recvfrom() loop against
+ * batched recvmmsg() with several batch sizes. A sender thread floods the
+ * socket with sendmmsg() while the receiver counts datagrams for a fixed
+ * amount of time.
+ */
+
+#define BUFSIZE 8192
+#define SEND_BATCH 64
+#define MAXBATCH 1024
+
+static const char payload[] = "OPTIONS sip:100@127.0.0.1 SIP/2.0\r\n"
+			      "Via: SIP/2.0/UDP 127.0.0.1:5061;branch=z9hG4bK-1234567890\r\n"
+			      "From: \"sipvicious\"<sip:100@1.1.1.1>;tag=6434396633623535\r\n"
+			      "To: \"sipvicious\"<sip:100@1.1.1.1>\r\n"
+			      "Call-ID: 1234567890123456789012\r\n"
+			      "CSeq: 1 OPTIONS\r\n"
+			      "Max-Forwards: 70\r\n"
+			      "User-Agent: friendly-scanner\r\n"
+			      "Accept: application/sdp\r\n"
+			      "Content-Length: 0\r\n\r\n";
+
+static atomic_bool	  stop;
+static struct sockaddr_in dst;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void *
+sender(void *args)
+{
+	struct mmsghdr msgs[SEND_BATCH];
+	struct iovec   iov;
+	int	       fd;
+
+	if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+		err(EX_OSERR, "socket()");
+	if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+		err(EX_OSERR, "connect()");
+
+	iov.iov_base = (void *)payload;
+	iov.iov_len  = sizeof(payload) - 1;
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < SEND_BATCH; i++) {
+		msgs[i].msg_hdr.msg_iov	   = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!atomic_load(&stop))
+		sendmmsg(fd, msgs, SEND_BATCH, 0);
+
+	close(fd);
+	return (args);
+}
+
+/*
+ * receive for the given number of seconds and return datagrams per second,
+ * batch == 0 selects the recvfrom() path
+ */
+static double
+run(int fd, int batch, double duration)
+{
+	static char		       bufs[MAXBATCH][BUFSIZE];
+	static struct mmsghdr	       msgs[MAXBATCH];
+	static struct iovec	       iov[MAXBATCH];
+	static struct sockaddr_storage addrs[MAXBATCH];
+	struct timespec		       timeout = { 0, 100000000 };
+	socklen_t		       sa_len;
+	pthread_t		       thr;
+	uint64_t		       count = 0;
+	double			       start, end;
+	int			       n;
+
+	for (int i = 0; i < MAXBATCH; i++) {
+		iov[i].iov_base		   = bufs[i];
+		iov[i].iov_len		   = BUFSIZE;
+		msgs[i].msg_hdr.msg_iov	   = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name   = &addrs[i];
+	}
+
+	atomic_store(&stop, false);
+	pthread_create(&thr, NULL, sender, NULL);
+
+	start = now();
+	end   = start + duration;
+	while (now() < end) {
+		if (batch == 0) {
+			sa_len = sizeof(addrs[0]);
+			if (recvfrom(fd, bufs[0], BUFSIZE, 0, (struct sockaddr *)&addrs[0],
+				&sa_len) > 0)
+				count++;
+		} else {
+			for (int i = 0; i < batch; i++)
+				msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			if ((n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, &timeout)) > 0)
+				count += n;
+		}
+	}
+	end = now();
+
+	atomic_store(&stop, true);
+	pthread_join(thr, NULL);
+
+	/* drain whatever is left in the socket buffer */
+	while (recv(fd, bufs[0], BUFSIZE, MSG_DONTWAIT) > 0)
+		;
+
+	return (count / (end - start));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int	  batches[] = { 0, 1, 8, 32, 128, 512 };
+	double	  duration  = 2.0;
+	double	  base	    = 0;
+	double	  pps;
+	socklen_t sa_len;
+	int	  fd, opt;
+	int	  rcvbuf = 8 * 1024 * 1024;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: udp_bench [-d seconds]\n");
+			exit(EX_USAGE);
+		}
+	}
+
+	if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+		err(EX_OSERR, "socket()");
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family	    = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+		err(EX_OSERR, "bind()");
+	sa_len = sizeof(dst);
+	getsockname(fd, (struct sockaddr *)&dst, &sa_len);
+
+	printf("%-10s %6s %12s %8s\n", "mode", "batch", "pkt/s", "speedup");
+	for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		pps = run(fd, batches[i], duration);
+		if (batches[i] == 0)
+			base = pps;
+		printf("%-10s %6d %12.0f %7.2fx\n", batches[i] ? "recvmmsg" : "recvfrom",
+		    batches[i] ? batches[i] : 1, pps, base > 0 ? pps / base : 0);
+	}
+
+	close(fd);
+	return (0);
+}
@@ -0,0 +1,316 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "banned.h"
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+/*
+ * Minimal io_uring through the raw system calls, for systems without
+ * liburing. Only what the listeners and the log writer need: one ring per
+ * thread, provided buffer rings for multishot receives.
+ */
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+io_uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return ((int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0));
+}
+
+static int
+io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return ((int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs));
+}
+
+/*
+ * Whether the kernel has everything the listeners use: multishot accept
+ * and provided buffer rings (5.19) and multishot recvmsg (6.0). The latter
+ * has no flag or opcode of its own, IORING_OP_SEND_ZC came with it.
+ */
+bool
+uring_supported(void)
+{
+	static const uint8_t ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_RECVMSG,
+		IORING_OP_WRITEV, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_TIMEOUT,
+		IORING_OP_SEND_ZC };
+	static int	     supported = -1;
+	struct io_uring_probe *probe;
+	struct uring	       r;
+	size_t		       size;
+
+	if (supported != -1)
+		return (supported);
+	supported = 0;
+	if (uring_init(&r, 4) < 0)
+		return (false);
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	if ((probe = calloc(1, size)) != NULL &&
+	    io_uring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		supported = 1;
+		for (size_t i = 0; i < sizeof(ops); i++) {
+			if (ops[i] > probe->last_op ||
+			    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+				supported = 0;
+		}
+	}
+	free(probe);
+	uring_free(&r);
+
+	return (supported);
+}
+
+/*
+ * Set up a ring with room for entries submissions. Completions are only
+ * reaped in uring_submit(), so the kernel may defer its work until then
+ * instead of interrupting the thread (falls back to plain rings on older
+ * kernels).
+ */
+int
+uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	int		       saved;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((r->fd = io_uring_setup(entries, &p)) < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		r->fd = io_uring_setup(entries, &p);
+	}
+	if (r->fd < 0)
+		return (-1);
+
+	r->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+
+	r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->sq_head    = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail    = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_array   = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+	r->sq_mask    = *(unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->cq_head    = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail    = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask    = *(unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes	      = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	/* submission slots map to sqes one to one */
+	for (unsigned int i = 0; i < r->sq_entries; i++)
+		r->sq_array[i] = i;
+	return (0);
+
+fail:
+	saved = errno;
+	uring_free(r);
+	errno = saved;
+	return (-1);
+}
+
+void
+uring_free(struct uring *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_size);
+	if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/*
+ * Next free submission entry, cleared. Submits what is queued first if
+ * the queue is full, returns NULL if that fails.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int	     tail = *r->sq_tail;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_submit(r, 0) < 0)
+			return (NULL);
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+			return (NULL);
+	}
+	sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+
+	return (sqe);
+}
+
+/*
+ * Submit what is queued and wait until at least wait completions are
+ * ready, all in one system call. Interrupted waits return 0.
+ */
+int
+uring_submit(struct uring *r, unsigned int wait)
+{
+	int n;
+
+	n = io_uring_enter(r->fd, r->pending, wait, IORING_ENTER_GETEVENTS);
+	if (n < 0)
+		return (errno == EINTR ? 0 : -1);
+	r->pending -= MIN((unsigned int)n, r->pending);
+	return (n);
+}
+
+/*
+ * oldest unseen completion, NULL if there is none
+ */
+struct io_uring_cqe *
+uring_peek(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	return (&r->cqes[head & r->cq_mask]);
+}
+
+/*
+ * hand the completion returned by uring_peek() back to the kernel
+ */
+void
+uring_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register count buffers of size bytes each as buffer group group.
+ */
+int
+uring_bufs_init(struct uring *r, struct uring_bufs *b, uint16_t group, unsigned int count,
+    size_t size)
+{
+	struct io_uring_buf_reg reg;
+	size_t			ringsize = count * sizeof(struct io_uring_buf);
+
+	memset(b, 0, sizeof(*b));
+	b->ring = mmap(NULL, ringsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->ring == MAP_FAILED)
+		return (-1);
+	if ((b->bufs = malloc(count * (size + 1))) == NULL) {
+		munmap(b->ring, ringsize);
+		return (-1);
+	}
+	b->size	 = size;
+	b->count = count;
+	b->group = group;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr	 = (uint64_t)(uintptr_t)b->ring;
+	reg.ring_entries = count;
+	reg.bgid	 = group;
+	if (io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		free(b->bufs);
+		munmap(b->ring, ringsize);
+		return (-1);
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		uring_bufs_put(b, i);
+	uring_bufs_commit(b);
+	return (0);
+}
+
+/*
+ * buffer bid, which has a spare byte past its size for a terminating NUL
+ */
+char *
+uring_buf(const struct uring_bufs *b, unsigned int bid)
+{
+	return (b->bufs + (size_t)bid * (b->size + 1));
+}
+
+/*
+ * give buffer bid back, the kernel sees it after uring_bufs_commit()
+ */
+void
+uring_bufs_put(struct uring_bufs *b, unsigned int bid)
+{
+	struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->count - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+	buf->len  = b->size;
+	buf->bid  = bid;
+	b->tail++;
+}
+
+void
+uring_bufs_commit(struct uring_bufs *b)
+{
+	__atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_URING */
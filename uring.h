@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2016, Babak Farrokhi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(NO_URING)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+#endif
+
+struct uring;
+
+#ifdef HAVE_URING
+
+#define URING_ENTRIES 256 /* submission queue size of the listeners */
+
+/*
+ * Submission and completion queues shared with the kernel. A ring belongs
+ * to the thread that created it.
+ */
+struct uring {
+	int		     fd;
+	unsigned int *	     sq_head;
+	unsigned int *	     sq_tail;
+	unsigned int *	     sq_array;
+	unsigned int	     sq_mask;
+	unsigned int	     sq_entries;
+	unsigned int	     pending; /* prepared but not yet submitted */
+	unsigned int *	     cq_head;
+	unsigned int *	     cq_tail;
+	unsigned int	     cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *		     sq_ring;
+	void *		     cq_ring;
+	size_t		     sq_size;
+	size_t		     cq_size;
+	size_t		     sqes_size;
+};
+
+/*
+ * Buffers provided to the kernel for multishot receives, which pick one
+ * per completion. The buffer ID comes back in the completion flags and the
+ * buffer has to be handed back with uring_bufs_put() once it is consumed.
+ */
+struct uring_bufs {
+	struct io_uring_buf_ring *ring;
+	char *			  bufs;
+	size_t			  size;	 /* bytes per buffer */
+	unsigned int		  count; /* a power of two */
+	uint16_t		  group;
+	uint16_t		  tail; /* published with uring_bufs_commit() */
+};
+
+bool		     uring_supported(void);
+int		     uring_init(struct uring *r, unsigned int entries);
+void		     uring_free(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int		     uring_submit(struct uring *r, unsigned int wait);
+struct io_uring_cqe *uring_peek(struct uring *r);
+void		     uring_seen(struct uring *r);
+int   uring_bufs_init(struct uring *r, struct uring_bufs *b, uint16_t group, unsigned int count,
+      size_t size);
+char *uring_buf(const struct uring_bufs *b, unsigned int bid);
+void  uring_bufs_put(struct uring_bufs *b, unsigned int bid);
+void  uring_bufs_commit(struct uring_bufs *b);
+
+#endif /* HAVE_URING */
+
+#endif /* _URING_H */